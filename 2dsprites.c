@@ -1,76 +1,141 @@
 #include <string.h>
 
 #include "2dsprites.h"
+#include "textureLoader.h"
+#include "traceEvents.h"
 
+// Nothing reads the failure reasons, the loader threads only need them thread local (see
+// STBI_THREAD_LOCAL in stb_image.h) because the GIF loader sets one whatever this says
+#define STBI_NO_FAILURE_STRINGS
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
-typedef struct
+// Renderables own a reference to their texture. This runs on whichever thread removed the
+// renderable, which can be a parallel for worker, so the cache only gets it back when the
+// GL thread calls ReleaseQueuedTextures
+static void ReleaseRenderable(void* component)
 {
-  GLuint glTextureId;
-  char filename[240];
-} LoadedTexture;
-
-u8 loadedTextureCount = 0;
-LoadedTexture loadedTextures[256];
+  Renderable* renderable = component;
+  if(renderable->texture != NO_TEXTURE_HANDLE)
+    QueueTextureRelease(renderable->texture);
+}
 
-GLuint LoadTexture(char* filename, u32* width, u32* height)
+__attribute__((constructor)) static void RegisterRenderableRelease()
 {
-  // Start checking textures from the last one loaded. Latest loaded is most likely to be used next?
-  u8 checkTexture = loadedTextureCount;
-  while(checkTexture--)
-    if(strcmp(filename, loadedTextures[checkTexture].filename) == 0)
-      return loadedTextures[checkTexture].glTextureId;
-
-  // We have not already loaded this texture, load and bind it now
-  int componentsPerPixel;
-  unsigned char* imageData = stbi_load(filename, width, height, &componentsPerPixel, 4);
-  LoadedTexture* texture = &loadedTextures[loadedTextureCount++];
-
-  GLuint newTexture;
-  glGenTextures(1, &newTexture);
-  DEBUG_LOG("%d", glGetError());
-  
-  glBindTexture(GL_TEXTURE_2D, newTexture);
-  DEBUG_LOG("%d", glGetError());
-
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  DEBUG_LOG("%d", glGetError());
+  SetComponentReleaseFunction(GetComponentId(Renderable), &ReleaseRenderable);
+}
 
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  DEBUG_LOG("%d", glGetError());
+// Shown until a texture has loaded, and for good if it never does
+#define PLACEHOLDER_SIZE (4)
+static u32 placeholderRegion = NO_ATLAS_REGION;
 
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-  DEBUG_LOG("%d", glGetError());
+static u32 PlaceholderRegion()
+{
+  if(placeholderRegion == NO_ATLAS_REGION)
+  {
+    u32 pixels[PLACEHOLDER_SIZE * PLACEHOLDER_SIZE];
+    u32 pixel;
+    for(pixel = 0; pixel < PLACEHOLDER_SIZE * PLACEHOLDER_SIZE; ++pixel)
+      pixels[pixel] = (((pixel / PLACEHOLDER_SIZE) + pixel) & 1) ? 0xc0ff00ff : 0xc0808080;
+    placeholderRegion = AddImageToAtlas((u8*)pixels, PLACEHOLDER_SIZE, PLACEHOLDER_SIZE);
+  }
+  return placeholderRegion;
+}
 
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-  DEBUG_LOG("%d", glGetError());
+// Blocks until the image is loaded, if it was queued in the background we do it ourselves
+// and the loader drops its copy when it turns up
+TextureHandle LoadTexture(char* filename, u32* width, u32* height)
+{
+  TRACE_ZONE("LoadTexture");
 
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, *width, *height, 0, GL_RGBA, GL_UNSIGNED_BYTE, imageData);
-  DEBUG_LOG("%d", glGetError());
+  TextureHandle texture = FindCachedTexture(filename);
+  if(texture != NO_TEXTURE_HANDLE && !TextureIsPending(texture))
+  {
+    CachedTextureSize(texture, width, height);
+    return texture;
+  }
 
-  stbi_image_free(imageData);
+  // We have not already loaded this texture, load it and pack it into the atlas now
+  int componentsPerPixel;
+  unsigned char* imageData = stbi_load(filename, (int*)width, (int*)height, &componentsPerPixel, 4);
+  u32 atlasRegion = NO_ATLAS_REGION;
+  if(imageData)
+  {
+    atlasRegion = AddImageToAtlas(imageData, *width, *height);
+    stbi_image_free(imageData);
+  }
+  else
+  {
+    DEBUG_ERR("Failed to load texture \"%s\"", filename);
+  }
+
+  if(texture != NO_TEXTURE_HANDLE)
+  {
+    FinishTextureLoad(texture, atlasRegion, *width, *height);
+    atlasGeneration++;
+    return texture;
+  }
+
+  if(atlasRegion == NO_ATLAS_REGION)
+    return NO_TEXTURE_HANDLE;
+
+  return AddCachedTexture(filename, atlasRegion, *width, *height);
+}
 
-  strcpy(texture->filename, filename);
-  texture->glTextureId = newTexture;
+TextureHandle RequestTexture(char* filename)
+{
+  TextureHandle texture = FindCachedTexture(filename);
+  if(texture != NO_TEXTURE_HANDLE)
+    return texture;
+
+  // Make sure the placeholder is in the atlas now rather than while something is drawing
+  PlaceholderRegion();
+  texture = AddPendingTexture(filename);
+  QueueTextureDecode(texture, filename);
+  return texture;
+}
 
-  return newTexture;
+void RefreshRenderableRegion(Renderable* renderable)
+{
+  renderable->atlasGeneration = atlasGeneration;
+  u32 atlasRegion = (renderable->texture == NO_TEXTURE_HANDLE) ? NO_ATLAS_REGION : CachedTextureRegion(renderable->texture);
+  if(atlasRegion == NO_ATLAS_REGION)
+    atlasRegion = PlaceholderRegion();
+
+  AtlasRegion region = AtlasRegionFor(atlasRegion);
+  renderable->textureId = region.texture;
+  renderable->uv = region.uv;
 }
 
-void SetRenderableSpriteForEntityInWorld(World* world, u32 entityId, char* filename, u32 width, u32 height)
+void SetRenderableSpriteForEntityInWorld(World* world, EntityId entityId, char* filename, u32 width, u32 height)
 {
-    u32 a, b;
-    GLuint texture = LoadTexture(filename, &a, &b);
-    Entity* entity = EntityFromWorld(world, entityId);
+    TextureHandle texture = RequestTexture(filename);
+    // Adding the component can move the entity so only look it up afterwards
     AddComponentsToEntityInWorld(world, entityId, GetComponentFlag(Renderable));
-    DEBUG_LOG("Adding texture \"%s\" to entity %d (%p)", filename, entityId, entity);
-    DEBUG_LOG("Renderable = %p", entity->renderable);
-    PrintFlagValue(Renderable);
-    entity->renderable->textureId = texture;
-    entity->renderable->width = width;
-    entity->renderable->height = height;
+    Renderable* renderable = RenderableForEntityInWorld(world, entityId);
+    DEBUG_LOG("Adding texture \"%s\" to entity "EntityIdPrintfSymbol, filename, EntityIdToPrintf(entityId));
+    DEBUG_LOG("Renderable = %p", renderable);
+    PrintComponentId(Renderable);
+    if(!renderable)
+    {
+	FreeTexture(texture);
+	return;
+    }
+
+    // Swapping one sprite for another
+    if(renderable->texture != NO_TEXTURE_HANDLE)
+	FreeTexture(renderable->texture);
+
+    renderable->texture = texture;
+    RefreshRenderableRegion(renderable);
+    renderable->width = width;
+    renderable->height = height;
+    renderable->layer = 0;
+    renderable->depth = 0;
 }
 
-void FreeTexture(GLuint texture)
+void FreeTexture(TextureHandle texture)
 {
+  if(texture != NO_TEXTURE_HANDLE)
+    ReleaseTexture(texture);
 }
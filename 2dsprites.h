@@ -4,9 +4,30 @@
 #include <GL/gl.h>
 #include "entityComponentSystem.h"
 #include "types.h"
+#include "textureAtlas.h"
+#include "textureCache.h"
 
-GLuint LoadTexture(char* filename, u32* width, u32* height);
-void SetRenderableSpriteForEntityInWorld(World* world, u32 entityId, char* filename, u32 width, u32 height);
-void FreeTexture(GLuint texture);
+// Loads an image into the texture atlas, or finds it if it is already there. The caller
+// owns a reference to the texture and gives it back with FreeTexture
+TextureHandle LoadTexture(char* filename, u32* width, u32* height);
+// The same without waiting, the texture is decoded in the background and renderables show
+// a placeholder until UploadDecodedTextures has put it in the atlas
+TextureHandle RequestTexture(char* filename);
+// Only on the GL thread, like everything else touching the texture cache
+void FreeTexture(TextureHandle texture);
+// Loads the sprite in the background
+void SetRenderableSpriteForEntityInWorld(World* world, EntityId entityId, char* filename, u32 width, u32 height);
+
+// Copies the texture and UVs from the renderable's atlas region, or the placeholder's if it
+// has none yet. Only on the GL thread, the placeholder is made the first time it is needed
+void RefreshRenderableRegion(Renderable* renderable);
+
+// Renderables keep their own copy of where their image is so drawing doesn't have to look
+// it up, this catches them up if the atlas has moved things since
+static inline void RefreshRenderable(Renderable* renderable)
+{
+    if(renderable->atlasGeneration != atlasGeneration)
+	RefreshRenderableRegion(renderable);
+}
 
 #endif
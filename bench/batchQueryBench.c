@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "entityComponentSystem.h"
+#include "movementKernels.h"
+#include "timing.h"
+
+// Gravity and movement over a million entities, an entity at a time through a function
+// pointer the way systems used to run, then a batch at a time with each level of kernels
+// the CPU supports. Half the entities have Health too so the query has two archetypes
+#define BENCH_ENTITIES (1000000)
+#define BENCH_PASSES (20)
+#define BENCH_DT (1.0f / 60.0f)
+
+typedef void (*EntityFunction)(Entity* entity, float dt);
+
+static void MoveEntity(Entity* entity, float dt)
+{
+    EntityField(entity, velocity, vy) += (dt * GRAVITY);
+    EntityField(entity, velocity, vx) = 0;
+    EntityField(entity, position, x) += (dt * EntityField(entity, velocity, vx));
+    EntityField(entity, position, y) += (dt * EntityField(entity, velocity, vy));
+}
+
+// Volatile so the call can't be inlined away
+static EntityFunction volatile moveEntity = &MoveEntity;
+
+static void MovePerEntity(World* world, ComponentFlags moving)
+{
+    BatchQuery query = BeginBatchQuery(world, moving);
+    while(NextBatchInQuery(&query))
+    {
+	Entity entity;
+	InitEntityInBatch(&entity, query.batch, query.batch->components);
+	u32 entityIdx = query.batch->entityCount;
+	while(entityIdx--)
+	{
+	    moveEntity(&entity, BENCH_DT);
+	    NextEntity(&entity);
+	}
+    }
+}
+
+static void MoveBatches(World* world, ComponentFlags moving, MovementKernels* kernels)
+{
+    BatchQuery query = BeginBatchQuery(world, moving);
+    while(NextBatchInQuery(&query))
+    {
+	kernels->applyGravity(query.batch->velocities, query.batch->entityCount, BENCH_DT);
+	kernels->moveEntities(query.batch->positions, query.batch->velocities, query.batch->entityCount, BENCH_DT);
+    }
+}
+
+// Best of the passes, in ms
+static double BestPassMs(World* world, ComponentFlags moving, MovementKernels* kernels)
+{
+    u64 bestNs = ~0ull;
+    u32 pass;
+    for(pass = 0; pass < BENCH_PASSES; ++pass)
+    {
+	u64 startNs = NowNs();
+	if(kernels)
+	    MoveBatches(world, moving, kernels);
+	else
+	    MovePerEntity(world, moving);
+	u64 passNs = NowNs() - startNs;
+	if(passNs < bestNs)
+	    bestNs = passNs;
+    }
+    return (double)bestNs / NS_PER_MS;
+}
+
+int main()
+{
+    ComponentFlags moving = ComponentMaskOf(GetComponentId(Position), GetComponentId(Velocity));
+    World* world = CreateWorld(16);
+
+    u32 idx;
+    for(idx = 0; idx < BENCH_ENTITIES; ++idx)
+	NewEntityInWorld(world, (idx & 1) ? moving : ComponentMaskUnion(moving, GetComponentFlag(Health)));
+
+    printf("%-24s %10s\n", "1M entities", "ms");
+    printf("%-24s %10.2f\n", "per entity", BestPassMs(world, moving, NULL));
+
+    KernelLevel level;
+    for(level = KernelsScalar; level <= SupportedKernelLevel(); ++level)
+    {
+	MovementKernels kernels = MovementKernelsForLevel(level);
+	char label[32];
+	snprintf(label, sizeof(label), "batches, %s", kernels.name);
+	printf("%-24s %10.2f\n", label, BestPassMs(world, moving, &kernels));
+    }
+
+    return 0;
+}
@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "entityComponentSystem.h"
+#include "movementKernels.h"
+#include "timing.h"
+
+// One row of the chunk size sweep, make bench-batch-sizes builds this once for each
+// BATCH_BYTES. Spawns a million moving entities and times gravity and movement over all
+// of them, the best pass counts so a stray interrupt doesn't
+#define BENCH_ENTITIES (1000000)
+#define BENCH_PASSES (20)
+#define BENCH_DT (1.0f / 60.0f)
+
+int main()
+{
+    ComponentFlags moving = ComponentMaskOf(GetComponentId(Position), GetComponentId(Velocity));
+    World* world = CreateWorld(16);
+
+    u64 startNs = NowNs();
+    u32 idx;
+    for(idx = 0; idx < BENCH_ENTITIES; ++idx)
+	NewEntityInWorld(world, moving);
+    double spawnNs = (double)(NowNs() - startNs) / BENCH_ENTITIES;
+
+    u32 capacity = 0;
+    u32 batchCount = 0;
+    BatchQuery query = BeginBatchQuery(world, moving);
+    while(NextBatchInQuery(&query))
+    {
+	capacity = query.batch->capacity;
+	batchCount++;
+    }
+
+    u64 bestNs = ~0ull;
+    u32 pass;
+    for(pass = 0; pass < BENCH_PASSES; ++pass)
+    {
+	startNs = NowNs();
+	query = BeginBatchQuery(world, moving);
+	while(NextBatchInQuery(&query))
+	{
+	    movementKernels.applyGravity(query.batch->velocities, query.batch->entityCount, BENCH_DT);
+	    movementKernels.moveEntities(query.batch->positions, query.batch->velocities, query.batch->entityCount, BENCH_DT);
+	}
+	u64 passNs = NowNs() - startNs;
+	if(passNs < bestNs)
+	    bestNs = passNs;
+    }
+
+    printf("%8u %10u %10u %12.1f %14.2f\n", BATCH_BYTES, capacity, batchCount, spawnNs, (double)bestNs / NS_PER_MS);
+    return 0;
+}
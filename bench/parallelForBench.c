@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "entityComponentSystem.h"
+#include "parallelFor.h"
+#include "movementKernels.h"
+#include "timing.h"
+
+// How gravity and movement over 5M entities scale with threads. One thread is the plain
+// loop with no pool, the rest go through ParallelForBatchesInQuery with the pool restarted
+// at each size. Goes up to the core count, or 4 on smaller machines so the cost of
+// splitting and stealing still shows
+#define BENCH_ENTITIES (5000000)
+#define BENCH_PASSES (10)
+#define BENCH_DT (1.0f / 60.0f)
+#define BENCH_MIN_THREADS (4)
+
+static float dt = BENCH_DT;
+
+static void MoveBatch(EntityBatch* batch, void* userData)
+{
+    float batchDt = *(float*)userData;
+    movementKernels.applyGravity(batch->velocities, batch->entityCount, batchDt);
+    movementKernels.moveEntities(batch->positions, batch->velocities, batch->entityCount, batchDt);
+}
+
+static void MoveWithoutPool(World* world, ComponentFlags moving)
+{
+    BatchQuery query = BeginBatchQuery(world, moving);
+    while(NextBatchInQuery(&query))
+	MoveBatch(query.batch, &dt);
+}
+
+// Best of the passes, in ms
+static double BestPassMs(World* world, ComponentFlags moving, u8 usePool)
+{
+    u64 bestNs = ~0ull;
+    u32 pass;
+    for(pass = 0; pass < BENCH_PASSES; ++pass)
+    {
+	u64 startNs = NowNs();
+	if(usePool)
+	    ParallelForBatchesInQuery(world, moving, &MoveBatch, &dt);
+	else
+	    MoveWithoutPool(world, moving);
+	u64 passNs = NowNs() - startNs;
+	if(passNs < bestNs)
+	    bestNs = passNs;
+    }
+    return (double)bestNs / NS_PER_MS;
+}
+
+int main()
+{
+    ComponentFlags moving = ComponentMaskOf(GetComponentId(Position), GetComponentId(Velocity));
+    World* world = CreateWorld(16);
+
+    u32 idx;
+    for(idx = 0; idx < BENCH_ENTITIES; ++idx)
+	NewEntityInWorld(world, moving);
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    u32 maxThreads = (cores > BENCH_MIN_THREADS) ? (u32)cores : BENCH_MIN_THREADS;
+    if(maxThreads > MAX_PARALLEL_FOR_WORKERS + 1)
+	maxThreads = MAX_PARALLEL_FOR_WORKERS + 1;
+
+    printf("5M entities, %ld cores, %s kernels\n", cores, movementKernels.name);
+    printf("%8s %10s %10s\n", "threads", "ms", "speedup");
+
+    double singleMs = BestPassMs(world, moving, 0);
+    printf("%8u %10.2f %10.2f\n", 1, singleMs, 1.0);
+
+    u32 threads;
+    for(threads = 2; threads <= maxThreads; ++threads)
+    {
+	StartParallelFor(threads - 1);
+	double ms = BestPassMs(world, moving, 1);
+	printf("%8u %10.2f %10.2f\n", ParallelForThreadCount(), ms, singleMs / ms);
+	StopParallelFor();
+    }
+
+    return 0;
+}
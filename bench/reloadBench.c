@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "entityComponentSystem.h"
+#include "systemScheduler.h"
+#include "timing.h"
+
+// How long a hot reload of the systems library takes. The library is replaced the way a
+// build does it, written next to the old one and renamed over it, and the loop below
+// plays the game loop calling LoadSystems until the new systems are in. Needs a debug
+// build so there is a watcher, make bench-reload sorts that out
+#define BENCH_RELOADS (20)
+#define BENCH_TIMEOUT_NS (2 * NS_PER_SECOND)
+#define BENCH_FRAME_SLEEP_US (100)
+
+static u8* ReadWholeFile(const char* path, u64* size)
+{
+    FILE* file = fopen(path, "rb");
+    if(!file)
+	return NULL;
+
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    u8* bytes = malloc(*size);
+    if(fread(bytes, 1, *size, file) != *size)
+    {
+	free(bytes);
+	bytes = NULL;
+    }
+    fclose(file);
+    return bytes;
+}
+
+static u8 ReplaceFile(const char* path, u8* bytes, u64 size)
+{
+    char nextPath[4096];
+    snprintf(nextPath, sizeof(nextPath), "%s.next", path);
+
+    FILE* file = fopen(nextPath, "wb");
+    if(!file)
+	return 0;
+    u8 written = (fwrite(bytes, 1, size, file) == size);
+    fclose(file);
+
+    return written && !rename(nextPath, path);
+}
+
+typedef struct
+{
+    double total;
+    double worst;
+} Timing;
+
+static void AddTiming(Timing* timing, double ms)
+{
+    timing->total += ms;
+    if(ms > timing->worst)
+	timing->worst = ms;
+}
+
+static void PrintTiming(const char* label, Timing* timing, u32 count)
+{
+    printf("%-28s %10.3f %10.3f\n", label, timing->total / count, timing->worst);
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 2)
+    {
+	printf("Usage: %s path/to/entitySystems.so\n", argv[0]);
+	return 1;
+    }
+
+    u64 size;
+    u8* library = ReadWholeFile(argv[1], &size);
+    if(!library)
+    {
+	printf("Can't read \"%s\"\n", argv[1]);
+	return 1;
+    }
+
+    World* world = CreateWorld(16);
+    LoadSystems(argv[1]);
+    RunSimulationSystems(world);
+
+    Timing stage = {0, 0};
+    Timing open = {0, 0};
+    Timing load = {0, 0};
+    Timing latency = {0, 0};
+    Timing replaced = {0, 0};
+    u32 reloads = 0;
+    u32 missed = 0;
+
+    u32 attempt;
+    for(attempt = 0; attempt < BENCH_RELOADS; ++attempt)
+    {
+	u32 reloadCount = LastSystemReloadStats().reloadCount;
+	u64 replacedNs = NowNs();
+	if(!ReplaceFile(argv[1], library, size))
+	{
+	    printf("Can't replace \"%s\"\n", argv[1]);
+	    return 1;
+	}
+
+	while(LastSystemReloadStats().reloadCount == reloadCount && NowNs() - replacedNs < BENCH_TIMEOUT_NS)
+	{
+	    LoadSystems(argv[1]);
+	    RunSimulationSystems(world);
+	    usleep(BENCH_FRAME_SLEEP_US);
+	}
+
+	SystemReloadStats stats = LastSystemReloadStats();
+	if(stats.reloadCount == reloadCount)
+	{
+	    missed++;
+	    continue;
+	}
+
+	AddTiming(&stage, stats.stageMs);
+	AddTiming(&open, stats.openMs);
+	AddTiming(&load, stats.loadMs);
+	AddTiming(&latency, stats.latencyMs);
+	AddTiming(&replaced, (double)(NowNs() - replacedNs) / NS_PER_MS);
+	reloads++;
+    }
+
+    printf("%u reloads of %llu bytes, %u missed\n", reloads, (unsigned long long)size, missed);
+    if(reloads)
+    {
+	printf("%-28s %10s %10s\n", "", "mean ms", "worst ms");
+	PrintTiming("staging", &stage, reloads);
+	PrintTiming("opening", &open, reloads);
+	PrintTiming("resolving and scheduling", &load, reloads);
+	PrintTiming("noticed to running", &latency, reloads);
+	PrintTiming("replaced to running", &replaced, reloads);
+    }
+
+    StopWatchingSystems();
+    StopSystemScheduler();
+    free(library);
+    return missed ? 1 : 0;
+}
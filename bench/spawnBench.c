@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "entityComponentSystem.h"
+#include "timing.h"
+
+// How long spawning takes as worlds get bigger, it should stay flat. Each size is spawned
+// into a fresh world (which has to grow as it goes), destroyed, then spawned again into
+// the slots that frees up
+#define MAX_ENTITIES (10000000)
+
+static EntityId* entities;
+
+static double SpawnNs(World* world, u32 count)
+{
+    u64 startNs = NowNs();
+    u32 idx;
+    for(idx = 0; idx < count; ++idx)
+	entities[idx] = NewEntityInWorld(world, ComponentMaskOf(GetComponentId(Position), GetComponentId(Velocity)));
+    return (double)(NowNs() - startNs) / count;
+}
+
+static double DestroyNs(World* world, u32 count)
+{
+    u64 startNs = NowNs();
+    u32 idx;
+    for(idx = 0; idx < count; ++idx)
+	DestroyEntityInWorld(world, entities[idx]);
+    return (double)(NowNs() - startNs) / count;
+}
+
+int main()
+{
+    entities = malloc(MAX_ENTITIES * sizeof(EntityId));
+
+    printf("%10s %14s %14s %14s\n", "entities", "spawn ns", "destroy ns", "respawn ns");
+
+    u32 count;
+    for(count = 1000; count <= MAX_ENTITIES; count *= 10)
+    {
+	// Worlds can't be freed, the biggest is only a few hundred MB so let them go
+	World* world = CreateWorld(16);
+	double spawnNs = SpawnNs(world, count);
+	double destroyNs = DestroyNs(world, count);
+	double respawnNs = SpawnNs(world, count);
+	printf("%10u %14.1f %14.1f %14.1f\n", count, spawnNs, destroyNs, respawnNs);
+    }
+
+    free(entities);
+    return 0;
+}
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/gl.h>
+
+#include "entityComponentSystem.h"
+#include "spriteBatch.h"
+#include "textureAtlas.h"
+#include "timing.h"
+
+// Drawing 10K and 100K small blended sprites, a glBegin/glEnd each the way the render
+// system used to, then through the sprite batch. Runs offscreen on a surfaceless EGL
+// context so it works without a window, which with Mesa usually means llvmpipe and the
+// rasterising shows up in both
+#define BENCH_FRAMES (10)
+#define BENCH_VIEW_SIZE (512)
+#define BENCH_SPRITE_SIZE (8)
+
+static u8 StartOffscreenGL()
+{
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if(!getPlatformDisplay)
+	return 0;
+
+    EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if(display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL))
+	return 0;
+
+    EGLint configAttributes[] = {EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_RED_SIZE, 8, EGL_NONE};
+    EGLConfig config;
+    EGLint configCount;
+    if(!eglChooseConfig(display, configAttributes, &config, 1, &configCount) || !configCount)
+	return 0;
+
+    EGLint surfaceAttributes[] = {EGL_WIDTH, BENCH_VIEW_SIZE, EGL_HEIGHT, BENCH_VIEW_SIZE, EGL_NONE};
+    EGLSurface surface = eglCreatePbufferSurface(display, config, surfaceAttributes);
+    eglBindAPI(EGL_OPENGL_API);
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+    if(surface == EGL_NO_SURFACE || context == EGL_NO_CONTEXT || !eglMakeCurrent(display, surface, surface, context))
+	return 0;
+
+    // The same setup main does
+    glViewport(0, 0, BENCH_VIEW_SIZE, BENCH_VIEW_SIZE);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0, BENCH_VIEW_SIZE, BENCH_VIEW_SIZE, 0, -100, 100);
+    glMatrixMode(GL_MODELVIEW);
+    glEnable(GL_TEXTURE_2D);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    return 1;
+}
+
+static void DrawImmediate(World* world, ComponentFlags drawn)
+{
+    BatchQuery query = BeginBatchQuery(world, drawn);
+    while(NextBatchInQuery(&query))
+    {
+	Entity entity;
+	InitEntityInBatch(&entity, query.batch, query.batch->components);
+	u32 entityIdx = query.batch->entityCount;
+	while(entityIdx--)
+	{
+	    Renderable* renderable = entity.renderable;
+	    glBindTexture(GL_TEXTURE_2D, renderable->textureId);
+	    glPushMatrix();
+	    glTranslatef(EntityField(&entity, position, x), EntityField(&entity, position, y), 0);
+	    glBegin(GL_QUADS);
+	    glTexCoord2f(renderable->uv.u0, renderable->uv.v0);
+	    glVertex2f(0, 0);
+	    glTexCoord2f(renderable->uv.u1, renderable->uv.v0);
+	    glVertex2f(renderable->width, 0);
+	    glTexCoord2f(renderable->uv.u1, renderable->uv.v1);
+	    glVertex2f(renderable->width, renderable->height);
+	    glTexCoord2f(renderable->uv.u0, renderable->uv.v1);
+	    glVertex2f(0, renderable->height);
+	    glEnd();
+	    glPopMatrix();
+	    NextEntity(&entity);
+	}
+    }
+}
+
+static void DrawBatched(World* world, ComponentFlags drawn)
+{
+    BeginSpriteBatch();
+    BatchQuery query = BeginBatchQuery(world, drawn);
+    while(NextBatchInQuery(&query))
+    {
+	Entity entity;
+	InitEntityInBatch(&entity, query.batch, query.batch->components);
+	u32 entityIdx = query.batch->entityCount;
+	while(entityIdx--)
+	{
+	    Renderable* renderable = entity.renderable;
+	    DrawSprite(renderable->textureId, renderable->uv, EntityField(&entity, position, x), EntityField(&entity, position, y), renderable->width, renderable->height);
+	    NextEntity(&entity);
+	}
+    }
+    EndSpriteBatch();
+}
+
+// Average ms a frame, glFinish so the GL work is counted and not just queueing it
+static double FrameMs(World* world, ComponentFlags drawn, u8 batched)
+{
+    u64 startNs = NowNs();
+    u32 frame;
+    for(frame = 0; frame < BENCH_FRAMES; ++frame)
+    {
+	glClear(GL_COLOR_BUFFER_BIT);
+	glLoadIdentity();
+	if(batched)
+	    DrawBatched(world, drawn);
+	else
+	    DrawImmediate(world, drawn);
+	glFinish();
+    }
+    return (double)(NowNs() - startNs) / BENCH_FRAMES / NS_PER_MS;
+}
+
+int main()
+{
+    if(!StartOffscreenGL())
+    {
+	printf("No offscreen GL context, skipping the sprite benchmark\n");
+	return 0;
+    }
+    printf("Drawing with %s\n", glGetString(GL_RENDERER));
+
+    u32 pixels[BENCH_SPRITE_SIZE * BENCH_SPRITE_SIZE];
+    u32 pixel;
+    for(pixel = 0; pixel < BENCH_SPRITE_SIZE * BENCH_SPRITE_SIZE; ++pixel)
+	pixels[pixel] = 0x80ffffff;
+    AtlasRegion region = AtlasRegionFor(AddImageToAtlas((u8*)pixels, BENCH_SPRITE_SIZE, BENCH_SPRITE_SIZE));
+
+    ComponentFlags drawn = ComponentMaskOf(GetComponentId(Position), GetComponentId(Renderable));
+    printf("%8s %14s %12s %14s %12s\n", "sprites", "immediate ms", "draw calls", "batched ms", "draw calls");
+
+    u32 spriteCount;
+    for(spriteCount = 10000; spriteCount <= 100000; spriteCount *= 10)
+    {
+	World* world = CreateWorld(16);
+	u32 idx;
+	for(idx = 0; idx < spriteCount; ++idx)
+	{
+	    Entity entity = EntityFromWorld(world, NewEntityInWorld(world, drawn));
+	    EntityField(&entity, position, x) = (float)((idx * 37) % (BENCH_VIEW_SIZE - BENCH_SPRITE_SIZE));
+	    EntityField(&entity, position, y) = (float)((idx * 91) % (BENCH_VIEW_SIZE - BENCH_SPRITE_SIZE));
+	    entity.renderable->texture = 0;
+	    entity.renderable->textureId = region.texture;
+	    entity.renderable->uv = region.uv;
+	    entity.renderable->width = BENCH_SPRITE_SIZE;
+	    entity.renderable->height = BENCH_SPRITE_SIZE;
+	}
+
+	double immediateMs = FrameMs(world, drawn, 0);
+	double batchedMs = FrameMs(world, drawn, 1);
+	printf("%8u %14.2f %12u %14.2f %12u\n", spriteCount, immediateMs, spriteCount, batchedMs, LastSpriteBatchStats().drawCalls);
+    }
+
+    FreeSpriteBatch();
+    FreeTextureAtlas();
+    return 0;
+}
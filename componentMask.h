@@ -0,0 +1,138 @@
+#ifndef __COMPONENT_MASK_H__
+#define __COMPONENT_MASK_H__
+
+#include <string.h>
+#include <inttypes.h>
+
+#include "types.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Components are identified by their index in the component registry and sets of them
+// are stored as a bit per component
+#define ComponentId u16
+#define MAX_COMPONENT_TYPES (256)
+#define COMPONENT_MASK_WORDS (MAX_COMPONENT_TYPES/64)
+
+// Aligned so the mask can be pulled straight into SSE registers, 32 byte alignment would
+// let AVX use aligned loads too but changes how masks get passed around by value
+typedef struct
+{
+    u64 bits[COMPONENT_MASK_WORDS];
+} __attribute__((aligned(16))) ComponentMask;
+
+// Prints the whole mask as hex, highest word first
+#define ComponentMaskPrintfSymbol "%016"PRIx64"%016"PRIx64"%016"PRIx64"%016"PRIx64
+#define ComponentMaskToPrintf(mask) (mask).bits[3],(mask).bits[2],(mask).bits[1],(mask).bits[0]
+
+static inline ComponentMask EmptyComponentMask()
+{
+    ComponentMask ret;
+    memset(&ret, 0, sizeof(ret));
+    return ret;
+}
+
+static inline ComponentMask ComponentMaskFromId(ComponentId id)
+{
+    ComponentMask ret = EmptyComponentMask();
+    ret.bits[id >> 6] = ((u64)1) << (id & 63);
+    return ret;
+}
+
+static inline ComponentMask ComponentMaskFromIds(u32 idCount, const ComponentId* ids)
+{
+    ComponentMask ret = EmptyComponentMask();
+    while(idCount--)
+    {
+	ret.bits[ids[idCount] >> 6] |= ((u64)1) << (ids[idCount] & 63);
+    }
+    return ret;
+}
+
+// Build a mask from any number of component ids, eg ComponentMaskOf(GetComponentId(Position), GetComponentId(Velocity))
+#define ComponentMaskOf(...) ComponentMaskFromIds(sizeof((ComponentId[]){__VA_ARGS__})/sizeof(ComponentId), (ComponentId[]){__VA_ARGS__})
+
+static inline u8 ComponentMaskHasId(ComponentMask mask, ComponentId id)
+{
+    return (mask.bits[id >> 6] >> (id & 63)) & 1;
+}
+
+static inline ComponentMask ComponentMaskUnion(ComponentMask a, ComponentMask b)
+{
+    u32 word;
+    for(word = 0; word < COMPONENT_MASK_WORDS; ++word)
+	a.bits[word] |= b.bits[word];
+    return a;
+}
+
+// Everything in a which is not in b
+static inline ComponentMask ComponentMaskWithout(ComponentMask a, ComponentMask b)
+{
+    u32 word;
+    for(word = 0; word < COMPONENT_MASK_WORDS; ++word)
+	a.bits[word] &= ~b.bits[word];
+    return a;
+}
+
+// Do a and b have any components in common?
+static inline u8 ComponentMaskOverlaps(ComponentMask a, ComponentMask b)
+{
+    u64 common = 0;
+    u32 word;
+    for(word = 0; word < COMPONENT_MASK_WORDS; ++word)
+	common |= a.bits[word] & b.bits[word];
+    return common != 0;
+}
+
+// The query matching test, does mask have every component in required?
+// This runs for every batch a query looks at so it gets the SIMD treatment
+static inline u8 ComponentMaskContains(ComponentMask mask, ComponentMask required)
+{
+#if defined(__AVX2__)
+    __m256i have = _mm256_loadu_si256((const __m256i*)mask.bits);
+    __m256i want = _mm256_loadu_si256((const __m256i*)required.bits);
+    return _mm256_testc_si256(have, want);
+#elif defined(__SSE2__)
+    __m128i wantLow = _mm_load_si128((const __m128i*)required.bits);
+    __m128i wantHigh = _mm_load_si128((const __m128i*)(required.bits + 2));
+    __m128i matchLow = _mm_cmpeq_epi8(_mm_and_si128(_mm_load_si128((const __m128i*)mask.bits), wantLow), wantLow);
+    __m128i matchHigh = _mm_cmpeq_epi8(_mm_and_si128(_mm_load_si128((const __m128i*)(mask.bits + 2)), wantHigh), wantHigh);
+    return _mm_movemask_epi8(_mm_and_si128(matchLow, matchHigh)) == 0xffff;
+#else
+    u32 word;
+    for(word = 0; word < COMPONENT_MASK_WORDS; ++word)
+	if((mask.bits[word] & required.bits[word]) != required.bits[word])
+	    return 0;
+    return 1;
+#endif
+}
+
+static inline u8 ComponentMaskEqual(ComponentMask a, ComponentMask b)
+{
+#if defined(__AVX2__)
+    __m256i diff = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)a.bits), _mm256_loadu_si256((const __m256i*)b.bits));
+    return _mm256_testz_si256(diff, diff);
+#elif defined(__SSE2__)
+    __m128i matchLow = _mm_cmpeq_epi8(_mm_load_si128((const __m128i*)a.bits), _mm_load_si128((const __m128i*)b.bits));
+    __m128i matchHigh = _mm_cmpeq_epi8(_mm_load_si128((const __m128i*)(a.bits + 2)), _mm_load_si128((const __m128i*)(b.bits + 2)));
+    return _mm_movemask_epi8(_mm_and_si128(matchLow, matchHigh)) == 0xffff;
+#else
+    return memcmp(a.bits, b.bits, sizeof(a.bits)) == 0;
+#endif
+}
+
+// Fold the mask down to something we can index a hash table with
+static inline u32 HashComponentMask(ComponentMask mask)
+{
+    u64 hash = 0;
+    u32 word;
+    for(word = 0; word < COMPONENT_MASK_WORDS; ++word)
+	hash = (hash ^ mask.bits[word]) * 0x9e3779b97f4a7c15;
+    return (u32)(hash >> 32);
+}
+
+#endif
@@ -1,4 +1,5 @@
 #define NO_PRINT
+#define _GNU_SOURCE
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -6,30 +7,319 @@
 #include <sys/stat.h>
 #include <dlfcn.h>
 #include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
 
 #include "logging.h"
 
 #include "entityComponentSystem.h"
+#include "systemScheduler.h"
+#include "systemDependencies.h"
+#include "systemProfiler.h"
+#include "libraryWatcher.h"
+#include "traceEvents.h"
+#include "timing.h"
 
 // Initialise component values
-SetValueForComponentFlag(Allocated)
-SetValueForComponentFlag(Position)
-SetValueForComponentFlag(Velocity)
-SetValueForComponentFlag(Health)
-SetValueForComponentFlag(Gravity)
-SetValueForComponentFlag(Renderable)
+SetIdForComponent(Allocated)
+SetIdForComponent(Position)
+SetIdForComponent(Velocity)
+SetIdForComponent(Health)
+SetIdForComponent(Gravity)
+SetIdForComponent(Renderable)
+SetIdForComponent(PreviousPosition)
+
+// Everything we know about component types, built in ones are filled in before main runs.
+// Types are only ever added to the end and never change once they are counted, so anything
+// below the count can be read without the lock. Registering takes it, a systems library
+// being prepared on the watcher thread can be registering while the main thread builds
+// archetypes
+static ComponentType componentTypes[MAX_COMPONENT_TYPES];
+static au32 componentTypeCount = 0;
+static pthread_mutex_t componentRegistryLock = PTHREAD_MUTEX_INITIALIZER;
+// Kept apart from the types so registering a component never loses its release function
+static ComponentReleaseFunction componentReleaseFunctions[MAX_COMPONENT_TYPES];
+
+#define RegisterBuiltInComponent(name, size, alignment, fieldSize)	\
+    componentTypes[GetComponentId(name)] = (ComponentType){#name, size, alignment, fieldSize}; \
+    if(componentTypeCount <= GetComponentId(name))			\
+	componentTypeCount = GetComponentId(name) + 1;
+
+// Position and Velocity are all floats so split into a float per field
+#ifdef SOA_COMPONENTS
+#define SPLIT_FIELD_SIZE (sizeof(float))
+#else
+#define SPLIT_FIELD_SIZE (0)
+#endif
 
-// Allocate a new batch of entities and mark all entities as having no components
-EntityBatch* CreateEntityBatch()
+__attribute__((constructor)) static void RegisterBuiltInComponents()
 {
-    DEBUG_LOG("Creating new entity batch");
-    EntityBatch* ret = (EntityBatch*)malloc(sizeof(EntityBatch));
+    RegisterBuiltInComponent(Allocated, 0, 1, 0);
+    RegisterBuiltInComponent(Position, sizeof(Position), _Alignof(Position), SPLIT_FIELD_SIZE);
+    RegisterBuiltInComponent(Velocity, sizeof(Velocity), _Alignof(Velocity), SPLIT_FIELD_SIZE);
+    RegisterBuiltInComponent(Health, sizeof(Health), _Alignof(Health), 0);
+    RegisterBuiltInComponent(Gravity, 0, 1, 0);
+    RegisterBuiltInComponent(Renderable, sizeof(Renderable), _Alignof(Renderable), 0);
+    RegisterBuiltInComponent(PreviousPosition, sizeof(Position), _Alignof(Position), SPLIT_FIELD_SIZE);
+}
 
-    u32 idx;
-    for(idx = 0; idx < BATCH_SIZE; ++idx)
-	ret->entityComponents[idx] = 0;
+static inline u32 RoundUpToCacheLine(u32 bytes)
+{
+    return (bytes + CACHE_LINE_BYTES - 1) & ~(CACHE_LINE_BYTES - 1);
+}
+
+// The biggest component that still leaves room for the smallest batch of entities having
+// nothing else, their ids and the padding after each array included
+#define MAX_COMPONENT_BYTES ((BATCH_BYTES - BATCH_HEADER_BYTES - RoundUpToCacheLine(BATCH_CAPACITY_GRANULARITY * sizeof(u32))) / BATCH_CAPACITY_GRANULARITY)
+
+static ComponentId RegisterComponentTypeLocked(const char* name, u32 size, u32 alignment)
+{
+    u32 typeCount = atomic_load_explicit(&componentTypeCount, memory_order_relaxed);
+    ComponentId id;
+    for(id = 0; id < typeCount; ++id)
+    {
+	if(strcmp(componentTypes[id].name, name) != 0)
+	    continue;
+
+	if(componentTypes[id].size != size || componentTypes[id].alignment != alignment)
+	{
+	    DEBUG_ERR("Component \"%s\" re-registered with a different layout", name);
+	    return NO_COMPONENT_ID;
+	}
+	return id;
+    }
+
+    if(typeCount == MAX_COMPONENT_TYPES)
+    {
+	DEBUG_ERR("Unable to register component \"%s\", all %d component ids are in use", name, MAX_COMPONENT_TYPES);
+	return NO_COMPONENT_ID;
+    }
+
+    // Arrays are only ever cache line aligned
+    if(alignment > CACHE_LINE_BYTES)
+    {
+	DEBUG_ERR("Component \"%s\" wants %d byte alignment, only %d is supported", name, alignment, CACHE_LINE_BYTES);
+	return NO_COMPONENT_ID;
+    }
+
+    if(size > MAX_COMPONENT_BYTES)
+    {
+	DEBUG_ERR("Component \"%s\" is %d bytes, batches can't hold components over %d bytes", name, size, (u32)MAX_COMPONENT_BYTES);
+	return NO_COMPONENT_ID;
+    }
+
+    // Keep our own copy of the name, it may live in a library which gets unloaded
+    char* nameCopy = malloc(strlen(name) + 1);
+    strcpy(nameCopy, name);
+
+    // Only counted once it is all there
+    id = typeCount;
+    componentTypes[id] = (ComponentType){nameCopy, size, alignment, 0};
+    atomic_store_explicit(&componentTypeCount, typeCount + 1, memory_order_release);
+
+    DEBUG_LOG("Registered component \"%s\" with id %d (%d bytes)", name, id, size);
+
+    return id;
+}
+
+// Hand out an id for a new component type, or the old one if we have seen this name before
+ComponentId RegisterComponentType(const char* name, u32 size, u32 alignment)
+{
+    pthread_mutex_lock(&componentRegistryLock);
+    ComponentId id = RegisterComponentTypeLocked(name, size, alignment);
+    pthread_mutex_unlock(&componentRegistryLock);
+    return id;
+}
+
+const ComponentType* ComponentTypeFromId(ComponentId id)
+{
+    return (id < atomic_load_explicit(&componentTypeCount, memory_order_acquire)) ? &componentTypes[id] : NULL;
+}
+
+u32 RegisteredComponentTypeCount()
+{
+    return atomic_load_explicit(&componentTypeCount, memory_order_acquire);
+}
+
+void SetComponentReleaseFunction(ComponentId id, ComponentReleaseFunction release)
+{
+    if(id >= MAX_COMPONENT_TYPES || componentTypes[id].fieldSize)
+    {
+	DEBUG_ERR("Component %d can't have a release function", id);
+	return;
+    }
+    componentReleaseFunctions[id] = release;
+}
+
+// A component stored whole is just one big field
+static inline u32 ComponentFieldSize(ComponentId component)
+{
+    return componentTypes[component].fieldSize ? componentTypes[component].fieldSize : componentTypes[component].size;
+}
+
+static inline u32 ComponentFieldCount(ComponentId component)
+{
+    return componentTypes[component].size / ComponentFieldSize(component);
+}
+
+// Bytes from one field's array to the next, every field array starts on its own cache line
+static inline u32 ComponentFieldStride(ComponentId component, u32 capacity)
+{
+    return RoundUpToCacheLine(capacity * ComponentFieldSize(component));
+}
+
+// Work out where every array of an archetype goes in a batch and how many entities fit,
+// returns the number of bytes the layout needs
+static u32 LayoutArchetype(Archetype* archetype, u32 capacity)
+{
+    // Entity ids come first, straight after the header
+    u32 offset = BATCH_HEADER_BYTES + RoundUpToCacheLine(capacity * sizeof(u32));
+
+    u32 dataIdx;
+    for(dataIdx = 0; dataIdx < archetype->dataComponentCount; ++dataIdx)
+    {
+	ComponentId component = archetype->dataComponents[dataIdx];
+	archetype->componentOffsets[component] = offset;
+	offset += ComponentFieldCount(component) * ComponentFieldStride(component, capacity);
+    }
+
+    return offset;
+}
+
+// Find the components of an archetype which need storage and fit as many entities as we can
+// into a batch, returns 0 if not even the smallest batch of them fits
+static u8 BuildArchetypeLayout(Archetype* archetype)
+{
+    memset(archetype->componentOffsets, 0, sizeof(archetype->componentOffsets));
+    archetype->dataComponentCount = 0;
+
+    u32 bytesPerEntity = sizeof(u32);
+    u32 typeCount = atomic_load_explicit(&componentTypeCount, memory_order_acquire);
+    ComponentId component;
+    for(component = 0; component < typeCount; ++component)
+    {
+	if(!ComponentMaskHasId(archetype->components, component) || !componentTypes[component].size)
+	    continue;
+
+	archetype->dataComponents[archetype->dataComponentCount++] = component;
+	bytesPerEntity += componentTypes[component].size;
+    }
+
+    // Start from the best case and back off until the cache line padding fits too
+    u32 capacity = (BATCH_BYTES - BATCH_HEADER_BYTES) / bytesPerEntity;
+    capacity -= (capacity % BATCH_CAPACITY_GRANULARITY);
+    while(capacity > BATCH_CAPACITY_GRANULARITY && LayoutArchetype(archetype, capacity) > BATCH_BYTES)
+	capacity -= BATCH_CAPACITY_GRANULARITY;
+
+    // Every component fits on its own but enough of them together can still be too much
+    if(!capacity || LayoutArchetype(archetype, capacity) > BATCH_BYTES)
+    {
+	DEBUG_ERR("Archetype needs %d bytes per entity, too big for a %d byte batch", bytesPerEntity, BATCH_BYTES);
+	return 0;
+    }
+
+    archetype->batchCapacity = capacity;
+    return 1;
+}
+
+void* ComponentArrayInBatch(EntityBatch* batch, ComponentId component)
+{
+    if(component >= MAX_COMPONENT_TYPES)
+	return NULL;
+
+    u32 offset = batch->archetype->componentOffsets[component];
+    return offset ? (u8*)batch + offset : NULL;
+}
+
+void* ComponentFieldArrayInBatch(EntityBatch* batch, ComponentId component, u32 field)
+{
+    if(component >= MAX_COMPONENT_TYPES)
+	return NULL;
+
+    u32 offset = batch->archetype->componentOffsets[component];
+    if(!offset || field >= ComponentFieldCount(component))
+	return NULL;
+
+    return (u8*)batch + offset + (field * ComponentFieldStride(component, batch->capacity));
+}
+
+// Typed views of the built in arrays, split components point at the start of each field's
+// array and come back all NULL when the batch doesn't have the component
+#ifdef SOA_COMPONENTS
+static inline PositionArray PositionArrayInBatch(EntityBatch* batch, ComponentId component)
+{
+    PositionArray ret;
+    ret.x = ComponentFieldArrayInBatch(batch, component, 0);
+    ret.y = ComponentFieldArrayInBatch(batch, component, 1);
+    return ret;
+}
+
+static inline VelocityArray VelocityArrayInBatch(EntityBatch* batch)
+{
+    VelocityArray ret;
+    ret.vx = ComponentFieldArrayInBatch(batch, GetComponentId(Velocity), 0);
+    ret.vy = ComponentFieldArrayInBatch(batch, GetComponentId(Velocity), 1);
+    ret.vxMax = ComponentFieldArrayInBatch(batch, GetComponentId(Velocity), 2);
+    ret.vyMax = ComponentFieldArrayInBatch(batch, GetComponentId(Velocity), 3);
+    return ret;
+}
+
+static inline PositionArray PositionArrayFrom(PositionArray positions, u32 entityIdx)
+{
+    if(positions.x)
+    {
+	positions.x += entityIdx;
+	positions.y += entityIdx;
+    }
+    return positions;
+}
+
+static inline VelocityArray VelocityArrayFrom(VelocityArray velocities, u32 entityIdx)
+{
+    if(velocities.vx)
+    {
+	velocities.vx += entityIdx;
+	velocities.vy += entityIdx;
+	velocities.vxMax += entityIdx;
+	velocities.vyMax += entityIdx;
+    }
+    return velocities;
+}
+
+static const PositionArray noPositions = {0};
+static const VelocityArray noVelocities = {0};
+#else
+#define PositionArrayInBatch(batch, component) ((Position*)ComponentArrayInBatch(batch, component))
+#define VelocityArrayInBatch(batch) ((Velocity*)ComponentArrayInBatch(batch, GetComponentId(Velocity)))
+#define PositionArrayFrom(positions, entityIdx) ((positions) ? (positions) + (entityIdx) : NULL)
+#define VelocityArrayFrom(velocities, entityIdx) ((velocities) ? (velocities) + (entityIdx) : NULL)
+#define noPositions ((Position*)NULL)
+#define noVelocities ((Velocity*)NULL)
+#endif
+
+// Allocate a new, empty batch which can only hold entities with exactly the given components
+EntityBatch* CreateEntityBatch(Archetype* archetype)
+{
+    DEBUG_LOG("Creating new entity batch for components "ComponentMaskPrintfSymbol" holding %d entities", ComponentMaskToPrintf(archetype->components), archetype->batchCapacity);
+    EntityBatch* ret = (EntityBatch*)aligned_alloc(CACHE_LINE_BYTES, BATCH_BYTES);
 
+    ret->components = archetype->components;
     ret->entityCount = 0;
+    ret->capacity = archetype->batchCapacity;
+    ret->nextBatchWithSpace = NO_BATCH;
+    ret->archetype = archetype;
+
+    // Arrays live on the cache lines following the batch header
+    ret->entityIds = (u32*)((u8*)ret + BATCH_HEADER_BYTES);
+    ret->positions = PositionArrayInBatch(ret, GetComponentId(Position));
+    ret->previousPositions = PositionArrayInBatch(ret, GetComponentId(PreviousPosition));
+    ret->velocities = VelocityArrayInBatch(ret);
+    ret->healths = ComponentArrayInBatch(ret, GetComponentId(Health));
+    ret->renderables = ComponentArrayInBatch(ret, GetComponentId(Renderable));
 
     return ret;
 }
@@ -37,248 +327,539 @@ EntityBatch* CreateEntityBatch()
 // Create a world with enough space to hold a given number of entities
 World* CreateWorld(u32 entityCount)
 {
-    // How many batches will we fill?
-    u32 batchCount = (entityCount/BATCH_SIZE);
-
-    batchCount += ((entityCount % BATCH_SIZE) != 0); // Do we have any extras
+    // We don't know the archetypes yet so we can't make any batches, just
+    // reserve enough room to track them and the entities that will live in them
+    u32 batchCapacity = (entityCount/MIN_BATCH_CAPACITY) + 1;
 
-    DEBUG_LOG("Creating world with capacity for %d entities in %d batches", entityCount, batchCount);
+    DEBUG_LOG("Creating world with capacity for %d entities in %d batches", entityCount, batchCapacity);
   
     // Allocate the memory for our info and enough pointers to hold our batches
     World* ret = (World*)malloc(sizeof(World));
-    ret->batches = (EntityBatch**)malloc(batchCount * sizeof(EntityBatch*));
-    ret->batchCount = batchCount;
+    ret->batches = (EntityBatch**)malloc(batchCapacity * sizeof(EntityBatch*));
+    ret->batchCount = 0;
+    ret->batchCapacity = batchCapacity;
+
+    ret->entityLocations = (EntityLocation*)malloc((entityCount + 1) * sizeof(EntityLocation));
+    ret->entityCount = 0;
+    ret->entityIndexCount = 0;
+    ret->entityCapacity = entityCount + 1;
+    ret->firstFreeEntityIndex = NO_BATCH;
+
+    ret->archetypeCount = 0;
+    ret->archetypeCapacity = 16;
+    ret->archetypes = (Archetype**)malloc(ret->archetypeCapacity * sizeof(Archetype*));
+    ret->archetypeLookup = (u32*)calloc(ret->archetypeCapacity * 2, sizeof(u32));
   
     ret->lastTickDt = 0.033f;
-
-    // Create our batches
-    while(batchCount--)
-	ret->batches[batchCount] = CreateEntityBatch();
+    ret->lastFrameDt = 0.033f;
+    ret->interpolation = 1.0f;
 
     return ret;
 }
 
 void InitEntityInBatch(Entity* entity, EntityBatch* batch, ComponentFlags flags)
 {
-    entity->components = batch->entityComponents;
-    entity->position = HasComponent(flags, Position) ? batch->positions : NULL;
-    entity->velocity = HasComponent(flags, Velocity) ? batch->velocities : NULL;
+    // All entities in a batch share their flags so this never moves
+    entity->components = &batch->components;
+    entity->position = HasComponent(flags, Position) ? batch->positions : noPositions;
+    entity->previousPosition = HasComponent(flags, PreviousPosition) ? batch->previousPositions : noPositions;
+    entity->velocity = HasComponent(flags, Velocity) ? batch->velocities : noVelocities;
     entity->health = HasComponent(flags, Health) ? batch->healths : NULL;
     entity->renderable = HasComponent(flags, Renderable) ? batch->renderables : NULL;
 }
 
 void NextEntity(Entity* entity)
 {
-    entity->components++;
-    if(entity->position) entity->position++;
-    if(entity->velocity) entity->velocity++;
+    entity->position = PositionArrayFrom(entity->position, 1);
+    entity->previousPosition = PositionArrayFrom(entity->previousPosition, 1);
+    entity->velocity = VelocityArrayFrom(entity->velocity, 1);
     if(entity->health) entity->health++;
     if(entity->renderable) entity->renderable++;
 }
 
+// Is this id still referring to a live entity?
+u8 EntityIsValidInWorld(World* world, EntityId entityId)
+{
+    u32 entityIdx = EntityIndex(entityId);
+    if(entityIdx >= world->entityIndexCount)
+	return 0;
+
+    EntityLocation* location = &world->entityLocations[entityIdx];
+    return (location->generation == EntityGeneration(entityId)) && (location->batchIdx != NO_BATCH);
+}
+
 // If we are only interested in one entity we need its batch and its position in that batch
-EntityBatch* BatchContainingEntity(World* world, u32 entityId, u32* entityPosition)
+EntityBatch* BatchContainingEntity(World* world, EntityId entityId, u32* entityPosition)
 {
-    u32 batchId = entityId/BATCH_SIZE;
+    if(!EntityIsValidInWorld(world, entityId))
+    {
+	DEBUG_ERR("Requesting batch for stale entity "EntityIdPrintfSymbol, EntityIdToPrintf(entityId));
+	return NULL;
+    }
 
-    *entityPosition = entityId%BATCH_SIZE;
+    EntityLocation location = world->entityLocations[EntityIndex(entityId)];
+
+    *entityPosition = location.slot;
   
-    DEBUG_LOG("Requesting batch for entity %d, returning batch %d with offset %d", entityId, batchId, *entityPosition);
+    DEBUG_LOG("Requesting batch for entity "EntityIdPrintfSymbol", returning batch %d with offset %d", EntityIdToPrintf(entityId), location.batchIdx, *entityPosition);
   
-    return world->batches[batchId];
+    return world->batches[location.batchIdx];
 }
 
-Entity* EntityFromWorld(World* world, u32 entityId)
+// Fills in a view of a single entity, everything is NULL if the entity has been destroyed
+Entity EntityFromWorld(World* world, EntityId entityId)
 {
+    Entity ret = {0};
+
     u32 entityIdx;
     EntityBatch* batch = BatchContainingEntity(world, entityId, &entityIdx);
+    if(!batch)
+	return ret;
   
-    Entity* ret = malloc(sizeof(Entity));
-    ret->components = batch->entityComponents + entityIdx;
-    ret->position = batch->positions + entityIdx;
-    ret->velocity = batch->velocities + entityIdx;
-    ret->health = batch->healths + entityIdx;
-    ret->renderable = batch->renderables + entityIdx;
+    ret.components = &batch->components;
+    ret.position = PositionArrayFrom(batch->positions, entityIdx);
+    ret.previousPosition = PositionArrayFrom(batch->previousPositions, entityIdx);
+    ret.velocity = VelocityArrayFrom(batch->velocities, entityIdx);
+    ret.health = batch->healths ? batch->healths + entityIdx : NULL;
+    ret.renderable = batch->renderables ? batch->renderables + entityIdx : NULL;
   
     return ret;
 }
 
-// Find room for a new entity, recycling where possible
-// If no room is found then create a new batch
-u32 NewEntityInWorld(World* world, ComponentFlags requiredComponents)
-{
-    DEBUG_LOG("Creating new entity with components %#06x", requiredComponents);
-
-    // Skip over full batches
-    u32 batchIdx = 0;
-    while(world->batches[batchIdx]->entityCount == BATCH_SIZE)
-    {
-	DEBUG_LOG("Batch %d is full, moving on", batchIdx);
-      
-	// Move to the next batch
-	batchIdx++;
-      
-	// If this leaves us with a valid, allocated batch then try again
-	if(batchIdx < world->batchCount)
-	    continue;
+#define DefineComponentGetter(name, type, array, offsetArray, none)	\
+    DeclareComponentGetter(name, type)					\
+    {									\
+	u32 entityIdx;							\
+	EntityBatch* batch = BatchContainingEntity(world, entityId, &entityIdx); \
+	return batch ? offsetArray(batch->array, entityIdx) : none;	\
+    }
 
-	// Otherwise we have filled all of our batches and must make a new one
-	DEBUG_LOG("All batches are full, creating new batch");
+#define PointerFrom(array, entityIdx) ((array) ? (array) + (entityIdx) : NULL)
 
-	// How much memory do we need?
-	u32 newBatchArraySize = ++world->batchCount * sizeof(EntityBatch*);
+DefineComponentGetter(Position, PositionArray, positions, PositionArrayFrom, noPositions)
+DefineComponentGetter(Velocity, VelocityArray, velocities, VelocityArrayFrom, noVelocities)
+DefineComponentGetter(Health, Health*, healths, PointerFrom, NULL)
+DefineComponentGetter(Renderable, Renderable*, renderables, PointerFrom, NULL)
 
-	// Get more memory (staying in place if we can)
-	world->batches = realloc(world->batches, newBatchArraySize);
+void* ComponentForEntityInWorld(World* world, EntityId entityId, ComponentId component)
+{
+    u32 entityIdx;
+    EntityBatch* batch = BatchContainingEntity(world, entityId, &entityIdx);
+    if(!batch)
+	return NULL;
 
-	// Allocate the new batch
-	world->batches[batchIdx] = CreateEntityBatch();
-	DEBUG_LOG("    New batch count = %d", world->batchCount);
-	break;
+    u8* array = ComponentArrayInBatch(batch, component);
+    return array ? array + (entityIdx * ComponentFieldSize(component)) : NULL;
+}
+
+// Where in the lookup table an archetype lives, or the empty entry where it should go
+static inline u32* ArchetypeLookupEntry(World* world, ComponentFlags components)
+{
+    u32 mask = (world->archetypeCapacity * 2) - 1;
+    u32 entry = HashComponentMask(components) & mask;
+
+    while(world->archetypeLookup[entry] && !ComponentMaskEqual(world->archetypes[world->archetypeLookup[entry] - 1]->components, components))
+	entry = (entry + 1) & mask;
+
+    return &world->archetypeLookup[entry];
+}
+
+// Grow the archetype storage, the lookup table has to be rebuilt as its size has changed
+static void GrowArchetypes(World* world)
+{
+    world->archetypeCapacity *= 2;
+    world->archetypes = realloc(world->archetypes, world->archetypeCapacity * sizeof(Archetype*));
+
+    free(world->archetypeLookup);
+    world->archetypeLookup = (u32*)calloc(world->archetypeCapacity * 2, sizeof(u32));
+
+    u32 archetypeIdx;
+    for(archetypeIdx = 0; archetypeIdx < world->archetypeCount; ++archetypeIdx)
+	*ArchetypeLookupEntry(world, world->archetypes[archetypeIdx]->components) = archetypeIdx + 1;
+}
+
+// Find the archetype for a set of components, making it if this is the first time we have
+// seen it. NULL if the components are too big to go in a batch together
+static Archetype* ArchetypeForComponents(World* world, ComponentFlags components)
+{
+    u32* entry = ArchetypeLookupEntry(world, components);
+    if(*entry)
+	return world->archetypes[*entry - 1];
+
+    // Archetypes are big and batches point at them so they each get their own allocation
+    Archetype* archetype = (Archetype*)aligned_alloc(_Alignof(Archetype), sizeof(Archetype));
+    archetype->components = components;
+    if(!BuildArchetypeLayout(archetype))
+    {
+	free(archetype);
+	return NULL;
     }
 
-    // We are now guaranteed to be pointing to a batch with at least 1 free space
-    EntityBatch* batch = world->batches[batchIdx];
-    DEBUG_LOG("Have batch reference %p", batch);
-  
-    // Skip over allocated entity slots
-    u32 entityIdx = 0;
-    while(batch->entityComponents[entityIdx] & GetComponentFlag(Allocated))
+    if(world->archetypeCount == world->archetypeCapacity)
     {
-	DEBUG_LOG("Entity %d of batch is occupied", entityIdx);
-	entityIdx++;
+	GrowArchetypes(world);
+	entry = ArchetypeLookupEntry(world, components);
     }
 
-    DEBUG_LOG("Entity index = %d", entityIdx);
+    DEBUG_LOG("New archetype %d for components "ComponentMaskPrintfSymbol, world->archetypeCount, ComponentMaskToPrintf(components));
 
-    // Mark this entity slot as allocated as well as containing the required components
-    batch->entityComponents[entityIdx] = (requiredComponents | GetComponentFlag(Allocated));
-    batch->entityCount++;
+    archetype->firstBatchWithSpace = NO_BATCH;
+    archetype->entityCount = 0;
+    archetype->batchCount = 0;
+    archetype->batchListCapacity = 4;
+    archetype->batchIndices = (u32*)malloc(archetype->batchListCapacity * sizeof(u32));
 
-    DEBUG_LOG("Set flags");
+    world->archetypes[world->archetypeCount] = archetype;
+    *entry = ++world->archetypeCount;
+    return archetype;
+}
 
-    // Increase our returned id by the number of entities we skipped in the batch finding stage
-    entityIdx += (batchIdx * BATCH_SIZE);
+// Find a batch of the given archetype with room for another entity, creating one if needed.
+// NO_BATCH if there can't be an archetype with these components
+static u32 BatchWithSpaceForComponents(World* world, ComponentFlags components)
+{
+    Archetype* archetype = ArchetypeForComponents(world, components);
+    if(!archetype)
+	return NO_BATCH;
 
-    DEBUG_LOG("Creating new entity with index %d", entityIdx);
-  
-    return entityIdx;
+    if(archetype->firstBatchWithSpace != NO_BATCH)
+	return archetype->firstBatchWithSpace;
+
+    // Otherwise we have filled all of our batches and must make a new one
+    DEBUG_LOG("All batches for "ComponentMaskPrintfSymbol" are full, creating new batch", ComponentMaskToPrintf(components));
+
+    // Get more memory (staying in place if we can)
+    if(world->batchCount == world->batchCapacity)
+    {
+	world->batchCapacity *= 2;
+	world->batches = realloc(world->batches, world->batchCapacity * sizeof(EntityBatch*));
+    }
+
+    u32 batchIdx = world->batchCount++;
+    world->batches[batchIdx] = CreateEntityBatch(archetype);
+    archetype->firstBatchWithSpace = batchIdx;
+    DEBUG_LOG("    New batch count = %d", world->batchCount);
+
+    if(archetype->batchCount == archetype->batchListCapacity)
+    {
+	archetype->batchListCapacity *= 2;
+	archetype->batchIndices = realloc(archetype->batchIndices, archetype->batchListCapacity * sizeof(u32));
+    }
+    archetype->batchIndices[archetype->batchCount++] = batchIdx;
+
+    return batchIdx;
 }
 
-// Allows us to dynamically add components to entities
-void AddComponentsToEntityInWorld(World* world, u32 entityId, ComponentFlags components)
+// Zero a single entity's components so nothing stale leaks into a reused slot
+static inline void ClearEntityInBatch(EntityBatch* batch, u32 slot)
 {
-    DEBUG_LOG("Adding components %#06x to entity %d", components, entityId);
-    u32 idxInBatch;
-    EntityBatch* batch = BatchContainingEntity(world, entityId, &idxInBatch);
-    batch->entityComponents[idxInBatch] |= components;
+    Archetype* archetype = batch->archetype;
+
+    u32 dataIdx;
+    for(dataIdx = 0; dataIdx < archetype->dataComponentCount; ++dataIdx)
+    {
+	ComponentId component = archetype->dataComponents[dataIdx];
+	u32 fieldSize = ComponentFieldSize(component);
+	u32 stride = ComponentFieldStride(component, batch->capacity);
+	u8* field = (u8*)batch + archetype->componentOffsets[component] + (slot * fieldSize);
+
+	u32 fieldIdx;
+	for(fieldIdx = ComponentFieldCount(component); fieldIdx--; field += stride)
+	    memset(field, 0, fieldSize);
+    }
 }
 
-// Allows us to dynamically remove components from entities
-void RemoveComponentsFromEntityInWorld(World* world, u32 entityId, ComponentFlags components)
+// Hand the components going away to their release functions before the slot is reused
+static void ReleaseEntityComponents(EntityBatch* batch, u32 slot, ComponentFlags components)
 {
-    DEBUG_LOG("Adding components %#06x to entity %d", components, entityId);
-    u32 idxInBatch;
-    EntityBatch* batch = BatchContainingEntity(world, entityId, &idxInBatch);
-    batch->entityComponents[idxInBatch] &= !components;
+    Archetype* archetype = batch->archetype;
+
+    u32 dataIdx;
+    for(dataIdx = 0; dataIdx < archetype->dataComponentCount; ++dataIdx)
+    {
+	ComponentId component = archetype->dataComponents[dataIdx];
+	if(componentReleaseFunctions[component] && ComponentMaskHasId(components, component))
+	    componentReleaseFunctions[component]((u8*)batch + archetype->componentOffsets[component] + (slot * componentTypes[component].size));
+    }
 }
 
+// Copy whichever components both batches have from one slot to another
+static inline void CopyEntityBetweenBatches(EntityBatch* from, u32 fromSlot, EntityBatch* to, u32 toSlot)
+{
+    Archetype* fromArchetype = from->archetype;
+    Archetype* toArchetype = to->archetype;
 
-/*************************************************************************
- **                                                                     **
- **                      This way insanity lies                         **
- **                                                                     **
- *************************************************************************/
+    u32 dataIdx;
+    for(dataIdx = 0; dataIdx < toArchetype->dataComponentCount; ++dataIdx)
+    {
+	ComponentId component = toArchetype->dataComponents[dataIdx];
+	if(!fromArchetype->componentOffsets[component])
+	    continue;
+
+	// Batches of different archetypes have different capacities so their fields are spaced differently
+	u32 fieldSize = ComponentFieldSize(component);
+	u32 toStride = ComponentFieldStride(component, to->capacity);
+	u32 fromStride = ComponentFieldStride(component, from->capacity);
+	u8* toField = (u8*)to + toArchetype->componentOffsets[component] + (toSlot * fieldSize);
+	u8* fromField = (u8*)from + fromArchetype->componentOffsets[component] + (fromSlot * fieldSize);
 
-// Its a swap function...
-void SwapDescriptorPointers(SystemDescriptor** p1, SystemDescriptor** p2)
+	u32 fieldIdx;
+	for(fieldIdx = ComponentFieldCount(component); fieldIdx--; toField += toStride, fromField += fromStride)
+	    memcpy(toField, fromField, fieldSize);
+    }
+}
+
+// Put an entity at the end of a batch of the given archetype and remember where it went,
+// if there is nowhere it can go the location has no batch and nothing is changed
+static EntityLocation PlaceEntity(World* world, u32 entityIdx, ComponentFlags components)
 {
-    SystemDescriptor* tmp = *p1;
-    *p1 = *p2;
-    *p2 = tmp;
+    EntityLocation location;
+    location.batchIdx = BatchWithSpaceForComponents(world, components);
+    if(location.batchIdx == NO_BATCH)
+	return location;
+
+    EntityBatch* batch = world->batches[location.batchIdx];
+    location.slot = batch->entityCount++;
+    batch->archetype->entityCount++;
+    batch->entityIds[location.slot] = entityIdx;
+    ClearEntityInBatch(batch, location.slot);
+
+    // We always fill the batch at the front of the list, if it is now full drop it
+    if(batch->entityCount == batch->capacity)
+    {
+	batch->archetype->firstBatchWithSpace = batch->nextBatchWithSpace;
+	batch->nextBatchWithSpace = NO_BATCH;
+    }
+
+    world->entityLocations[entityIdx].batchIdx = location.batchIdx;
+    world->entityLocations[entityIdx].slot = location.slot;
+
+    return location;
 }
 
-// Change the order of systems so that they always follow what they depend on
-u64 ResolveDependencyOrder(SystemDescriptor** resolveFrom)
+// Take an entity out of its batch, filling the hole with the last entity to keep the batch packed
+static void UnplaceEntity(World* world, EntityLocation location)
 {
-    // Checking lies in the unresolved section, swapTo lies at the start of it
-    SystemDescriptor** checking = resolveFrom;
-    SystemDescriptor** swapTo = resolveFrom;
+    EntityBatch* batch = world->batches[location.batchIdx];
+
+    // A full batch is about to have room again so make it findable
+    if(batch->entityCount == batch->capacity)
+    {
+	Archetype* archetype = batch->archetype;
+	batch->nextBatchWithSpace = archetype->firstBatchWithSpace;
+	archetype->firstBatchWithSpace = location.batchIdx;
+    }
+
+    u32 lastSlot = --batch->entityCount;
+    batch->archetype->entityCount--;
+
+    if(location.slot == lastSlot)
+	return;
+
+    CopyEntityBetweenBatches(batch, lastSlot, batch, location.slot);
+
+    u32 movedEntity = batch->entityIds[lastSlot];
+    batch->entityIds[location.slot] = movedEntity;
+    world->entityLocations[movedEntity].slot = location.slot;
+}
+
+// Move an entity to the batch for its new archetype, bringing along any components it keeps
+// and releasing the ones in released. Leaves it where it was if the new archetype can't exist
+static void MoveEntityToComponents(World* world, u32 entityIdx, ComponentFlags components, ComponentFlags released)
+{
+    EntityLocation oldLocation = world->entityLocations[entityIdx];
+    EntityBatch* oldBatch = world->batches[oldLocation.batchIdx];
+
+    if(ComponentMaskEqual(oldBatch->components, components))
+	return;
 
-    // What systems have we already resolved?
-    u64 resolvedFlags = 0;
+    DEBUG_LOG("Moving entity %d from "ComponentMaskPrintfSymbol" to "ComponentMaskPrintfSymbol, entityIdx, ComponentMaskToPrintf(oldBatch->components), ComponentMaskToPrintf(components));
 
-    // As long as we are looking at a descriptor
-    while(*checking)
+    EntityLocation newLocation = PlaceEntity(world, entityIdx, components);
+    if(newLocation.batchIdx == NO_BATCH)
     {
-	// What does this system need?
-	u64 requiredFlags = (*checking)->dependsOnSystems;
+	DEBUG_ERR("Unable to move entity %d, its new components don't fit in a batch", entityIdx);
+	return;
+    }
 
-	// If the system we are checking has had its dependencies resolved
-	if((requiredFlags & resolvedFlags) == requiredFlags)
-	{
-	    // Include this system in the resolved systems flags
-	    resolvedFlags |= (1 << (*checking)->id);
+    CopyEntityBetweenBatches(oldBatch, oldLocation.slot, world->batches[newLocation.batchIdx], newLocation.slot);
+    ReleaseEntityComponents(oldBatch, oldLocation.slot, released);
+    UnplaceEntity(world, oldLocation);
+}
 
-	    // Move it to the resolved section
-	    SwapDescriptorPointers(swapTo, checking);
+// Get a location entry for a new entity, reusing ones from destroyed entities first
+static u32 NewEntityIndex(World* world)
+{
+    u32 entityIdx = world->firstFreeEntityIndex;
+    if(entityIdx != NO_BATCH)
+    {
+	world->firstFreeEntityIndex = world->entityLocations[entityIdx].slot;
+	return entityIdx;
+    }
 
-	    // Move the start of the unresolved section along
-	    swapTo++;
+    // Make sure we can track where this entity lives
+    if(world->entityIndexCount == world->entityCapacity)
+    {
+	world->entityCapacity *= 2;
+	world->entityLocations = realloc(world->entityLocations, world->entityCapacity * sizeof(EntityLocation));
+    }
 
-	    // And start again at the start of the unresolved section
-	    checking = swapTo;
-	}
-	else
+    // Generation 0 is never used so that NO_ENTITY is never valid
+    entityIdx = world->entityIndexCount++;
+    world->entityLocations[entityIdx].generation = 1;
+    return entityIdx;
+}
+
+// Find room for a new entity, recycling where possible
+// If no room is found then create a new batch, either way this takes constant time
+EntityId NewEntityInWorld(World* world, ComponentFlags requiredComponents)
+{
+    DEBUG_LOG("Creating new entity with components "ComponentMaskPrintfSymbol, ComponentMaskToPrintf(requiredComponents));
+
+    u32 entityIdx = NewEntityIndex(world);
+
+    // Mark this entity as allocated as well as containing the required components
+    if(PlaceEntity(world, entityIdx, ComponentMaskUnion(requiredComponents, GetComponentFlag(Allocated))).batchIdx == NO_BATCH)
+    {
+	DEBUG_ERR("Unable to create entity, its components don't fit in a batch");
+	world->entityLocations[entityIdx].batchIdx = NO_BATCH;
+	world->entityLocations[entityIdx].slot = world->firstFreeEntityIndex;
+	world->firstFreeEntityIndex = entityIdx;
+	return NO_ENTITY;
+    }
+    world->entityCount++;
+
+    EntityId entityId = MakeEntityId(entityIdx, world->entityLocations[entityIdx].generation);
+    DEBUG_LOG("Creating new entity with id "EntityIdPrintfSymbol, EntityIdToPrintf(entityId));
+  
+    return entityId;
+}
+
+// Free an entity's slot and id for reuse, any copies of the id become invalid
+void DestroyEntityInWorld(World* world, EntityId entityId)
+{
+    if(!EntityIsValidInWorld(world, entityId))
+    {
+	DEBUG_ERR("Trying to destroy stale entity "EntityIdPrintfSymbol, EntityIdToPrintf(entityId));
+	return;
+    }
+
+    DEBUG_LOG("Destroying entity "EntityIdPrintfSymbol, EntityIdToPrintf(entityId));
+
+    u32 entityIdx = EntityIndex(entityId);
+    EntityLocation* location = &world->entityLocations[entityIdx];
+    EntityBatch* batch = world->batches[location->batchIdx];
+    ReleaseEntityComponents(batch, location->slot, batch->components);
+    UnplaceEntity(world, *location);
+
+    // Skip generation 0 if we ever wrap around
+    if(!++location->generation)
+	location->generation = 1;
+
+    location->batchIdx = NO_BATCH;
+    location->slot = world->firstFreeEntityIndex;
+    world->firstFreeEntityIndex = entityIdx;
+    world->entityCount--;
+}
+
+// Allows us to dynamically add components to entities
+void AddComponentsToEntityInWorld(World* world, EntityId entityId, ComponentFlags components)
+{
+    DEBUG_LOG("Adding components "ComponentMaskPrintfSymbol" to entity "EntityIdPrintfSymbol, ComponentMaskToPrintf(components), EntityIdToPrintf(entityId));
+    u32 idxInBatch;
+    EntityBatch* batch = BatchContainingEntity(world, entityId, &idxInBatch);
+    if(!batch)
+	return;
+
+    MoveEntityToComponents(world, EntityIndex(entityId), ComponentMaskUnion(batch->components, components), EmptyComponentMask());
+}
+
+// Allows us to dynamically remove components from entities
+void RemoveComponentsFromEntityInWorld(World* world, EntityId entityId, ComponentFlags components)
+{
+    DEBUG_LOG("Removing components "ComponentMaskPrintfSymbol" from entity "EntityIdPrintfSymbol, ComponentMaskToPrintf(components), EntityIdToPrintf(entityId));
+    u32 idxInBatch;
+    EntityBatch* batch = BatchContainingEntity(world, entityId, &idxInBatch);
+    if(!batch)
+	return;
+
+    // Removing components never deallocates the entity, that is what DestroyEntityInWorld is for
+    components = ComponentMaskWithout(components, GetComponentFlag(Allocated));
+    MoveEntityToComponents(world, EntityIndex(entityId), ComponentMaskWithout(batch->components, components), components);
+}
+
+// FNV-1a over the bytes of every live entity's values, slow but only debug builds use it
+u64 ChecksumComponentsInWorld(World* world, ComponentFlags components)
+{
+    u64 hash = 0xcbf29ce484222325;
+
+    u32 archetypeIdx;
+    for(archetypeIdx = 0; archetypeIdx < world->archetypeCount; ++archetypeIdx)
+    {
+	Archetype* archetype = world->archetypes[archetypeIdx];
+	if(!archetype->entityCount)
+	    continue;
+
+	u32 dataIdx;
+	for(dataIdx = 0; dataIdx < archetype->dataComponentCount; ++dataIdx)
 	{
-	    // We can not yet run this system, try the next one
-	    checking++;
+	    ComponentId component = archetype->dataComponents[dataIdx];
+	    if(!ComponentMaskHasId(components, component))
+		continue;
+
+	    u32 batchIdx;
+	    for(batchIdx = 0; batchIdx < archetype->batchCount; ++batchIdx)
+	    {
+		EntityBatch* batch = world->batches[archetype->batchIndices[batchIdx]];
+		u32 liveBytes = batch->entityCount * ComponentFieldSize(component);
+
+		u32 fieldIdx;
+		for(fieldIdx = 0; fieldIdx < ComponentFieldCount(component); ++fieldIdx)
+		{
+		    u8* field = ComponentFieldArrayInBatch(batch, component, fieldIdx);
+		    u32 byteIdx;
+		    for(byteIdx = 0; byteIdx < liveBytes; ++byteIdx)
+			hash = (hash ^ field[byteIdx]) * 0x100000001b3;
+		}
+	    }
 	}
     }
 
-    // Return the flags of all resolved systems, if these match the provided systems flags
-    // then everything has been resolved properly
-    return resolvedFlags;
+    return hash;
 }
 
+
+/*************************************************************************
+ **                                                                     **
+ **                      This way insanity lies                         **
+ **                                                                     **
+ *************************************************************************/
+
 // Global defines for dynamic loading
 char* systemFilename = NULL;
 ino_t systemFileInodeNumber;
 time_t systemFileEditTime = 0;
-void* systemFileDLHandle = NULL;
 
-// Which systems do we have?
-SystemDescriptor systems[64];  
-int numSystems = 0;  
-
-// @TODO: Error checking in here
-// Copies a file in 1K chunks, no error checking implemented yet
-static inline u8 CopyFile(char* source, char* dest)
+// Everything that came from one load of the systems library. A new table is put together
+// off the main thread and swapped in whole between frames
+typedef struct
 {
-    // Open our files
-    FILE* inFile = fopen(source, "rb");
-    FILE* outFile = fopen(dest, "wb");
-
-    char buffer[1024]; // Where to store stuff
-    u32 read; // How many bytes did we read?
+    void* library;
+    int stagedFd; // Stays open as long as the library, see PrepareSystemTable
+    SystemDescriptor* systems; // Our own copies, see CopySystems
+    u32 systemCount;
+    SystemSchedule* schedule; // Built along with the rest, the scheduler uses it from the swap on
+    u64 startedNs; // When we started staging it
+    SystemReloadStats stats;
+} SystemTable;
 
-    // As long as there is some file left
-    while(!feof(inFile))
-    {
-	// Read in (upto) 1K
-	read = fread(buffer, 1, 1024, inFile);
-	fwrite(buffer, 1, read, outFile); // And write it out
-    }
+// The systems running each frame, only ever changed by the main thread between frames
+_Atomic(SystemTable*) currentSystemTable = NULL;
 
-    // Close our input
-    fclose(inFile);
+// The table that was swapped out last frame, it goes once a whole frame has run without it
+SystemTable* retiringSystemTable = NULL;
 
-    // Ensure our output writing has finished and close it
-    fflush(outFile);
-    fclose(outFile);
-
-    return 1;
-}
+SystemReloadStats lastSystemReload;
 
 // Updated the globals associated with dynamic loading
 static inline void UpdateSystemFileInfo(char* filename, time_t modified, ino_t inodeNumber)
@@ -287,7 +868,7 @@ static inline void UpdateSystemFileInfo(char* filename, time_t modified, ino_t i
     systemFileInodeNumber = inodeNumber;
     if(systemFilename)
 	free(systemFilename);
-    systemFilename = malloc(sizeof(char)*strlen(filename));
+    systemFilename = malloc(sizeof(char)*(strlen(filename) + 1));
     strcpy(systemFilename, filename);
 
     systemFileEditTime = modified;
@@ -340,169 +921,432 @@ static inline FileChangedResult FileHasChangedDebug(char* filename)
 // Query our system file for what system functions it contains
 typedef SystemDescriptor** (*SystemDescriptorQueryFunction)();
 
-static inline SystemDescriptorQueryFunction LoadNewFile(char* filename)
+// Fastest first, each way of copying hands over to the next for good if it can't do the job.
+// copy_file_range only works within a file system on older kernels and some file systems
+// (procfs and the like) say they copied nothing rather than fail, sendfile copies from
+// anywhere to anywhere and reading and writing it ourselves always works
+#define STAGE_WITH_COPY_FILE_RANGE (0)
+#define STAGE_WITH_SENDFILE (1)
+#define STAGE_WITH_READ_WRITE (2)
+#define STAGE_BUFFER_BYTES (64 * 1024)
+
+// Copies some of what is left from the current offset of source, returns how much like read
+static ssize_t StageBytes(int source, int staged, size_t length, u8* method)
 {
-    dlerror(); // Clear any old errors
+    ssize_t copied;
+    if(*method == STAGE_WITH_COPY_FILE_RANGE)
+    {
+	copied = copy_file_range(source, NULL, staged, NULL, length, 0);
+	if(copied > 0 || (copied < 0 && errno == EINTR))
+	    return copied;
+	*method = STAGE_WITH_SENDFILE;
+    }
 
-    DEBUG_LOG("Copying file");
+    if(*method == STAGE_WITH_SENDFILE)
+    {
+	copied = sendfile(staged, source, NULL, length);
+	if(copied > 0 || (copied < 0 && errno == EINTR))
+	    return copied;
+	*method = STAGE_WITH_READ_WRITE;
+    }
 
-    char tempName[255];
-    tmpnam_r(tempName);
-    
-    // Copy the newly compiled file so we can overwrite it when we compile later
-    if(!CopyFile(filename, tempName))
-	return NULL;
+    u8 buffer[STAGE_BUFFER_BYTES];
+    copied = read(source, buffer, (length < sizeof(buffer)) ? length : sizeof(buffer));
+    ssize_t written = 0;
+    while(written < copied)
+    {
+	ssize_t wrote = write(staged, buffer + written, copied - written);
+	if(wrote < 0 && errno == EINTR)
+	    continue;
+	if(wrote <= 0)
+	    return -1;
+	written += wrote;
+    }
+    return copied;
+}
 
-    DEBUG_LOG("File copied");
-  
-    // Open the library file and resolve dependencies now
-    void* newFile = dlopen(tempName, RTLD_NOW);  
-    if(newFile == NULL)  
-    {  
-	DEBUG_ERR("Failed to open systems file \"%s\":", filename);  
-	DEBUG_ERR("\t%s", dlerror());  
-	return NULL;  
+// Copy the newly compiled file so we can overwrite it when we compile later. The copy is an
+// anonymous memory file so there is nothing to clean up on disk, and the kernel moves the
+// bytes itself without them coming through us. Gives back the fd of the copy or -1
+static int StageSystemFile(char* filename)
+{
+    TRACE_ZONE("StageSystemFile");
+
+    int source = open(filename, O_RDONLY | O_CLOEXEC);
+    if(source < 0)
+    {
+	DEBUG_ERR("Unable to open systems file \"%s\" to stage it", filename);
+	return -1;
     }
 
-    // The new file is legal, close the old one
-    if(systemFileDLHandle)
+    struct stat sourceAttrs;
+    int staged = -1;
+    if(fstat(source, &sourceAttrs) || (staged = memfd_create("entitySystems", MFD_CLOEXEC)) < 0)
     {
-	DEBUG_LOG("Closing so file handle");
-	if(dlclose(systemFileDLHandle))
+	DEBUG_ERR("Unable to make somewhere to stage \"%s\"", filename);
+	close(source);
+	return -1;
+    }
+
+    off_t remaining = sourceAttrs.st_size;
+    u8 method = STAGE_WITH_COPY_FILE_RANGE;
+    while(remaining > 0)
+    {
+	ssize_t copied = StageBytes(source, staged, remaining, &method);
+	if(copied <= 0)
 	{
-	    DEBUG_ERR("Unable to close old system file");
-	    DEBUG_ERR("\t%s", dlerror());
-	    return NULL;
+	    if(copied < 0 && errno == EINTR)
+		continue;
+
+	    // Someone cut the file short while we were copying it, we'll hear about the next write
+	    DEBUG_ERR("Unable to stage \"%s\", %lld bytes left to copy", filename, (long long)remaining);
+	    close(staged);
+	    close(source);
+	    return -1;
 	}
+	remaining -= copied;
     }
+    close(source);
 
-    // Clear errors
-    dlerror();
+    DEBUG_LOG("Staged %lld KiB of \"%s\"", (long long)sourceAttrs.st_size / 1024, filename);
+    return staged;
+}
 
-    DEBUG_LOG("Getting query function");
-  
-    // Try to get a handle to the function
-    SystemDescriptorQueryFunction func = dlsym(newFile, "GetSystemDescriptors");
-    DEBUG_LOG("Finished dlsym call");
-    if(func == NULL)
+
+// Systems run on other threads based on what they say they touch, so refuse to load any
+// which make no sense rather than find out when two of them write the same array
+static u8 ValidateSystemDescriptor(SystemDescriptor* descriptor)
+{
+    if(!descriptor->updateFunction)
     {
-	DEBUG_ERR("Failed to get system descriptor query function handle");
-	DEBUG_ERR("\t%s", dlerror());
-	return NULL;
+	DEBUG_ERR("System %u has no update function", descriptor->id);
+	return 0;
     }
 
-    systemFileDLHandle = newFile;
+    ComponentFlags registered = EmptyComponentMask();
+    u32 typeCount = atomic_load_explicit(&componentTypeCount, memory_order_acquire);
+    ComponentId component;
+    for(component = 0; component < typeCount; ++component)
+	registered.bits[component >> 6] |= ((u64)1) << (component & 63);
 
-    return func;
+    ComponentFlags unknown = ComponentMaskWithout(ComponentMaskUnion(descriptor->componentsRead, descriptor->componentsWritten), registered);
+    if(!ComponentMaskEqual(unknown, EmptyComponentMask()))
+    {
+	DEBUG_ERR("System %u uses components which were never registered "ComponentMaskPrintfSymbol, descriptor->id, ComponentMaskToPrintf(unknown));
+	return 0;
+    }
+
+    // Only creating and destroying entities gets to change this
+    if(HasComponent(descriptor->componentsWritten, Allocated))
+    {
+	DEBUG_ERR("System %u says it writes Allocated, systems may only read it", descriptor->id);
+	return 0;
+    }
+
+    return 1;
 }
 
-// Convenience methods (only used for printing)
-static inline u32 HigherBits(u64 val)
+// The loaded library can go away under us, keep everything a system points to ourselves
+static SystemDescriptor* CopySystems(SystemDescriptor** descriptors, u32 count)
 {
-    return (u32)((0xffffffff & val)>>32);
+    SystemDescriptor* ret = malloc(count * sizeof(SystemDescriptor));
+    u32 idx;
+    for(idx = 0; idx < count; ++idx)
+    {
+	ret[idx] = *descriptors[idx];
+	ret[idx].dependsOn = malloc(ret[idx].dependencyCount * sizeof(u32));
+	memcpy(ret[idx].dependsOn, descriptors[idx]->dependsOn, ret[idx].dependencyCount * sizeof(u32));
+	ret[idx].name = descriptors[idx]->name ? strdup(descriptors[idx]->name) : NULL;
+	DEBUG_LOG("Loaded system %s (%u), depends on %u others", ret[idx].name ? ret[idx].name : "unnamed", ret[idx].id, ret[idx].dependencyCount);
+    }
+    return ret;
 }
 
-static inline u32 LowerBits(u64 val)
+static void FreeSystems(SystemDescriptor* toFree, u32 count)
 {
-    return (u32)(0xffffffff & val);
+    while(count--)
+    {
+	free(toFree[count].dependsOn);
+	free(toFree[count].name);
+    }
+    free(toFree);
 }
 
-#define u64PrintfSymbol "%#06x%04x"
-#define u64ToPrintf(val) HigherBits(val),LowerBits(val)
+// How long each system took on average last time round, systems we have not seen before
+// are guessed to take as long as the average of the ones we have
+static float* ExpectedSystemCosts(SystemDescriptor** descriptors, u32 count)
+{
+    float* costs = malloc(count * sizeof(float));
+    float knownTotal = 0;
+    u32 knownCount = 0;
+
+    u32 idx;
+    for(idx = 0; idx < count; ++idx)
+    {
+	SystemProfileStats stats;
+	costs[idx] = -1;
+	if(SystemProfileStatsForId(descriptors[idx]->id, &stats))
+	{
+	    costs[idx] = stats.avgMs;
+	    knownTotal += stats.avgMs;
+	    knownCount++;
+	}
+    }
+
+    float guess = knownCount ? (knownTotal / knownCount) : 1;
+    for(idx = 0; idx < count; ++idx)
+    {
+	if(costs[idx] < 0)
+	    costs[idx] = guess;
+    }
+
+    return costs;
+}
 
 // Perform the query and manage the returned system descriptors
-static inline void LoadDescriptors(SystemDescriptorQueryFunction queryFunction)
+static inline u8 LoadDescriptors(SystemDescriptorQueryFunction queryFunction, SystemTable* table)
 { 
     // Do the query
     SystemDescriptor** firstDescriptor = (*queryFunction)();
     if(firstDescriptor == NULL)
     {
 	DEBUG_ERR("System descriptor query function returned NULL");
-	return;
+	return 0;
     }
 
-    // As we load we should track which system ids are used
-    u64 loadedSystems = 0;
-
     // How many descriptors do we have?
-    u8 descriptorCount = 0;
-    SystemDescriptor** iterator = firstDescriptor;
-    while(*iterator && (++descriptorCount<64)) 
-	loadedSystems |= (1<<((*iterator++)->id));
-
-    // It had better be less than 4
-    if(descriptorCount >= 64)
-    {
-	DEBUG_ERR("Too many system descriptors, 64 allowed at most");
-	return;
-    }
+    u32 descriptorCount = 0;
+    while(firstDescriptor[descriptorCount])
+	descriptorCount++;
 
     DEBUG_LOG("Loaded %d descriptors", descriptorCount);
 
-    int i;
+    u32 i;
     for(i = 0; i < descriptorCount; ++i)
-	DEBUG_LOG("System %d requires %#06x%04x", firstDescriptor[i]->id, HigherBits(firstDescriptor[i]->dependsOnSystems), LowerBits(firstDescriptor[i]->dependsOnSystems));
+    {
+	if(!ValidateSystemDescriptor(firstDescriptor[i]))
+	{
+	    DEBUG_ERR("Not loading systems, keeping the ones we already have");
+	    return 0;
+	}
+    }
 
-    // Try to resolve the dependencies
-    u64 resolvedSystems = ResolveDependencyOrder(firstDescriptor);
-    if(resolvedSystems != loadedSystems)
+    // Try to resolve the dependencies, longest running chains first
+    float* costs = ExpectedSystemCosts(firstDescriptor, descriptorCount);
+    u8 resolved = ResolveSystemOrder(firstDescriptor, descriptorCount, costs);
+    free(costs);
+    if(!resolved)
     {
-	DEBUG_ERR("Failed to resolve system dependencies, check you don't have cyles");
-	DEBUG_ERR("    Loaded systems     "u64PrintfSymbol, u64ToPrintf(loadedSystems));
-	DEBUG_ERR("    Resolved systems   %#06x%04x", HigherBits(resolvedSystems), LowerBits(resolvedSystems));
-	return;
+	DEBUG_ERR("Failed to resolve system dependencies, keeping the ones we already have");
+	return 0;
     }
 
     // We have sucessfully managed to load the file, retrieve the definition function
     // and resolve dependencies. Copy the descriptor information and cleanup
-    numSystems = descriptorCount;
-    while(descriptorCount--)
+    table->systems = CopySystems(firstDescriptor, descriptorCount);
+    table->systemCount = descriptorCount;
+    return 1;
+}
+
+static void DiscardSystemTable(void* toDiscard)
+{
+    SystemTable* table = (SystemTable*)toDiscard;
+    if(table->library && dlclose(table->library))
     {
-	systems[descriptorCount] = **(firstDescriptor + descriptorCount);
-	DEBUG_LOG("Loaded system id = %d, depends on %#010x", systems[descriptorCount].id, LowerBits(systems[descriptorCount].dependsOnSystems));
+	DEBUG_ERR("Unable to close old system file");
+	DEBUG_ERR("\t%s", dlerror());
     }
+
+    if(table->stagedFd >= 0)
+	close(table->stagedFd);
+
+    FreeSystemSchedule(table->schedule);
+    FreeSystems(table->systems, table->systemCount);
+    free(table);
 }
 
+// Everything it takes to get a new library ready short of running it, this is the slow
+// part so it runs on the watcher thread once that is going. The library's
+// GetSystemDescriptors runs here too, so may register components off the main thread
+static void* PrepareSystemTable(char* filename)
+{
+    TRACE_ZONE("PrepareSystemTable");
+
+    SystemTable* table = calloc(1, sizeof(SystemTable));
+    table->startedNs = NowNs();
+    if((table->stagedFd = StageSystemFile(filename)) < 0)
+    {
+	free(table);
+	return NULL;
+    }
+    table->stats.stageMs = (float)(NowNs() - table->startedNs) / NS_PER_MS;
+
+    // dlopen goes by name and hands back a library it already has if the name matches, so
+    // the fd in the name stays open until the library is closed and can't be reused before
+    char stagedName[32];
+    snprintf(stagedName, sizeof(stagedName), "/proc/self/fd/%d", table->stagedFd);
+
+    dlerror(); // Clear any old errors
+
+    // Open the library file and resolve dependencies now
+    u64 start = NowNs();
+    table->library = dlopen(stagedName, RTLD_NOW);
+    table->stats.openMs = (float)(NowNs() - start) / NS_PER_MS;
+    if(!table->library)
+    {  
+	DEBUG_ERR("Failed to open systems file \"%s\":", filename);  
+	DEBUG_ERR("\t%s", dlerror());  
+	DiscardSystemTable(table);
+	return NULL;  
+    }
+
+    // Clear errors
+    dlerror();
+
+    DEBUG_LOG("Getting query function");
+  
+    // Try to get a handle to the function
+    SystemDescriptorQueryFunction queryFunction = dlsym(table->library, "GetSystemDescriptors");
+    DEBUG_LOG("Finished dlsym call");
+    if(!queryFunction)
+    {
+	DEBUG_ERR("Failed to get system descriptor query function handle");
+	DEBUG_ERR("\t%s", dlerror());
+	DiscardSystemTable(table);
+	return NULL;
+    }
+
+    start = NowNs();
+    if(!LoadDescriptors(queryFunction, table))
+    {
+	DiscardSystemTable(table);
+	return NULL;
+    }
+
+    // Work out what can run alongside what
+    table->schedule = BuildSystemSchedule(table->systems, table->systemCount);
+    table->stats.loadMs = (float)(NowNs() - start) / NS_PER_MS;
+
+    DEBUG_LOG("Prepared %u systems from \"%s\"", table->systemCount, filename);
+    return table;
+}
+
+// Swap a prepared table in between frames
+static void PublishSystemTable(SystemTable* table)
+{
+    TRACE_ZONE("PublishSystemTable");
+
+    // LoadSystems has already let go of the last table to be swapped out
+    UseSystemSchedule(table->schedule);
+    retiringSystemTable = atomic_exchange(&currentSystemTable, table);
+
+    u32 reloadCount = lastSystemReload.reloadCount;
+    lastSystemReload = table->stats;
+    lastSystemReload.latencyMs = (float)(NowNs() - table->startedNs) / NS_PER_MS;
+    lastSystemReload.reloadCount = reloadCount + 1;
+
+    DEBUG_LOG("Swapped in new systems, reload took %.3fms (staging %.3fms, opening %.3fms, loading %.3fms)", lastSystemReload.latencyMs, lastSystemReload.stageMs, lastSystemReload.openMs, lastSystemReload.loadMs);
+}
+
+static inline u32 LoadedSystemCount()
+{
+    SystemTable* table = atomic_load(&currentSystemTable);
+    return table ? table->systemCount : 0;
+}
+
+// Set once the watcher thread is keeping an eye on the systems file for us
+u8 systemFileWatched = 0;
+
+// The first call always loads the file itself, after that the watcher brings anything new
+u8 systemsLoadAttempted = 0;
+
 // One call to rule them all
 void LoadSystems(char* filename)  
 {
-    DEBUG_LOG("Checking file changed");
+    TRACE_ZONE("LoadSystems");
 
-    // One call to find them
-    FileChangedResult res;
-    if(!(res = FileHasChanged(filename)).changed)
-	return;
+    // The frame that just finished was the first without the last table we swapped out, so
+    // nothing can still be using it
+    if(retiringSystemTable)
+    {
+	if(systemFileWatched)
+	    RetirePreparedLibrary(retiringSystemTable);
+	else
+	    DiscardSystemTable(retiringSystemTable);
+	retiringSystemTable = NULL;
+    }
 
-    DEBUG_LOG("File has changed, getting systems");
-  
-    // One call to bring them all
-    SystemDescriptorQueryFunction queryFunction = LoadNewFile(filename);
-    DEBUG_LOG("Query function is %p", queryFunction);
-    if(queryFunction == NULL)
+#ifdef DEBUG
+    // Only debug builds hot reload. The watcher starts before the first load so a build
+    // finishing while we load the old file is still seen, it just gets loaded next frame
+    if(!systemsLoadAttempted)
+	systemFileWatched = StartLibraryWatcher(filename, &PrepareSystemTable, &DiscardSystemTable);
+#endif
+
+    // One call to find them. With the watcher going all a frame costs when nothing has
+    // changed is an atomic load and the new systems turn up ready to run, otherwise we ask
+    // the file system every time and load them here
+    SystemTable* table;
+    if(systemFileWatched && systemsLoadAttempted)
     {
-	DEBUG_ERR("Null query function, returning");
-	return;
+	if(!(table = TakePreparedLibrary()))
+	    return;
     }
+    else
+    {
+	DEBUG_LOG("Checking file changed");
 
-    DEBUG_LOG("Query function found, querying");
+	// Nothing loaded yet means there is no old version to compare with
+	FileChangedResult res = FileHasChanged(filename);
+	if(!res.changed && atomic_load(&currentSystemTable))
+	    return;
 
-    UpdateSystemFileInfo(filename, res.modified, res.inodeNumber);
-  
-    // And in the globals bind them
-    LoadDescriptors(queryFunction);
+	DEBUG_LOG("File has changed, getting systems");
+	systemsLoadAttempted = 1;
+	if(!(table = PrepareSystemTable(filename)))
+	    return;
+
+	UpdateSystemFileInfo(filename, res.modified, res.inodeNumber);
+    }
+
+    // One call to bring them all, and in the globals bind them
+    PublishSystemTable(table);
+}
 
-    DEBUG_LOG("Have query functions");
+SystemReloadStats LastSystemReloadStats()
+{
+    return lastSystemReload;
+}
+
+void StopWatchingSystems()
+{
+    StopLibraryWatcher();
+    systemFileWatched = 0;
+    systemsLoadAttempted = 0;
+
+    if(retiringSystemTable)
+	DiscardSystemTable(retiringSystemTable);
+    retiringSystemTable = NULL;
 }
 
 // Runs the systems, I named this one quite well
 void RunSystems(World* world)
 {
-    int i;
+    TRACE_ZONE("RunSystems");
     DEBUG_LOG("************************************");
-    DEBUG_LOG("        Running %3d systems         ", numSystems);
+    DEBUG_LOG("        Running %3d systems         ", LoadedSystemCount());
     DEBUG_LOG("************************************");
-    for(i = 0; i < numSystems; ++i)
-    {
-	systems[i].updateFunction(world);
-    }
+    RunSystemSchedule(world, AllSystems);
+}
+
+void RunSimulationSystems(World* world)
+{
+    TRACE_ZONE("RunSimulationSystems");
+    RunSystemSchedule(world, SimulationSystems);
+}
+
+void RunFrameSystems(World* world)
+{
+    TRACE_ZONE("RunFrameSystems");
+    RunSystemSchedule(world, FrameSystems);
 }
@@ -3,31 +3,77 @@
 
 #include "types.h"
 #include "logging.h"
+#include "componentMask.h"
 
 #include <GL/gl.h>
 
-#define ComponentFlags u32
+#include "textureAtlas.h"
 
-#define ComponentFlagName(name) name ## ComponentFlag
-#define DeclareComponentFlag(name) extern u32 ComponentFlagName(name)
-#define SetValueForComponentFlag(name) u32 ComponentFlagName(name) = (1<<__COUNTER__);
-#define ImportComponentFlag(name) u32 ComponentFlagName(name);
-#define GetComponentFlag(name) (ComponentFlagName(name))
-#define PrintFlagValue(name) DEBUG_LOG("Component flag value [%12s] = %#06x", #name, GetComponentFlag(name))
+#define ComponentFlags ComponentMask
 
-DeclareComponentFlag(Allocated);
+// Every component type has an id, built in components get theirs at compile time and
+// anything else (eg from a systems library) asks the registry for one at runtime
+#define ComponentIdName(name) name ## ComponentId
+#define DeclareComponent(name) extern ComponentId ComponentIdName(name)
+#define SetIdForComponent(name) ComponentId ComponentIdName(name) = __COUNTER__;
+#define ImportComponent(name) ComponentId ComponentIdName(name);
+#define GetComponentId(name) (ComponentIdName(name))
+#define GetComponentFlag(name) ComponentMaskFromId(GetComponentId(name))
+#define PrintComponentId(name) DEBUG_LOG("Component id [%12s] = %d", #name, GetComponentId(name))
 
-DeclareComponentFlag(Position);
-DeclareComponentFlag(Velocity);
-DeclareComponentFlag(Health);
-DeclareComponentFlag(Gravity);
-DeclareComponentFlag(Renderable);
+DeclareComponent(Allocated);
+
+DeclareComponent(Position);
+DeclareComponent(Velocity);
+DeclareComponent(Health);
+DeclareComponent(Gravity);
+DeclareComponent(Renderable);
+DeclareComponent(PreviousPosition); // Position as of the last simulation step, a Position
+
+// What the registry knows about each component type, tags like Gravity have no size.
+// Split components are stored with each field in its own array rather than a struct per
+// entity, fieldSize is how big each of those fields is (0 for components stored whole)
+typedef struct
+{
+    const char* name;
+    u32 size;
+    u32 alignment;
+    u32 fieldSize;
+} ComponentType;
+
+// Returns the existing id if a component with this name was already registered (eg by a
+// previous load of the same systems library). Components which can't be stored (too big for
+// a batch, over cache line alignment, or re-registered with a different layout) or don't
+// fit in the registry get NO_COMPONENT_ID, which must not be used in a mask.
+//
+// Any thread may register, a systems library's GetSystemDescriptors runs on the library
+// watcher thread in debug builds. Registered types never change so looking them up never
+// waits on a registration
+#define NO_COMPONENT_ID ((ComponentId)MAX_COMPONENT_TYPES)
+ComponentId RegisterComponentType(const char* name, u32 size, u32 alignment);
+const ComponentType* ComponentTypeFromId(ComponentId id);
+u32 RegisteredComponentTypeCount();
+
+// Lets a component own something, eg a Renderable holding a reference to its texture. The
+// function gets the component's value when it is removed from an entity or the entity is
+// destroyed, not when the entity just moves between archetypes. Only for components stored
+// whole, and called on whichever thread made the change, which can be a parallel for worker
+// so it must not touch anything belonging to one thread (see ReleaseRenderable)
+typedef void (*ComponentReleaseFunction)(void* component);
+void SetComponentReleaseFunction(ComponentId id, ComponentReleaseFunction release);
 
 typedef struct
 {
   float width;
   float height;
+  u32 texture; // A TextureHandle, the renderable holds a reference to it
+  // Copied from the texture's atlas region, which may have moved if atlasGeneration is
+  // behind the atlas. See RefreshRenderable
   GLuint textureId;
+  TextureRect uv;
+  u32 atlasGeneration;
+  u8 layer; // Higher layers are drawn over lower ones
+  float depth; // Orders sprites sharing a layer and texture, lowest first
 } Renderable;
 
 typedef struct
@@ -49,60 +95,312 @@ typedef struct
     int hp;
 } Health;
 
+// Position and Velocity are normally stored a struct per entity, build everything (the
+// engine and the systems library) with SOA_COMPONENTS defined to split them so every
+// field gets an array of its own. Then updating vy only pulls vy through the cache and
+// SIMD code can work on whole registers of one field without shuffling.
+//
+// Either way the batch arrays and entity views have the same names, in the split layout
+// they are a pointer per field instead of a pointer to the struct
+#ifdef SOA_COMPONENTS
+typedef struct
+{
+    float* x;
+    float* y;
+} PositionArray;
+
+typedef struct
+{
+    float* vx;
+    float* vy;
+    float* vxMax;
+    float* vyMax;
+} VelocityArray;
+
+#define EntityField(entity, component, field) ((entity)->component.field[0])
+#define PositionArrayIsPresent(array) ((array).x != NULL)
+
+static inline void CopyPositionArray(PositionArray to, PositionArray from, u32 count)
+{
+    memcpy(to.x, from.x, count * sizeof(float));
+    memcpy(to.y, from.y, count * sizeof(float));
+}
+#else
+typedef Position* PositionArray;
+typedef Velocity* VelocityArray;
+
+#define EntityField(entity, component, field) ((entity)->component->field)
+#define PositionArrayIsPresent(array) ((array) != NULL)
+
+static inline void CopyPositionArray(PositionArray to, PositionArray from, u32 count)
+{
+    memcpy(to, from, count * sizeof(Position));
+}
+#endif
+
+// A single entity's components, eg EntityField(&entity, velocity, vy) += 1.0f works with
+// either layout. Health and Renderable are never split so can be used directly
 typedef struct
 {
     ComponentFlags* components;
-    Position* position;
-    Velocity* velocity;
+    PositionArray position;
+    PositionArray previousPosition;
+    VelocityArray velocity;
     Health* health;
     Renderable* renderable;
 } Entity;
 
-#define BATCH_SIZE (10)
+// Batches hold entities of a single archetype, every entity in a batch has exactly the
+// same components so we only store the component arrays that archetype actually uses.
+// Entities are packed densely at the front of the batch.
+//
+// Every batch is one BATCH_BYTES chunk, how many entities fit depends on the components
+// the archetype has. Each array starts on its own cache line, override BATCH_BYTES at
+// compile time to try out other chunk sizes
+#ifndef BATCH_BYTES
+#define BATCH_BYTES (16*1024)
+#endif
+#define CACHE_LINE_BYTES (64)
+
+// Capacities are kept to a multiple of this so that every array ends on a cache line
+#define BATCH_CAPACITY_GRANULARITY (CACHE_LINE_BYTES/sizeof(u32))
+
+struct Archetype;
+
 typedef struct
 {
+    ComponentFlags components; // The archetype, includes the Allocated flag
     u32 entityCount;
-    ComponentFlags      entityComponents[BATCH_SIZE];
-    Position            positions[BATCH_SIZE];
-    Velocity            velocities[BATCH_SIZE];
-    Health              healths[BATCH_SIZE];
-    Renderable renderables[BATCH_SIZE];
+    u32 capacity;
+    u32 nextBatchWithSpace; // Links the batches of an archetype which still have room
+    struct Archetype* archetype;
+    u32* entityIds; // Which entity lives in each slot, needed when we shuffle entities around
+
+    // Built in components are used so much they get their own pointers, any of these
+    // are NULL if the archetype does not include the component
+    PositionArray positions;
+    PositionArray previousPositions;
+    VelocityArray velocities;
+    Health*       healths;
+    Renderable*   renderables;
 } EntityBatch;
 
+#define BATCH_HEADER_BYTES ((sizeof(EntityBatch) + CACHE_LINE_BYTES - 1) & ~(CACHE_LINE_BYTES - 1))
+
+// What one entity costs if it has every built in component, so the smallest batch capacity
+// we will see for those. Registered components can make entities bigger than this
+#define MAX_BYTES_PER_ENTITY (sizeof(u32) + (2 * sizeof(Position)) + sizeof(Velocity) + sizeof(Health) + sizeof(Renderable))
+#define MIN_BATCH_CAPACITY ((((BATCH_BYTES - BATCH_HEADER_BYTES) / MAX_BYTES_PER_ENTITY) / BATCH_CAPACITY_GRANULARITY) * BATCH_CAPACITY_GRANULARITY)
+
+_Static_assert(MIN_BATCH_CAPACITY > 0, "BATCH_BYTES is too small to hold a single entity");
+
+// Any component, built in or registered, in a batch. NULL if the archetype does not have it.
+// For split components this is the array of the first field, the rest can be found with
+// ComponentFieldArrayInBatch
+void* ComponentArrayInBatch(EntityBatch* batch, ComponentId component);
+void* ComponentFieldArrayInBatch(EntityBatch* batch, ComponentId component, u32 field);
+
+// Entity ids are an index into the world's location table along with the generation of
+// that index, destroying an entity bumps the generation so old ids stop working
+#define EntityId u64
+#define NO_ENTITY ((EntityId)0)
+#define EntityIndex(id) ((u32)((id) & 0xffffffff))
+#define EntityGeneration(id) ((u32)((id) >> 32))
+#define MakeEntityId(index, generation) ((((EntityId)(generation)) << 32) | (index))
+#define EntityIdPrintfSymbol "%u:%u"
+#define EntityIdToPrintf(id) EntityIndex(id),EntityGeneration(id)
+
+// Where an entity currently lives, entity ids stay the same when they move between archetypes
+// Free entries have no batch and use slot to point at the next free entry
 typedef struct
 {
+    u32 batchIdx;
+    u32 slot;
+    u32 generation;
+} EntityLocation;
+
+#define NO_BATCH (0xffffffff)
+
+// All the batches for a set of components, the ones with room in them are kept in a list
+// so finding space for a new entity never has to look at full batches.
+// Queries test an archetype once and then only visit its batches, so a query never
+// touches batches it can't match and skips archetypes with nothing alive in them
+typedef struct Archetype
+{
+    ComponentFlags components;
+    u32 batchCapacity;
+    u32 firstBatchWithSpace;
+    u32 entityCount;
+
+    // Indices into world->batches of every batch holding this archetype
     u32 batchCount;
+    u32 batchListCapacity;
+    u32* batchIndices;
+
+    // Where each component's array starts inside a batch, 0 if the archetype does not have it
+    u32 componentOffsets[MAX_COMPONENT_TYPES];
+
+    // The components which actually need storage
+    u32 dataComponentCount;
+    ComponentId dataComponents[MAX_COMPONENT_TYPES];
+} Archetype;
+
+typedef struct
+{
+    u32 batchCount;
+    u32 batchCapacity;
+    u32 archetypeCount;
+    u32 archetypeCapacity; // Always a power of two, the lookup table has twice as many entries
     u32 entityCount;
-    float lastTickDt;
+    u32 entityIndexCount; // How many location entries have ever been handed out
+    u32 entityCapacity;
+    u32 firstFreeEntityIndex;
+    float lastTickDt; // How much time the systems being run should cover
+    float lastFrameDt; // How long the last frame actually took
+    float interpolation; // How far the frame being drawn is from the previous simulation step to the latest
     EntityBatch** batches;
+    EntityLocation* entityLocations;
+    Archetype** archetypes;
+    u32* archetypeLookup; // Open addressed hash of components to archetype index + 1, 0 is empty
 } World;
 
-#define HasComponent(flags, component) ((GetComponentFlag(component) & flags) != 0)
-#define IsAllocated(entity) (GetComponentFlag(Allocated) & (*entity->components))
+#define HasComponent(flags, component) ComponentMaskHasId(flags, GetComponentId(component))
+#define IsAllocated(entity) HasComponent(*(entity)->components, Allocated)
+#define EntityHasComponent(entity, component) ((entity)->components && HasComponent(*(entity)->components, component))
 
 void InitEntityInBatch(Entity* entity, EntityBatch* batch, ComponentFlags flags);
 
 void NextEntity(Entity* entity);
 
+// Walks every batch with live entities which has at least the required components, lets
+// systems work on whole component arrays at a time rather than an entity at a time.
+// Lives in the header so systems libraries get it inlined into their loops
+typedef struct
+{
+    World* world;
+    ComponentFlags requires;
+    u32 archetypeIdx;
+    u32 batchIdx;
+    EntityBatch* batch; // The current batch, valid after NextBatchInQuery returns 1
+} BatchQuery;
+
+static inline BatchQuery BeginBatchQuery(World* world, ComponentFlags requires)
+{
+    BatchQuery ret;
+    ret.world = world;
+    ret.requires = ComponentMaskUnion(requires, GetComponentFlag(Allocated));
+    ret.archetypeIdx = 0;
+    ret.batchIdx = 0;
+    ret.batch = NULL;
+    return ret;
+}
+
+static inline u8 NextBatchInQuery(BatchQuery* query)
+{
+    World* world = query->world;
+
+    while(query->archetypeIdx < world->archetypeCount)
+    {
+	Archetype* archetype = world->archetypes[query->archetypeIdx];
+
+	// One check rules every batch of the archetype in or out
+	if(archetype->entityCount && ComponentMaskContains(archetype->components, query->requires))
+	{
+	    while(query->batchIdx < archetype->batchCount)
+	    {
+		query->batch = world->batches[archetype->batchIndices[query->batchIdx++]];
+		if(query->batch->entityCount)
+		    return 1;
+	    }
+	}
+
+	query->archetypeIdx++;
+	query->batchIdx = 0;
+    }
+
+    query->batch = NULL;
+    return 0;
+}
+
 typedef void (*UpdateSystemFunction)(World*);
 
 World* CreateWorld(u32 entityCount);
-EntityBatch* BatchContainingEntity(World* world, u32 entityId, u32* entityPosition);
-Entity* EntityFromWorld(World* world, u32 entityId);
+u8 EntityIsValidInWorld(World* world, EntityId entityId);
+EntityBatch* BatchContainingEntity(World* world, EntityId entityId, u32* entityPosition);
+Entity EntityFromWorld(World* world, EntityId entityId);
+
+// Typed lookups for a single component of an entity, NULL if the entity is stale or lacks it.
+// Position and Velocity give back the same view an Entity has, all NULL pointers if missing
+#define DeclareComponentGetter(name, type) type name ## ForEntityInWorld(World* world, EntityId entityId)
+DeclareComponentGetter(Position, PositionArray);
+DeclareComponentGetter(Velocity, VelocityArray);
+DeclareComponentGetter(Health, Health*);
+DeclareComponentGetter(Renderable, Renderable*);
+
+// Split components give the entity's first field
+void* ComponentForEntityInWorld(World* world, EntityId entityId, ComponentId component);
+
+// Entities whose components are too big to share a batch can't exist, making one gives
+// NO_ENTITY and adding components to one leaves it as it was
+EntityId NewEntityInWorld(World* world, ComponentFlags requiredComponents);
+void DestroyEntityInWorld(World* world, EntityId entityId);
+void AddComponentsToEntityInWorld(World* world, EntityId entityId, ComponentFlags components);
+void RemoveComponentsFromEntityInWorld(World* world, EntityId entityId, ComponentFlags components);
 
-u32 NewEntityInWorld(World* world, ComponentFlags requiredComponents);
-void AddComponentsToEntityInWorld(World* world, u32 entityId, ComponentFlags components);
-void RemoveComponentsFromEntityInWorld(World* world, u32 entityId, ComponentFlags components);
+// Systems which talk to OpenGL have to stay on the thread which owns the context (the
+// one calling RunSystems), anything else can be run on any thread
+#define SYSTEM_ON_MAIN_THREAD (1<<0)
 
+// Simulation systems run once per fixed step, which may be several times in a frame or
+// not at all. Systems with this flag (eg rendering) run once every frame instead
+#define SYSTEM_EVERY_FRAME (1<<1)
+
+// Systems say which components they only look at and which they change, writing a
+// component counts as reading it too. Any number of systems can read a component at
+// once but a system writing it has to have it to itself.
+//
+// Ids can be anything as long as no two loaded systems share one, dependencies are by id.
+// The engine keeps its own copy of the name and dependency list when it loads a system
 typedef struct
 {
-    u64 dependsOnSystems;
+    u32* dependsOn;
+    u32 dependencyCount;
     UpdateSystemFunction updateFunction;
-    ComponentFlags componentsUsed;
-    u8 id;
+    ComponentFlags componentsRead;
+    ComponentFlags componentsWritten;
+    char* name; // Only used for reporting problems, may be NULL
+    u32 id;
+    u8 flags;
 } SystemDescriptor;
 
+// Hash of every live value of the given components, lets debug builds catch a system
+// changing components it said it would only read
+u64 ChecksumComponentsInWorld(World* world, ComponentFlags components);
+
+// Loads the systems library the first time, after that debug builds reload it whenever it
+// changes. Call every frame, it only costs anything when there is something new to load
 void LoadSystems(char* fileName);
+void StopWatchingSystems();
+
+// Where the time went in the last reload. Latency runs from when the new file was noticed
+// to the new systems being ready, staging happens on the watcher thread if there is one
+// and the gap before the frame loop picks it up counts too
+typedef struct
+{
+    float stageMs;
+    float openMs;
+    float loadMs; // Resolving and scheduling the descriptors
+    float latencyMs;
+    u32 reloadCount;
+} SystemReloadStats;
+
+SystemReloadStats LastSystemReloadStats();
+
+// Systems with no dependency between them run at the same time, see systemScheduler.h.
+// RunSystems runs everything, the game loop runs the simulation systems for each fixed
+// step and then the frame systems once
 void RunSystems(World* world);
+void RunSimulationSystems(World* world);
+void RunFrameSystems(World* world);
 
 #endif
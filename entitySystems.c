@@ -9,50 +9,44 @@
 
 #include "entityComponentSystem.h"
 #include "entityComponentSystem_dynamic.h"
-
-ImportComponentFlag(Position);
-ImportComponentFlag(Allocated);
-ImportComponentFlag(Health);
-ImportComponentFlag(Velocity);
-ImportComponentFlag(Gravity);
-ImportComponentFlag(Renderable);
+#include "movementKernels.h"
+#include "parallelFor.h"
+#include "renderQueue.h"
+#include "2dsprites.h"
+
+ImportComponent(Position);
+ImportComponent(Allocated);
+ImportComponent(Health);
+ImportComponent(Velocity);
+ImportComponent(Gravity);
+ImportComponent(Renderable);
+ImportComponent(PreviousPosition);
 
 #define PRINT_POSITION_OPERATES_ON (GetComponentFlag(Position))
 
-static inline void ApplyToAllEntitiesInWorld(World* world, void(someFunction)(Entity*,float), ComponentFlags requires)
+static inline void ApplyToAllEntitiesInWorld(World* world, void(someFunction)(Entity*,float), ComponentFlags requires, float value)
 {
-    EntityBatch* batch = NULL;
     Entity entity;
-    u32 batchCount = world->batchCount;
-    //DEBUG_LOG("Processing %d batches", batchCount);
-
-    requires |= GetComponentFlag(Allocated);
-
     u32 entityIdx = 0;
-    float dt = world->lastTickDt;
 
-    if(batchCount)
+    BatchQuery query = BeginBatchQuery(world, requires);
+    while(NextBatchInQuery(&query))
     {
-	batch = world->batches[0];   
-	while(batchCount--)
+	// Give every component the batch has, not just the ones we asked for
+	InitEntityInBatch(&entity, query.batch, query.batch->components);
+	entityIdx = query.batch->entityCount;
+
+	while(entityIdx--)
 	{
-	    InitEntityInBatch(&entity, batch, requires);
-	    batch++;
-	    entityIdx = 0;
-
-	    while(entityIdx++ < BATCH_SIZE)
-	    {
-		if((*entity.components & requires) == requires)
-		    (*someFunction)(&entity, dt);
-		NextEntity(&entity);
-	    }
+	    (*someFunction)(&entity, value);
+	    NextEntity(&entity);
 	}
     }
 }
 
 static inline void printEntityPosition(Entity* entity, float dt)
 {
-    DEBUG_LOG("Entity position = %f %f", entity->position->x, entity->position->y);
+    DEBUG_LOG("Entity position = %f %f", EntityField(entity, position, x), EntityField(entity, position, y));
 }
 
 static inline void printEntityHealth(Entity* entity, float dt)
@@ -62,130 +56,118 @@ static inline void printEntityHealth(Entity* entity, float dt)
 
 static inline void printEntityVelocity(Entity* entity, float dt)
 {
-    DEBUG_LOG("Entity velocity = %f %f", entity->velocity->vx, entity->velocity->vy);
-}
-
-static inline void applyGravity(Entity* entity, float dt)
-{
-    entity->velocity->vy += (dt * 9.81f);
-    entity->velocity->vx = 0;
-}
-
-static inline void clampVelocity(Entity* entity)
-{
-  return;
-    entity->velocity->vx = fmin(entity->velocity->vx, entity->velocity->vxMax);
-    entity->velocity->vy = fmin(entity->velocity->vy, entity->velocity->vyMax);
-  
-    entity->velocity->vx = fmax(entity->velocity->vx, -entity->velocity->vxMax);
-    entity->velocity->vy = fmax(entity->velocity->vy, -entity->velocity->vyMax);
+    DEBUG_LOG("Entity velocity = %f %f", EntityField(entity, velocity, vx), EntityField(entity, velocity, vy));
 }
 
-static inline void moveEntity(Entity* entity, float dt)
+// Where to draw an entity, part way between where the last two simulation steps left it
+static inline Position InterpolatedPosition(Entity* entity, float alpha)
 {
-    clampVelocity(entity);
-    entity->position->x += (dt * entity->velocity->vx);
-    entity->position->y += (dt * entity->velocity->vy);
+    Position ret = {EntityField(entity, position, x), EntityField(entity, position, y)};
+    if(PositionArrayIsPresent(entity->previousPosition))
+    {
+	float previousX = EntityField(entity, previousPosition, x);
+	float previousY = EntityField(entity, previousPosition, y);
+	ret.x = previousX + ((ret.x - previousX) * alpha);
+	ret.y = previousY + ((ret.y - previousY) * alpha);
+    }
+    return ret;
 }
 
-static inline void render(Entity* entity, float dt)
+static inline void render(Entity* entity, float alpha)
 {
     Renderable* renderable = entity->renderable;
-    Position* position = entity->position;
-
-    glBindTexture(GL_TEXTURE_2D, renderable->textureId);
-
-    DEBUG_LOG("Bind - %d", glGetError());
-
-    glPushMatrix();
-    glTranslatef(position->x, position->y, -10);
-
-    DEBUG_LOG("Translate - %d", glGetError());
-    
-    glBegin(GL_QUADS);
-
-    //glColor4f(1.0, 0.0, 0.0, 1.0);
-    glTexCoord2f(0, 0);
-    DEBUG_LOG("Coord - %d", glGetError());
-
-
-    glVertex3f(0, 0, 0);
+    Position position = InterpolatedPosition(entity, alpha);
 
-    DEBUG_LOG("Vert - %d", glGetError());
-
-    glTexCoord2f(1, 0);
-    glVertex3f(renderable->width, 0, 0);    
-
-    glTexCoord2f(1, 1);
-    glVertex3f(renderable->width, renderable->height, 0);
-
-    glTexCoord2f(0, 1);
-    glVertex3f(0, renderable->height, 0);
-
-    glEnd();
-    glPopMatrix();
+    RefreshRenderable(renderable);
+    QueueSprite(renderable->layer, renderable->textureId, renderable->depth, renderable->uv, position.x, position.y, renderable->width, renderable->height);
 }
 
 #define PRINT_POSITION_SYSTEM_COMPONENTS (GetComponentFlag(Position))
 void printPositionSystem(World* world)
 {
-    ApplyToAllEntitiesInWorld(world, &printEntityPosition, PRINT_POSITION_SYSTEM_COMPONENTS);
+    ApplyToAllEntitiesInWorld(world, &printEntityPosition, PRINT_POSITION_SYSTEM_COMPONENTS, world->lastTickDt);
 }
 
 #define PRINT_HEALTH_SYSTEM_COMPONENTS (GetComponentFlag(Health))
 void printHealthSystem(World* world)
 {
-    ApplyToAllEntitiesInWorld(world, &printEntityHealth, PRINT_HEALTH_SYSTEM_COMPONENTS);
+    ApplyToAllEntitiesInWorld(world, &printEntityHealth, PRINT_HEALTH_SYSTEM_COMPONENTS, world->lastTickDt);
 }
 
 #define PRINT_VELOCITY_SYSTEM_COMPONENTS (GetComponentFlag(Velocity))
 void printVelocitiesSystem(World* world)
 {
-    ApplyToAllEntitiesInWorld(world, &printEntityVelocity, PRINT_VELOCITY_SYSTEM_COMPONENTS);
+    ApplyToAllEntitiesInWorld(world, &printEntityVelocity, PRINT_VELOCITY_SYSTEM_COMPONENTS, world->lastTickDt);
+}
+
+// PreviousPosition is updated when an entity has it but isn't needed to move
+#define APPLY_MOVE_SYSTEM_COMPONENTS ComponentMaskOf(GetComponentId(Velocity), GetComponentId(Position))
+#define APPLY_MOVE_SYSTEM_READS EmptyComponentMask()
+#define APPLY_MOVE_SYSTEM_WRITES ComponentMaskUnion(APPLY_MOVE_SYSTEM_COMPONENTS, GetComponentFlag(PreviousPosition))
+static void moveBatch(EntityBatch* batch, void* dt)
+{
+    // Keep where we were so frames can be drawn between steps
+    if(PositionArrayIsPresent(batch->previousPositions))
+	CopyPositionArray(batch->previousPositions, batch->positions, batch->entityCount);
+
+    movementKernels.moveEntities(batch->positions, batch->velocities, batch->entityCount, *(float*)dt);
 }
 
-#define APPLY_MOVE_SYSTEM_COMPONENTS (GetComponentFlag(Velocity)|GetComponentFlag(Position))
 void doMovementSystem(World* world)
 {
-    ApplyToAllEntitiesInWorld(world, &moveEntity, APPLY_MOVE_SYSTEM_COMPONENTS);
+    float dt = world->lastTickDt;
+    ParallelForBatchesInQuery(world, APPLY_MOVE_SYSTEM_COMPONENTS, &moveBatch, &dt);
+}
+
+#define APPLY_GRAVITY_SYSTEM_READS GetComponentFlag(Gravity)
+#define APPLY_GRAVITY_SYSTEM_WRITES GetComponentFlag(Velocity)
+#define APPLY_GRAVITY_SYSTEM_COMPONENTS ComponentMaskUnion(APPLY_GRAVITY_SYSTEM_READS, APPLY_GRAVITY_SYSTEM_WRITES)
+static void applyGravityToBatch(EntityBatch* batch, void* dt)
+{
+    movementKernels.applyGravity(batch->velocities, batch->entityCount, *(float*)dt);
 }
 
-#define APPLY_GRAVITY_SYSTEM_COMPONENTS (GetComponentFlag(Gravity)|GetComponentFlag(Velocity))
 void applyGravitySystem(World* world)
 {
-    ApplyToAllEntitiesInWorld(world, &applyGravity, APPLY_GRAVITY_SYSTEM_COMPONENTS);
+    float dt = world->lastTickDt;
+    ParallelForBatchesInQuery(world, APPLY_GRAVITY_SYSTEM_COMPONENTS, &applyGravityToBatch, &dt);
 }
 
-#define APPLY_RENDER_SYSTEM_COMPONENTS (GetComponentFlag(Renderable)|GetComponentFlag(Position))
+// Entities without a PreviousPosition are drawn where they are. Renderables are only
+// written to catch up with atlas repacks
+#define APPLY_RENDER_SYSTEM_COMPONENTS ComponentMaskOf(GetComponentId(Renderable), GetComponentId(Position))
+#define APPLY_RENDER_SYSTEM_READS ComponentMaskUnion(GetComponentFlag(Position), GetComponentFlag(PreviousPosition))
+#define APPLY_RENDER_SYSTEM_WRITES GetComponentFlag(Renderable)
 void applyRenderSystem(World* world)
 {
     glClearColor(0, 0, 1, 0);
     glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
     glLoadIdentity();
-    ApplyToAllEntitiesInWorld(world, &render, APPLY_RENDER_SYSTEM_COMPONENTS);
-    glFlush();
-}
+    glTranslatef(0, 0, -10);
 
-static inline u64 SystemDependenciesFromIds(u8 idCount, va_list* args)
-{
-    u64 ret = 0;
-    while(idCount--)
-    {
-	ret |= (1<<va_arg(*args, int));
-    }
-    return ret;
+    BeginRenderQueue();
+    ApplyToAllEntitiesInWorld(world, &render, APPLY_RENDER_SYSTEM_COMPONENTS, world->interpolation);
+    SubmitRenderQueue();
+    glFlush();
 }
 
-SystemDescriptor* BuildSystemDescriptor(u8 id, ComponentFlags usesComponents, void(systemFunction)(World*), int numDependencies, ...)
+SystemDescriptor* BuildSystemDescriptor(u32 id, char* name, ComponentFlags readsComponents, ComponentFlags writesComponents, void(systemFunction)(World*), int numDependencies, ...)
 {
     va_list args;
     va_start(args, numDependencies);
 
     SystemDescriptor* ret = malloc(sizeof(SystemDescriptor));
-    ret->dependsOnSystems = SystemDependenciesFromIds(numDependencies, &args);
+    ret->dependsOn = malloc(sizeof(u32) * numDependencies);
+    ret->dependencyCount = numDependencies;
+    int dependency;
+    for(dependency = 0; dependency < numDependencies; ++dependency)
+	ret->dependsOn[dependency] = va_arg(args, u32);
     ret->updateFunction = systemFunction;
-    ret->componentsUsed = usesComponents;
+    ret->componentsRead = readsComponents;
+    ret->componentsWritten = writesComponents;
+    ret->name = name;
     ret->id = id;
+    ret->flags = 0;
 
     va_end(args);
 
@@ -195,11 +177,12 @@ SystemDescriptor* BuildSystemDescriptor(u8 id, ComponentFlags usesComponents, vo
 SystemDescriptor** GetSystemDescriptors()
 {
     SystemDescriptor** ret = malloc(sizeof(SystemDescriptor*) * 6);
-    ret[0] = BuildSystemDescriptor(1, APPLY_GRAVITY_SYSTEM_COMPONENTS, &applyGravitySystem, 0);
-    //ret[1] = BuildSystemDescriptor(2, PRINT_VELOCITY_SYSTEM_COMPONENTS, &printVelocitiesSystem, 1, 1);
-    ret[1] = BuildSystemDescriptor(5, APPLY_MOVE_SYSTEM_COMPONENTS, &doMovementSystem, 1, 1);
-    //ret[2] = BuildSystemDescriptor(4, PRINT_POSITION_SYSTEM_COMPONENTS, &printPositionSystem, 1, 5);
-    ret[2] = BuildSystemDescriptor(7, APPLY_RENDER_SYSTEM_COMPONENTS, &applyRenderSystem, 2, 1, 5);
+    ret[0] = BuildSystemDescriptor(1, "applyGravity", APPLY_GRAVITY_SYSTEM_READS, APPLY_GRAVITY_SYSTEM_WRITES, &applyGravitySystem, 0);
+    //ret[1] = BuildSystemDescriptor(2, "printVelocities", PRINT_VELOCITY_SYSTEM_COMPONENTS, EmptyComponentMask(), &printVelocitiesSystem, 1, 1);
+    ret[1] = BuildSystemDescriptor(5, "doMovement", APPLY_MOVE_SYSTEM_READS, APPLY_MOVE_SYSTEM_WRITES, &doMovementSystem, 1, 1);
+    //ret[2] = BuildSystemDescriptor(4, "printPosition", PRINT_POSITION_SYSTEM_COMPONENTS, EmptyComponentMask(), &printPositionSystem, 1, 5);
+    ret[2] = BuildSystemDescriptor(7, "applyRender", APPLY_RENDER_SYSTEM_READS, APPLY_RENDER_SYSTEM_WRITES, &applyRenderSystem, 2, 1, 5);
+    ret[2]->flags |= SYSTEM_ON_MAIN_THREAD | SYSTEM_EVERY_FRAME;
     ret[3] = NULL;
     return ret;
 }
@@ -0,0 +1,80 @@
+#define NO_PRINT
+
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+
+#include "logging.h"
+
+#include "frameClock.h"
+#include "timing.h"
+
+FrameClock CreateFrameClock(u32 simulationHz, u32 targetFps)
+{
+    FrameClock ret;
+    ret.stepNs = NS_PER_SECOND / simulationHz;
+    ret.frameNs = NS_PER_SECOND / targetFps;
+
+    ret.lastFrameStartNs = NowNs();
+    ret.nextFrameDeadlineNs = ret.lastFrameStartNs + ret.frameNs;
+    ret.accumulatedNs = 0;
+
+    ret.stepSeconds = (float)ret.stepNs / NS_PER_SECOND;
+    ret.lastFrameSeconds = (float)ret.frameNs / NS_PER_SECOND;
+    ret.droppedNs = 0;
+
+    return ret;
+}
+
+u32 BeginFrame(FrameClock* clock)
+{
+    u64 now = NowNs();
+    u64 elapsed = now - clock->lastFrameStartNs;
+    clock->lastFrameStartNs = now;
+    clock->lastFrameSeconds = (float)elapsed / NS_PER_SECOND;
+
+    clock->accumulatedNs += elapsed;
+    u64 steps = clock->accumulatedNs / clock->stepNs;
+
+    if(steps > MAX_STEPS_PER_FRAME)
+    {
+	u64 dropped = (steps - MAX_STEPS_PER_FRAME) * clock->stepNs;
+	DEBUG_LOG("Frame took %.1fms, dropping %.1fms of simulation", (double)elapsed / NS_PER_MS, (double)dropped / NS_PER_MS);
+	clock->accumulatedNs -= dropped;
+	clock->droppedNs += dropped;
+	steps = MAX_STEPS_PER_FRAME;
+    }
+
+    clock->accumulatedNs -= steps * clock->stepNs;
+    return (u32)steps;
+}
+
+float FrameInterpolation(FrameClock* clock)
+{
+    return (float)clock->accumulatedNs / (float)clock->stepNs;
+}
+
+void PaceFrame(FrameClock* clock)
+{
+    u64 deadline = clock->nextFrameDeadlineNs;
+    u64 now = NowNs();
+
+    // A frame that ran long moves the schedule rather than making the next few frames
+    // rush to catch up
+    if(now >= deadline)
+    {
+	clock->nextFrameDeadlineNs = now + clock->frameNs;
+	return;
+    }
+
+    if(deadline - now > FRAME_PACER_SPIN_NS)
+    {
+	u64 wake = deadline - FRAME_PACER_SPIN_NS;
+	struct timespec wakeAt = {(time_t)(wake / NS_PER_SECOND), (long)(wake % NS_PER_SECOND)};
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeAt, NULL) == EINTR);
+    }
+
+    while(NowNs() < deadline);
+
+    clock->nextFrameDeadlineNs = deadline + clock->frameNs;
+}
@@ -0,0 +1,45 @@
+#ifndef __FRAME_CLOCK_H__
+#define __FRAME_CLOCK_H__
+
+#include "types.h"
+
+// Keeps the simulation ticking at a fixed rate whatever the frame rate is doing and
+// paces frames so they come out evenly.
+//
+// Each frame the measured time since the last frame is added to an accumulator and the
+// simulation is stepped for every whole step in it. Whatever is left over says how far
+// between the last two simulation steps the frame should be drawn. If we fall so far
+// behind that catching up would take more than MAX_STEPS_PER_FRAME steps the extra time
+// is dropped, the game slows down rather than spiralling into ever longer frames
+#define MAX_STEPS_PER_FRAME (5)
+
+// Sleeping is only good to a millisecond or so, the pacer sleeps until this close to the
+// deadline and then spins the rest of the way
+#define FRAME_PACER_SPIN_NS (1500000)
+
+typedef struct
+{
+    u64 stepNs;
+    u64 frameNs;
+
+    u64 lastFrameStartNs;
+    u64 nextFrameDeadlineNs;
+    u64 accumulatedNs;
+
+    float stepSeconds; // What the simulation systems should use as their dt
+    float lastFrameSeconds; // How long the last frame really took
+    u64 droppedNs; // Time thrown away because we could not catch up, since the clock started
+} FrameClock;
+
+FrameClock CreateFrameClock(u32 simulationHz, u32 targetFps);
+
+// Call at the start of a frame, returns how many simulation steps to run this frame
+u32 BeginFrame(FrameClock* clock);
+
+// Between 0 (draw the previous simulation step) and 1 (draw the latest one)
+float FrameInterpolation(FrameClock* clock);
+
+// Call at the end of a frame, waits until it is time for the next one
+void PaceFrame(FrameClock* clock);
+
+#endif
@@ -0,0 +1,204 @@
+#define NO_PRINT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+
+#include "logging.h"
+
+#include "libraryWatcher.h"
+#include "traceEvents.h"
+
+typedef struct
+{
+    pthread_t thread;
+    u8 started;
+
+    int inotifyFd;
+    int wakeFd; // Written to when there is something to retire or it is time to stop
+    au8 stopping;
+
+    char* filename;
+    char* basename; // Events are for the directory, this is the one we care about
+
+    PrepareLibraryFunction prepare;
+    DiscardLibraryFunction discard;
+    _Atomic(void*) prepared;
+    _Atomic(void*) retired;
+} LibraryWatcher;
+
+static LibraryWatcher watcher;
+
+// Did anything in this lot of events touch our file? If the queue overflowed we can't tell
+// so assume it did
+static u8 EventsChangeLibrary(char* events, ssize_t length)
+{
+    u8 changed = 0;
+    char* next = events;
+    while(next < events + length)
+    {
+	struct inotify_event* event = (struct inotify_event*)next;
+	if((event->mask & IN_Q_OVERFLOW) || (event->len && !strcmp(event->name, watcher.basename)))
+	    changed = 1;
+	next += sizeof(struct inotify_event) + event->len;
+    }
+    return changed;
+}
+
+static void* LibraryWatcherThread(void* unused)
+{
+    TRACE_THREAD_NAME("Library watcher");
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd waitOn[2] = {{watcher.inotifyFd, POLLIN, 0}, {watcher.wakeFd, POLLIN, 0}};
+
+    while(1)
+    {
+	if(poll(waitOn, 2, -1) < 0)
+	{
+	    if(errno == EINTR)
+		continue;
+	    DEBUG_ERR("Library watcher poll failed, no more hot reloading");
+	    break;
+	}
+
+	if(waitOn[1].revents)
+	{
+	    u64 wakeCount;
+	    if(read(watcher.wakeFd, &wakeCount, sizeof(wakeCount)) < 0)
+	    {
+		DEBUG_ERR("Unable to read from the library watcher's wake up fd");
+	    }
+
+	    void* retired = atomic_exchange(&watcher.retired, NULL);
+	    if(retired)
+	    {
+		TRACE_ZONE("RetireLibrary");
+		watcher.discard(retired);
+	    }
+
+	    if(atomic_load(&watcher.stopping))
+		break;
+	}
+
+	if(!waitOn[0].revents)
+	    continue;
+
+	ssize_t length = read(watcher.inotifyFd, events, sizeof(events));
+	if(length <= 0 || !EventsChangeLibrary(events, length))
+	    continue;
+
+	DEBUG_LOG("%s changed, preparing it", watcher.filename);
+	void* prepared;
+	{
+	    TRACE_ZONE("PrepareLibrary");
+	    prepared = watcher.prepare(watcher.filename);
+	}
+	if(!prepared)
+	    continue;
+
+	void* replaced = atomic_exchange(&watcher.prepared, prepared);
+	if(replaced)
+	    watcher.discard(replaced);
+    }
+
+    return NULL;
+}
+
+u8 StartLibraryWatcher(char* filename, PrepareLibraryFunction prepare, DiscardLibraryFunction discard)
+{
+    if(watcher.started)
+	return 1;
+
+    // Builds tend to write a new file rather than over the old one, so watch the directory
+    watcher.filename = strdup(filename);
+    char* lastSlash = strrchr(watcher.filename, '/');
+    watcher.basename = lastSlash ? (lastSlash + 1) : watcher.filename;
+
+    char* directory = lastSlash ? strndup(watcher.filename, lastSlash - watcher.filename + 1) : strdup(".");
+
+    watcher.inotifyFd = inotify_init1(IN_CLOEXEC);
+    watcher.wakeFd = eventfd(0, EFD_CLOEXEC);
+    u8 watching = (watcher.inotifyFd >= 0) && (watcher.wakeFd >= 0) &&
+	(inotify_add_watch(watcher.inotifyFd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) >= 0);
+    free(directory);
+
+    watcher.prepare = prepare;
+    watcher.discard = discard;
+    atomic_init(&watcher.prepared, NULL);
+    atomic_init(&watcher.retired, NULL);
+    atomic_init(&watcher.stopping, 0);
+
+    if(!watching || pthread_create(&watcher.thread, NULL, &LibraryWatcherThread, NULL))
+    {
+	DEBUG_ERR("Unable to watch %s, falling back to checking it every frame", filename);
+	if(watcher.inotifyFd >= 0)
+	    close(watcher.inotifyFd);
+	if(watcher.wakeFd >= 0)
+	    close(watcher.wakeFd);
+	free(watcher.filename);
+	return 0;
+    }
+
+    watcher.started = 1;
+    DEBUG_LOG("Watching %s for changes", filename);
+    return 1;
+}
+
+void StopLibraryWatcher()
+{
+    if(!watcher.started)
+	return;
+
+    atomic_store(&watcher.stopping, 1);
+    u64 wake = 1;
+    if(write(watcher.wakeFd, &wake, sizeof(wake)) != sizeof(wake))
+    {
+	DEBUG_ERR("Unable to tell the library watcher to stop");
+    }
+    pthread_join(watcher.thread, NULL);
+
+    close(watcher.inotifyFd);
+    close(watcher.wakeFd);
+    free(watcher.filename);
+
+    void* leftOver = atomic_exchange(&watcher.prepared, NULL);
+    if(leftOver)
+	watcher.discard(leftOver);
+    leftOver = atomic_exchange(&watcher.retired, NULL);
+    if(leftOver)
+	watcher.discard(leftOver);
+
+    watcher.started = 0;
+}
+
+void* TakePreparedLibrary()
+{
+    // Most frames there is nothing, don't dirty the cache line for them
+    if(!atomic_load_explicit(&watcher.prepared, memory_order_relaxed))
+	return NULL;
+
+    return atomic_exchange(&watcher.prepared, NULL);
+}
+
+void RetirePreparedLibrary(void* prepared)
+{
+    void* empty = NULL;
+    if(!watcher.started || !atomic_compare_exchange_strong(&watcher.retired, &empty, prepared))
+    {
+	watcher.discard(prepared);
+	return;
+    }
+
+    u64 wake = 1;
+    if(write(watcher.wakeFd, &wake, sizeof(wake)) != sizeof(wake))
+    {
+	DEBUG_ERR("Unable to wake the library watcher to retire a library");
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef __LIBRARY_WATCHER_H__
+#define __LIBRARY_WATCHER_H__
+
+#include "types.h"
+
+// Watches a library with inotify on a thread of its own so the frame loop never has to ask
+// the file system whether it changed. Writing the file (close after write) or renaming
+// something over it wakes the thread, which calls prepare straight away to get the new
+// version ready to load and then leaves the result for the frame loop to pick up.
+//
+// If another change lands before the last one was picked up the older result is handed
+// to discard, only the newest is ever loaded. Once a loaded library is finished with it can
+// be handed back to be discarded on the watcher thread too, unloading takes a while
+
+// Runs on the watcher thread, returns NULL if there is nothing worth loading
+typedef void* (*PrepareLibraryFunction)(char* filename);
+typedef void (*DiscardLibraryFunction)(void* prepared);
+
+// Returns 0 if the file can not be watched, the caller has to keep checking it themselves
+u8 StartLibraryWatcher(char* filename, PrepareLibraryFunction prepare, DiscardLibraryFunction discard);
+void StopLibraryWatcher();
+
+// The newest prepared library if there is one the caller has not had yet, otherwise NULL.
+// Never makes a system call
+void* TakePreparedLibrary();
+
+// Discards something prepare made on the watcher thread, only for while the watcher is
+// running. If it is still busy with the last one this one is discarded here and now
+void RetirePreparedLibrary(void* prepared);
+
+#endif
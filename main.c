@@ -2,7 +2,6 @@
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <unistd.h>
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_video.h>
@@ -10,14 +9,30 @@
 
 #include "keyHandling.h"
 #include "entityComponentSystem.h"
+#include "systemScheduler.h"
+#include "systemProfiler.h"
+#include "parallelFor.h"
+#include "frameClock.h"
+#include "traceEvents.h"
 #include "logging.h"
 #include "2dsprites.h"
+#include "spriteBatch.h"
+#include "renderQueue.h"
+#include "textureAtlas.h"
+#include "textureCache.h"
+#include "textureLoader.h"
+
+// Physics runs at a fixed rate, drawing happens as often as this allows
+#define SIMULATION_HZ (60)
+#define TARGET_FPS (60)
 
 static SDL_Window* window;
 static SDL_GLContext glContext;
 
 int main()
 {
+    TRACE_THREAD_NAME("Main");
+
     // Initialise SDL
     if(SDL_Init(SDL_INIT_VIDEO) < 0)
     {
@@ -57,10 +72,10 @@ int main()
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-    PrintFlagValue(Allocated);
-    PrintFlagValue(Position);
-    PrintFlagValue(Velocity);
-    PrintFlagValue(Health);
+    PrintComponentId(Allocated);
+    PrintComponentId(Position);
+    PrintComponentId(Velocity);
+    PrintComponentId(Health);
 
     World* world15 = CreateWorld(15);
   
@@ -68,24 +83,27 @@ int main()
     DEBUG_LOG("Creating 12 entities");
     for(i = 0; i < 12; ++i)
     {
-	u32 newEntity = NewEntityInWorld(world15, GetComponentFlag(Position));
+	EntityId newEntity = NewEntityInWorld(world15, GetComponentFlag(Position));
 	if(i%3 == 0)
 	{
-	  AddComponentsToEntityInWorld(world15, newEntity, GetComponentFlag(Position)|GetComponentFlag(Gravity)|GetComponentFlag(Velocity));
-	    Entity* entity = EntityFromWorld(world15, newEntity);
-	    entity->velocity->vyMax = 10;
-	    entity->velocity->vxMax = 5;
-	    entity->position->x = i * 35;
-	    entity->position->y = 10;
+	  AddComponentsToEntityInWorld(world15, newEntity, ComponentMaskOf(GetComponentId(Position), GetComponentId(PreviousPosition), GetComponentId(Gravity), GetComponentId(Velocity)));
+	    Entity entity = EntityFromWorld(world15, newEntity);
+	    EntityField(&entity, velocity, vyMax) = 10;
+	    EntityField(&entity, velocity, vxMax) = 5;
+	    EntityField(&entity, position, x) = i * 35;
+	    EntityField(&entity, position, y) = 10;
+	    EntityField(&entity, previousPosition, x) = i * 35;
+	    EntityField(&entity, previousPosition, y) = 10;
 
 	    SetRenderableSpriteForEntityInWorld(world15, newEntity, "./smilie.png", 50, 50);
 	}
-	DEBUG_LOG("Entity %d has id %d", i, newEntity);
+	DEBUG_LOG("Entity %d has id "EntityIdPrintfSymbol, i, EntityIdToPrintf(newEntity));
     }
 
     u8 run = 1;
 
     SDL_Event event;
+    FrameClock frameClock = CreateFrameClock(SIMULATION_HZ, TARGET_FPS);
     
     while(run)
     {
@@ -97,19 +115,48 @@ int main()
 	    }
 	}
 
-      
-	usleep(33333);
+
 	DEBUG_LOG("Loading systems");
 	LoadSystems("./lib/entitySystems.so");
-	DEBUG_LOG("Loaded systems, running them");
-	RunSystems(world15);
-	DEBUG_LOG("Systems run, terminating");
+
+	// Catch the simulation up to now in fixed steps
+	u32 steps = BeginFrame(&frameClock);
+	world15->lastTickDt = frameClock.stepSeconds;
+	world15->lastFrameDt = frameClock.lastFrameSeconds;
+	DEBUG_LOG("Loaded systems, running %d simulation steps", steps);
+	while(steps--)
+	    RunSimulationSystems(world15);
+
+	// Give back textures renderables dropped on other threads, then put whatever the
+	// loader has finished into the atlas before drawing
+	ReleaseQueuedTextures();
+	UploadDecodedTextures(TEXTURE_UPLOAD_BUDGET_BYTES);
+
+	// Then draw somewhere between the last two steps
+	world15->interpolation = FrameInterpolation(&frameClock);
+	RunFrameSystems(world15);
+	DEBUG_LOG("Systems run, parallelism %.2f", LastScheduleFrameStats().parallelism);
+	DEBUG_LOG("Drew %u sprites with %u binds in %u draw calls", LastRenderQueueStats().sprites, LastRenderQueueStats().textureBinds, LastRenderQueueStats().drawCalls);
 
 	DEBUG_LOG("Updating display");
-	SDL_GL_SwapWindow(window);
+	{
+	    TRACE_ZONE("SwapWindow");
+	    SDL_GL_SwapWindow(window);
+	}
+	PaceFrame(&frameClock);
     }
     
     // Cleanup stuff
+    StopWatchingSystems();
+    StopSystemScheduler();
+    DumpSystemProfiles(stdout);
+    StopParallelFor();
+    TRACE_WRITE("trace.json");
+    FreeRenderQueue();
+    FreeSpriteBatch();
+    StopTextureLoader();
+    FreeTextureCache();
+    FreeTextureAtlas();
     SDL_GL_DeleteContext(glContext);
     SDL_DestroyWindow(window);
     SDL_Quit();
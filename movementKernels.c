@@ -0,0 +1,601 @@
+#define NO_PRINT
+
+// Fusing the multiply and add in the move kernels changes the rounding, that would break
+// the promise that every kernel gives the same answer as the scalar one
+#pragma GCC optimize ("fp-contract=off")
+
+#include <stdio.h>
+#include <cpuid.h>
+#include <immintrin.h>
+
+#include "logging.h"
+
+#include "movementKernels.h"
+
+// Written to behave exactly like minps/maxps (second operand wins on NaN) so every
+// kernel agrees with the scalar ones bit for bit
+static inline float MinFloat(float a, float b)
+{
+    return (a < b) ? a : b;
+}
+
+static inline float MaxFloat(float a, float b)
+{
+    return (a > b) ? a : b;
+}
+
+static inline float ClampFloat(float value, float limit)
+{
+    return MaxFloat(MinFloat(value, limit), -limit);
+}
+
+#ifndef SOA_COMPONENTS
+
+// Velocity is 4 floats so one fits exactly in an SSE register, the max values ride along
+// in the top half and have to come back out untouched
+_Static_assert(sizeof(Velocity) == 4*sizeof(float), "SIMD kernels expect Velocity to be 4 floats");
+_Static_assert(sizeof(Position) == 2*sizeof(float), "SIMD kernels expect Position to be 2 floats");
+
+/*************************************************************************
+ **                               Scalar                                **
+ *************************************************************************/
+
+static inline void ClampVelocityScalar(Velocity* velocity)
+{
+    velocity->vx = ClampFloat(velocity->vx, velocity->vxMax);
+    velocity->vy = ClampFloat(velocity->vy, velocity->vyMax);
+}
+
+static inline void ApplyGravityScalarRange(Velocity* restrict velocities, u32 start, u32 count, float dv)
+{
+    u32 idx;
+    for(idx = start; idx < count; ++idx)
+    {
+	velocities[idx].vy += dv;
+	velocities[idx].vx = 0;
+    }
+}
+
+static inline void MoveEntitiesScalarRange(Position* restrict positions, Velocity* restrict velocities, u32 start, u32 count, float dt)
+{
+    u32 idx;
+    for(idx = start; idx < count; ++idx)
+    {
+	ClampVelocityScalar(&velocities[idx]);
+	positions[idx].x += (dt * velocities[idx].vx);
+	positions[idx].y += (dt * velocities[idx].vy);
+    }
+}
+
+static void ApplyGravityScalar(Velocity* restrict velocities, u32 count, float dt)
+{
+    ApplyGravityScalarRange(velocities, 0, count, dt * GRAVITY);
+}
+
+static void ClampVelocitiesScalar(Velocity* restrict velocities, u32 count)
+{
+    u32 idx;
+    for(idx = 0; idx < count; ++idx)
+	ClampVelocityScalar(&velocities[idx]);
+}
+
+static void MoveEntitiesScalar(Position* restrict positions, Velocity* restrict velocities, u32 count, float dt)
+{
+    MoveEntitiesScalarRange(positions, velocities, 0, count, dt);
+}
+
+/*************************************************************************
+ **                                SSE2                                 **
+ *************************************************************************/
+
+// vx and vy are clamped against vxMax and vyMax, the max values are passed straight through
+static inline __m128 ClampVelocitySSE2(__m128 velocity)
+{
+    __m128 limit = _mm_shuffle_ps(velocity, velocity, _MM_SHUFFLE(3,2,3,2));
+    __m128 negativeLimit = _mm_xor_ps(limit, _mm_set1_ps(-0.0f));
+    __m128 clamped = _mm_max_ps(_mm_min_ps(velocity, limit), negativeLimit);
+    return _mm_shuffle_ps(clamped, velocity, _MM_SHUFFLE(3,2,1,0));
+}
+
+// Clear vx and add dv to vy, adding -0 leaves the max values exactly as they were
+#define GRAVITY_DELTA(dv) (-0.0f), (dv), (-0.0f), (-0.0f)
+
+static void ApplyGravitySSE2(Velocity* restrict velocities, u32 count, float dt)
+{
+    float dv = dt * GRAVITY;
+    __m128 keep = _mm_castsi128_ps(_mm_setr_epi32(0, -1, -1, -1));
+    __m128 delta = _mm_setr_ps(GRAVITY_DELTA(dv));
+
+    u32 idx;
+    for(idx = 0; idx < count; ++idx)
+    {
+	float* velocity = (float*)&velocities[idx];
+	_mm_storeu_ps(velocity, _mm_add_ps(_mm_and_ps(_mm_loadu_ps(velocity), keep), delta));
+    }
+}
+
+static void ClampVelocitiesSSE2(Velocity* restrict velocities, u32 count)
+{
+    u32 idx;
+    for(idx = 0; idx < count; ++idx)
+    {
+	float* velocity = (float*)&velocities[idx];
+	_mm_storeu_ps(velocity, ClampVelocitySSE2(_mm_loadu_ps(velocity)));
+    }
+}
+
+// Two entities at a time, that is one register of positions
+static void MoveEntitiesSSE2(Position* restrict positions, Velocity* restrict velocities, u32 count, float dt)
+{
+    __m128 dtv = _mm_set1_ps(dt);
+
+    u32 idx;
+    for(idx = 0; idx + 2 <= count; idx += 2)
+    {
+	float* velocity = (float*)&velocities[idx];
+	float* position = (float*)&positions[idx];
+
+	__m128 first = ClampVelocitySSE2(_mm_loadu_ps(velocity));
+	__m128 second = ClampVelocitySSE2(_mm_loadu_ps(velocity + 4));
+	_mm_storeu_ps(velocity, first);
+	_mm_storeu_ps(velocity + 4, second);
+
+	__m128 step = _mm_mul_ps(_mm_movelh_ps(first, second), dtv);
+	_mm_storeu_ps(position, _mm_add_ps(_mm_loadu_ps(position), step));
+    }
+
+    MoveEntitiesScalarRange(positions, velocities, idx, count, dt);
+}
+
+/*************************************************************************
+ **                                AVX2                                 **
+ *************************************************************************/
+
+// Each 128 bit lane holds one velocity so the SSE2 shuffles work per lane
+__attribute__((target("avx2")))
+static inline __m256 ClampVelocityLanesAVX2(__m256 velocities)
+{
+    __m256 limit = _mm256_shuffle_ps(velocities, velocities, _MM_SHUFFLE(3,2,3,2));
+    __m256 negativeLimit = _mm256_xor_ps(limit, _mm256_set1_ps(-0.0f));
+    __m256 clamped = _mm256_max_ps(_mm256_min_ps(velocities, limit), negativeLimit);
+    return _mm256_blend_ps(clamped, velocities, 0xcc);
+}
+
+__attribute__((target("avx2")))
+static void ApplyGravityAVX2(Velocity* restrict velocities, u32 count, float dt)
+{
+    float dv = dt * GRAVITY;
+    __m256 keep = _mm256_castsi256_ps(_mm256_setr_epi32(0, -1, -1, -1, 0, -1, -1, -1));
+    __m128 laneDelta = _mm_setr_ps(GRAVITY_DELTA(dv));
+    __m256 delta = _mm256_broadcast_ps(&laneDelta);
+
+    u32 idx;
+    for(idx = 0; idx + 2 <= count; idx += 2)
+    {
+	float* velocity = (float*)&velocities[idx];
+	_mm256_storeu_ps(velocity, _mm256_add_ps(_mm256_and_ps(_mm256_loadu_ps(velocity), keep), delta));
+    }
+
+    ApplyGravityScalarRange(velocities, idx, count, dv);
+}
+
+__attribute__((target("avx2")))
+static void ClampVelocitiesAVX2(Velocity* restrict velocities, u32 count)
+{
+    u32 idx;
+    for(idx = 0; idx + 2 <= count; idx += 2)
+    {
+	float* velocity = (float*)&velocities[idx];
+	_mm256_storeu_ps(velocity, ClampVelocityLanesAVX2(_mm256_loadu_ps(velocity)));
+    }
+
+    for(; idx < count; ++idx)
+	ClampVelocityScalar(&velocities[idx]);
+}
+
+// Four entities at a time
+__attribute__((target("avx2")))
+static void MoveEntitiesAVX2(Position* restrict positions, Velocity* restrict velocities, u32 count, float dt)
+{
+    __m256 dtv = _mm256_set1_ps(dt);
+
+    u32 idx;
+    for(idx = 0; idx + 4 <= count; idx += 4)
+    {
+	float* velocity = (float*)&velocities[idx];
+	float* position = (float*)&positions[idx];
+
+	__m256 first = ClampVelocityLanesAVX2(_mm256_loadu_ps(velocity));
+	__m256 second = ClampVelocityLanesAVX2(_mm256_loadu_ps(velocity + 8));
+	_mm256_storeu_ps(velocity, first);
+	_mm256_storeu_ps(velocity + 8, second);
+
+	// Gives entities 0 2 1 3, swap the middle pairs to line up with the positions
+	__m256 interleaved = _mm256_shuffle_ps(first, second, _MM_SHUFFLE(1,0,1,0));
+	__m256 ordered = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(interleaved), _MM_SHUFFLE(3,1,2,0)));
+
+	__m256 step = _mm256_mul_ps(ordered, dtv);
+	_mm256_storeu_ps(position, _mm256_add_ps(_mm256_loadu_ps(position), step));
+    }
+
+    MoveEntitiesScalarRange(positions, velocities, idx, count, dt);
+}
+
+/*************************************************************************
+ **                               AVX-512                               **
+ *************************************************************************/
+
+#define AVX512_MAX_LANES (0xcccc)
+
+__attribute__((target("avx512f")))
+static inline __m512 ClampVelocityLanesAVX512(__m512 velocities)
+{
+    __m512 limit = _mm512_permute_ps(velocities, _MM_SHUFFLE(3,2,3,2));
+    __m512 negativeLimit = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(limit), _mm512_set1_epi32(0x80000000)));
+    __m512 clamped = _mm512_max_ps(_mm512_min_ps(velocities, limit), negativeLimit);
+    return _mm512_mask_blend_ps(AVX512_MAX_LANES, clamped, velocities);
+}
+
+__attribute__((target("avx512f")))
+static void ApplyGravityAVX512(Velocity* restrict velocities, u32 count, float dt)
+{
+    float dv = dt * GRAVITY;
+    __m512 delta = _mm512_broadcast_f32x4(_mm_setr_ps(GRAVITY_DELTA(dv)));
+
+    u32 idx;
+    for(idx = 0; idx + 4 <= count; idx += 4)
+    {
+	float* velocity = (float*)&velocities[idx];
+
+	// Zero vx in every lane with a mask rather than an and
+	__m512 kept = _mm512_maskz_mov_ps(0xeeee, _mm512_loadu_ps(velocity));
+	_mm512_storeu_ps(velocity, _mm512_add_ps(kept, delta));
+    }
+
+    ApplyGravityScalarRange(velocities, idx, count, dv);
+}
+
+__attribute__((target("avx512f")))
+static void ClampVelocitiesAVX512(Velocity* restrict velocities, u32 count)
+{
+    u32 idx;
+    for(idx = 0; idx + 4 <= count; idx += 4)
+    {
+	float* velocity = (float*)&velocities[idx];
+	_mm512_storeu_ps(velocity, ClampVelocityLanesAVX512(_mm512_loadu_ps(velocity)));
+    }
+
+    for(; idx < count; ++idx)
+	ClampVelocityScalar(&velocities[idx]);
+}
+
+// Eight entities at a time
+__attribute__((target("avx512f")))
+static void MoveEntitiesAVX512(Position* restrict positions, Velocity* restrict velocities, u32 count, float dt)
+{
+    __m512 dtv = _mm512_set1_ps(dt);
+    __m512i order = _mm512_setr_epi64(0, 2, 4, 6, 1, 3, 5, 7);
+
+    u32 idx;
+    for(idx = 0; idx + 8 <= count; idx += 8)
+    {
+	float* velocity = (float*)&velocities[idx];
+	float* position = (float*)&positions[idx];
+
+	__m512 first = ClampVelocityLanesAVX512(_mm512_loadu_ps(velocity));
+	__m512 second = ClampVelocityLanesAVX512(_mm512_loadu_ps(velocity + 16));
+	_mm512_storeu_ps(velocity, first);
+	_mm512_storeu_ps(velocity + 16, second);
+
+	// Gives entities 0 4 1 5 2 6 3 7, put them back in order to match the positions
+	__m512 interleaved = _mm512_shuffle_ps(first, second, _MM_SHUFFLE(1,0,1,0));
+	__m512 ordered = _mm512_castpd_ps(_mm512_permutexvar_pd(order, _mm512_castps_pd(interleaved)));
+
+	__m512 step = _mm512_mul_ps(ordered, dtv);
+	_mm512_storeu_ps(position, _mm512_add_ps(_mm512_loadu_ps(position), step));
+    }
+
+    MoveEntitiesScalarRange(positions, velocities, idx, count, dt);
+}
+
+#else
+
+// With every field in its own cache line aligned array the kernels are straight loops over
+// whole registers of a single field, no shuffling and every load is aligned. Only the
+// last few entities of a batch that don't fill a register go through the scalar code
+
+/*************************************************************************
+ **                          Scalar (split)                             **
+ *************************************************************************/
+
+static inline void ApplyGravityScalarRange(VelocityArray velocities, u32 start, u32 count, float dv)
+{
+    u32 idx;
+    for(idx = start; idx < count; ++idx)
+    {
+	velocities.vy[idx] += dv;
+	velocities.vx[idx] = 0;
+    }
+}
+
+static inline void ClampVelocitiesScalarRange(VelocityArray velocities, u32 start, u32 count)
+{
+    u32 idx;
+    for(idx = start; idx < count; ++idx)
+    {
+	velocities.vx[idx] = ClampFloat(velocities.vx[idx], velocities.vxMax[idx]);
+	velocities.vy[idx] = ClampFloat(velocities.vy[idx], velocities.vyMax[idx]);
+    }
+}
+
+static inline void MoveEntitiesScalarRange(PositionArray positions, VelocityArray velocities, u32 start, u32 count, float dt)
+{
+    u32 idx;
+    for(idx = start; idx < count; ++idx)
+    {
+	float vx = ClampFloat(velocities.vx[idx], velocities.vxMax[idx]);
+	float vy = ClampFloat(velocities.vy[idx], velocities.vyMax[idx]);
+	velocities.vx[idx] = vx;
+	velocities.vy[idx] = vy;
+	positions.x[idx] += (dt * vx);
+	positions.y[idx] += (dt * vy);
+    }
+}
+
+static void ApplyGravityScalar(VelocityArray velocities, u32 count, float dt)
+{
+    ApplyGravityScalarRange(velocities, 0, count, dt * GRAVITY);
+}
+
+static void ClampVelocitiesScalar(VelocityArray velocities, u32 count)
+{
+    ClampVelocitiesScalarRange(velocities, 0, count);
+}
+
+static void MoveEntitiesScalar(PositionArray positions, VelocityArray velocities, u32 count, float dt)
+{
+    MoveEntitiesScalarRange(positions, velocities, 0, count, dt);
+}
+
+/*************************************************************************
+ **                           SSE2 (split)                              **
+ *************************************************************************/
+
+static inline __m128 ClampSSE2(__m128 value, __m128 limit)
+{
+    return _mm_max_ps(_mm_min_ps(value, limit), _mm_xor_ps(limit, _mm_set1_ps(-0.0f)));
+}
+
+static void ApplyGravitySSE2(VelocityArray velocities, u32 count, float dt)
+{
+    float dv = dt * GRAVITY;
+    __m128 dvv = _mm_set1_ps(dv);
+
+    u32 idx;
+    for(idx = 0; idx + 4 <= count; idx += 4)
+    {
+	_mm_store_ps(velocities.vy + idx, _mm_add_ps(_mm_load_ps(velocities.vy + idx), dvv));
+	_mm_store_ps(velocities.vx + idx, _mm_setzero_ps());
+    }
+
+    ApplyGravityScalarRange(velocities, idx, count, dv);
+}
+
+static void ClampVelocitiesSSE2(VelocityArray velocities, u32 count)
+{
+    u32 idx;
+    for(idx = 0; idx + 4 <= count; idx += 4)
+    {
+	_mm_store_ps(velocities.vx + idx, ClampSSE2(_mm_load_ps(velocities.vx + idx), _mm_load_ps(velocities.vxMax + idx)));
+	_mm_store_ps(velocities.vy + idx, ClampSSE2(_mm_load_ps(velocities.vy + idx), _mm_load_ps(velocities.vyMax + idx)));
+    }
+
+    ClampVelocitiesScalarRange(velocities, idx, count);
+}
+
+static void MoveEntitiesSSE2(PositionArray positions, VelocityArray velocities, u32 count, float dt)
+{
+    __m128 dtv = _mm_set1_ps(dt);
+
+    u32 idx;
+    for(idx = 0; idx + 4 <= count; idx += 4)
+    {
+	__m128 vx = ClampSSE2(_mm_load_ps(velocities.vx + idx), _mm_load_ps(velocities.vxMax + idx));
+	__m128 vy = ClampSSE2(_mm_load_ps(velocities.vy + idx), _mm_load_ps(velocities.vyMax + idx));
+	_mm_store_ps(velocities.vx + idx, vx);
+	_mm_store_ps(velocities.vy + idx, vy);
+	_mm_store_ps(positions.x + idx, _mm_add_ps(_mm_load_ps(positions.x + idx), _mm_mul_ps(vx, dtv)));
+	_mm_store_ps(positions.y + idx, _mm_add_ps(_mm_load_ps(positions.y + idx), _mm_mul_ps(vy, dtv)));
+    }
+
+    MoveEntitiesScalarRange(positions, velocities, idx, count, dt);
+}
+
+/*************************************************************************
+ **                           AVX2 (split)                              **
+ *************************************************************************/
+
+__attribute__((target("avx2")))
+static inline __m256 ClampAVX2(__m256 value, __m256 limit)
+{
+    return _mm256_max_ps(_mm256_min_ps(value, limit), _mm256_xor_ps(limit, _mm256_set1_ps(-0.0f)));
+}
+
+__attribute__((target("avx2")))
+static void ApplyGravityAVX2(VelocityArray velocities, u32 count, float dt)
+{
+    float dv = dt * GRAVITY;
+    __m256 dvv = _mm256_set1_ps(dv);
+
+    u32 idx;
+    for(idx = 0; idx + 8 <= count; idx += 8)
+    {
+	_mm256_store_ps(velocities.vy + idx, _mm256_add_ps(_mm256_load_ps(velocities.vy + idx), dvv));
+	_mm256_store_ps(velocities.vx + idx, _mm256_setzero_ps());
+    }
+
+    ApplyGravityScalarRange(velocities, idx, count, dv);
+}
+
+__attribute__((target("avx2")))
+static void ClampVelocitiesAVX2(VelocityArray velocities, u32 count)
+{
+    u32 idx;
+    for(idx = 0; idx + 8 <= count; idx += 8)
+    {
+	_mm256_store_ps(velocities.vx + idx, ClampAVX2(_mm256_load_ps(velocities.vx + idx), _mm256_load_ps(velocities.vxMax + idx)));
+	_mm256_store_ps(velocities.vy + idx, ClampAVX2(_mm256_load_ps(velocities.vy + idx), _mm256_load_ps(velocities.vyMax + idx)));
+    }
+
+    ClampVelocitiesScalarRange(velocities, idx, count);
+}
+
+__attribute__((target("avx2")))
+static void MoveEntitiesAVX2(PositionArray positions, VelocityArray velocities, u32 count, float dt)
+{
+    __m256 dtv = _mm256_set1_ps(dt);
+
+    u32 idx;
+    for(idx = 0; idx + 8 <= count; idx += 8)
+    {
+	__m256 vx = ClampAVX2(_mm256_load_ps(velocities.vx + idx), _mm256_load_ps(velocities.vxMax + idx));
+	__m256 vy = ClampAVX2(_mm256_load_ps(velocities.vy + idx), _mm256_load_ps(velocities.vyMax + idx));
+	_mm256_store_ps(velocities.vx + idx, vx);
+	_mm256_store_ps(velocities.vy + idx, vy);
+	_mm256_store_ps(positions.x + idx, _mm256_add_ps(_mm256_load_ps(positions.x + idx), _mm256_mul_ps(vx, dtv)));
+	_mm256_store_ps(positions.y + idx, _mm256_add_ps(_mm256_load_ps(positions.y + idx), _mm256_mul_ps(vy, dtv)));
+    }
+
+    MoveEntitiesScalarRange(positions, velocities, idx, count, dt);
+}
+
+/*************************************************************************
+ **                          AVX-512 (split)                            **
+ *************************************************************************/
+
+// A whole cache line of one field per register
+__attribute__((target("avx512f")))
+static inline __m512 ClampAVX512(__m512 value, __m512 limit)
+{
+    __m512 negativeLimit = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(limit), _mm512_set1_epi32(0x80000000)));
+    return _mm512_max_ps(_mm512_min_ps(value, limit), negativeLimit);
+}
+
+__attribute__((target("avx512f")))
+static void ApplyGravityAVX512(VelocityArray velocities, u32 count, float dt)
+{
+    float dv = dt * GRAVITY;
+    __m512 dvv = _mm512_set1_ps(dv);
+
+    u32 idx;
+    for(idx = 0; idx + 16 <= count; idx += 16)
+    {
+	_mm512_store_ps(velocities.vy + idx, _mm512_add_ps(_mm512_load_ps(velocities.vy + idx), dvv));
+	_mm512_store_ps(velocities.vx + idx, _mm512_setzero_ps());
+    }
+
+    ApplyGravityScalarRange(velocities, idx, count, dv);
+}
+
+__attribute__((target("avx512f")))
+static void ClampVelocitiesAVX512(VelocityArray velocities, u32 count)
+{
+    u32 idx;
+    for(idx = 0; idx + 16 <= count; idx += 16)
+    {
+	_mm512_store_ps(velocities.vx + idx, ClampAVX512(_mm512_load_ps(velocities.vx + idx), _mm512_load_ps(velocities.vxMax + idx)));
+	_mm512_store_ps(velocities.vy + idx, ClampAVX512(_mm512_load_ps(velocities.vy + idx), _mm512_load_ps(velocities.vyMax + idx)));
+    }
+
+    ClampVelocitiesScalarRange(velocities, idx, count);
+}
+
+__attribute__((target("avx512f")))
+static void MoveEntitiesAVX512(PositionArray positions, VelocityArray velocities, u32 count, float dt)
+{
+    __m512 dtv = _mm512_set1_ps(dt);
+
+    u32 idx;
+    for(idx = 0; idx + 16 <= count; idx += 16)
+    {
+	__m512 vx = ClampAVX512(_mm512_load_ps(velocities.vx + idx), _mm512_load_ps(velocities.vxMax + idx));
+	__m512 vy = ClampAVX512(_mm512_load_ps(velocities.vy + idx), _mm512_load_ps(velocities.vyMax + idx));
+	_mm512_store_ps(velocities.vx + idx, vx);
+	_mm512_store_ps(velocities.vy + idx, vy);
+	_mm512_store_ps(positions.x + idx, _mm512_add_ps(_mm512_load_ps(positions.x + idx), _mm512_mul_ps(vx, dtv)));
+	_mm512_store_ps(positions.y + idx, _mm512_add_ps(_mm512_load_ps(positions.y + idx), _mm512_mul_ps(vy, dtv)));
+    }
+
+    MoveEntitiesScalarRange(positions, velocities, idx, count, dt);
+}
+
+#endif
+
+/*************************************************************************
+ **                              Dispatch                               **
+ *************************************************************************/
+
+// Which register state the OS has agreed to save for us
+static inline u64 ReadXCR0()
+{
+    u32 eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((u64)edx << 32) | eax;
+}
+
+#define XCR0_AVX_STATE    (0x06) // XMM and YMM
+#define XCR0_AVX512_STATE (0xe6) // As above plus opmask and both halves of ZMM
+
+KernelLevel SupportedKernelLevel()
+{
+    u32 eax, ebx, ecx, edx;
+
+    // Every x86-64 CPU has SSE2
+    KernelLevel ret = KernelsSSE2;
+
+    if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE))
+	return ret;
+
+    u64 xcr0 = ReadXCR0();
+    if((xcr0 & XCR0_AVX_STATE) != XCR0_AVX_STATE)
+	return ret;
+
+    if(__get_cpuid_max(0, NULL) < 7)
+	return ret;
+
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+    if(ebx & bit_AVX2)
+	ret = KernelsAVX2;
+
+    if((ebx & bit_AVX512F) && ((xcr0 & XCR0_AVX512_STATE) == XCR0_AVX512_STATE))
+	ret = KernelsAVX512;
+
+    return ret;
+}
+
+static const MovementKernels allMovementKernels[__KERNEL_LEVEL_COUNT__] =
+{
+    {ApplyGravityScalar, ClampVelocitiesScalar, MoveEntitiesScalar, KernelsScalar, "scalar"},
+    {ApplyGravitySSE2,   ClampVelocitiesSSE2,   MoveEntitiesSSE2,   KernelsSSE2,   "SSE2"},
+    {ApplyGravityAVX2,   ClampVelocitiesAVX2,   MoveEntitiesAVX2,   KernelsAVX2,   "AVX2"},
+    {ApplyGravityAVX512, ClampVelocitiesAVX512, MoveEntitiesAVX512, KernelsAVX512, "AVX-512"},
+};
+
+MovementKernels MovementKernelsForLevel(KernelLevel level)
+{
+    KernelLevel supported = SupportedKernelLevel();
+    if(level > supported)
+	level = supported;
+
+    return allMovementKernels[level];
+}
+
+MovementKernels movementKernels;
+
+// Pick once when the systems library is loaded, a reload picks again
+__attribute__((constructor)) static void SelectMovementKernels()
+{
+    movementKernels = MovementKernelsForLevel(__KERNEL_LEVEL_COUNT__ - 1);
+    DEBUG_LOG("Using %s movement kernels", movementKernels.name);
+}
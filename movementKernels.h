@@ -0,0 +1,44 @@
+#ifndef __MOVEMENT_KERNELS_H__
+#define __MOVEMENT_KERNELS_H__
+
+#include "types.h"
+#include "entityComponentSystem.h"
+
+#define GRAVITY (9.81f)
+
+// The widest instruction set each kernel set uses, we pick the best the CPU supports
+typedef enum
+{
+    KernelsScalar = 0,
+    KernelsSSE2,
+    KernelsAVX2,
+    KernelsAVX512,
+
+    __KERNEL_LEVEL_COUNT__
+} KernelLevel;
+
+// Batch kernels for the movement systems. Every version gives bit for bit the same
+// results as the scalar one, including the velocity clamp which is branchless. The one
+// exception is adding two NaNs, the result is a NaN either way but which one the CPU
+// keeps depends on the operand order the compiler picked. tests/movementKernelTests.c
+// checks this for every level the CPU supports.
+// With SOA_COMPONENTS the arrays must start on a cache line, batch arrays always do
+typedef struct
+{
+    void (*applyGravity)(VelocityArray velocities, u32 count, float dt);
+    void (*clampVelocities)(VelocityArray velocities, u32 count);
+    void (*moveEntities)(PositionArray positions, VelocityArray velocities, u32 count, float dt);
+    KernelLevel level;
+    const char* name;
+} MovementKernels;
+
+// What the CPU (and OS) we are running on can actually do
+KernelLevel SupportedKernelLevel();
+
+// Kernels for a specific level, asking for more than is supported falls back to the best we have
+MovementKernels MovementKernelsForLevel(KernelLevel level);
+
+// The kernels picked at load time
+extern MovementKernels movementKernels;
+
+#endif
@@ -0,0 +1,337 @@
+#define NO_PRINT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "logging.h"
+
+#include "parallelFor.h"
+#include "traceEvents.h"
+
+// A range of chunk indices, the owner pops from the bottom and thieves take from the top.
+// Both ends live in one word so a single compare and swap claims a chunk from either end
+typedef struct
+{
+    au64 range; // Top in the high half, bottom (one past the last chunk) in the low half
+} __attribute__((aligned(CACHE_LINE_BYTES))) ChunkDeque;
+
+#define DequeRange(top, bottom) ((((u64)(top)) << 32) | (bottom))
+#define DequeTop(range) ((u32)((range) >> 32))
+#define DequeBottom(range) ((u32)((range) & 0xffffffff))
+#define NO_CHUNK (0xffffffff)
+
+typedef struct
+{
+    EntityBatch** batches;
+    u32 batchCount;
+    u32 chunkSize;
+    BatchFunction function;
+    void* userData;
+
+    ChunkDeque deques[MAX_PARALLEL_FOR_WORKERS + 1];
+    u32 dequeCount;
+    au32 nextDeque; // The next deque to hand to a thread joining in, the caller always has 0
+
+    u32 helperCount; // Pool threads inside the job, protected by the pool lock
+} ParallelForJob;
+
+// Somewhere to gather a query's batches. Every job needs one while it runs and several can
+// be running at once (or nested), so finished ones go back to the pool to be reused
+typedef struct BatchList
+{
+    struct BatchList* next;
+    EntityBatch** batches;
+    u32 capacity;
+} BatchList;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t jobPosted;
+    pthread_cond_t helperLeft;
+
+    pthread_t workers[MAX_PARALLEL_FOR_WORKERS];
+    u32 workerCount;
+    u8 started;
+    u8 stopping;
+
+    ParallelForJob* jobs[MAX_PARALLEL_FOR_JOBS];
+    u32 jobCount;
+
+    BatchList* spareBatchLists; // Protected by the lock
+} ParallelForPool;
+
+static ParallelForPool pool =
+{
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .jobPosted = PTHREAD_COND_INITIALIZER,
+    .helperLeft = PTHREAD_COND_INITIALIZER,
+};
+
+static inline u32 PopChunk(ChunkDeque* deque)
+{
+    u64 range = atomic_load(&deque->range);
+    while(DequeTop(range) < DequeBottom(range))
+    {
+	if(atomic_compare_exchange_weak(&deque->range, &range, DequeRange(DequeTop(range), DequeBottom(range) - 1)))
+	    return DequeBottom(range) - 1;
+    }
+    return NO_CHUNK;
+}
+
+static inline u32 StealChunk(ChunkDeque* deque)
+{
+    u64 range = atomic_load(&deque->range);
+    while(DequeTop(range) < DequeBottom(range))
+    {
+	if(atomic_compare_exchange_weak(&deque->range, &range, DequeRange(DequeTop(range) + 1, DequeBottom(range))))
+	    return DequeTop(range);
+    }
+    return NO_CHUNK;
+}
+
+static inline void RunChunk(ParallelForJob* job, u32 chunk)
+{
+    u32 batchIdx = chunk * job->chunkSize;
+    u32 lastBatch = batchIdx + job->chunkSize;
+    if(lastBatch > job->batchCount)
+	lastBatch = job->batchCount;
+
+    for(; batchIdx < lastBatch; ++batchIdx)
+	job->function(job->batches[batchIdx], job->userData);
+}
+
+// Drain our own deque then go stealing until there is nothing left anywhere
+static void WorkOnJob(ParallelForJob* job, u32 ownDeque)
+{
+    TRACE_ZONE("ParallelFor");
+
+    u32 chunk;
+    if(ownDeque < job->dequeCount)
+    {
+	while((chunk = PopChunk(&job->deques[ownDeque])) != NO_CHUNK)
+	    RunChunk(job, chunk);
+    }
+
+    u32 victim;
+    for(victim = 1; victim <= job->dequeCount; ++victim)
+    {
+	ChunkDeque* deque = &job->deques[(ownDeque + victim) % job->dequeCount];
+	while((chunk = StealChunk(deque)) != NO_CHUNK)
+	    RunChunk(job, chunk);
+    }
+}
+
+// Any job which still has work that no one has claimed yet, called with the lock held
+static inline ParallelForJob* JobNeedingHelp()
+{
+    u32 jobIdx;
+    for(jobIdx = 0; jobIdx < pool.jobCount; ++jobIdx)
+    {
+	if(atomic_load(&pool.jobs[jobIdx]->nextDeque) < pool.jobs[jobIdx]->dequeCount)
+	    return pool.jobs[jobIdx];
+    }
+    return NULL;
+}
+
+static void* ParallelForWorker(void* unused)
+{
+    TRACE_THREAD_NAME("Parallel for worker");
+
+    pthread_mutex_lock(&pool.lock);
+    while(1)
+    {
+	ParallelForJob* job;
+	while(!(job = JobNeedingHelp()) && !pool.stopping)
+	    pthread_cond_wait(&pool.jobPosted, &pool.lock);
+
+	if(pool.stopping)
+	    break;
+
+	job->helperCount++;
+	pthread_mutex_unlock(&pool.lock);
+
+	// Joining late just means we start out stealing
+	WorkOnJob(job, atomic_fetch_add(&job->nextDeque, 1));
+
+	pthread_mutex_lock(&pool.lock);
+	if(!--job->helperCount)
+	    pthread_cond_broadcast(&pool.helperLeft);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    return NULL;
+}
+
+void StartParallelFor(u32 workerCount)
+{
+    if(pool.started)
+	return;
+
+    if(!workerCount)
+    {
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	workerCount = (cores > 1) ? (u32)(cores - 1) : 0;
+    }
+
+    if(workerCount > MAX_PARALLEL_FOR_WORKERS)
+	workerCount = MAX_PARALLEL_FOR_WORKERS;
+
+    pool.stopping = 0;
+    pool.workerCount = 0;
+    while(pool.workerCount < workerCount)
+    {
+	if(pthread_create(&pool.workers[pool.workerCount], NULL, &ParallelForWorker, NULL))
+	{
+	    DEBUG_ERR("Unable to start parallel for worker %d, carrying on with what we have", pool.workerCount);
+	    break;
+	}
+	pool.workerCount++;
+    }
+
+    pool.started = 1;
+    DEBUG_LOG("Parallel for pool started with %d workers", pool.workerCount);
+}
+
+void StopParallelFor()
+{
+    if(!pool.started)
+	return;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = 1;
+    pthread_cond_broadcast(&pool.jobPosted);
+    pthread_mutex_unlock(&pool.lock);
+
+    while(pool.workerCount)
+	pthread_join(pool.workers[--pool.workerCount], NULL);
+
+    // Nothing can be running a job now we are stopping
+    while(pool.spareBatchLists)
+    {
+	BatchList* list = pool.spareBatchLists;
+	pool.spareBatchLists = list->next;
+	free(list->batches);
+	free(list);
+    }
+
+    pool.started = 0;
+}
+
+u32 ParallelForThreadCount()
+{
+    return pool.workerCount + 1;
+}
+
+// A list big enough for every batch in the world. Lists only get new memory when there are
+// more jobs at once than ever before or the world has grown
+static BatchList* TakeBatchList(World* world)
+{
+    pthread_mutex_lock(&pool.lock);
+    BatchList* list = pool.spareBatchLists;
+    if(list)
+	pool.spareBatchLists = list->next;
+    pthread_mutex_unlock(&pool.lock);
+
+    if(!list)
+	list = calloc(1, sizeof(BatchList));
+
+    if(list->capacity < world->batchCapacity)
+    {
+	free(list->batches);
+	list->capacity = world->batchCapacity;
+	list->batches = malloc(list->capacity * sizeof(EntityBatch*));
+    }
+
+    return list;
+}
+
+static void GiveBackBatchList(BatchList* list)
+{
+    pthread_mutex_lock(&pool.lock);
+    list->next = pool.spareBatchLists;
+    pool.spareBatchLists = list;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Gather up the batches a query would visit so they can be handed out by index
+static u32 BatchesInQuery(World* world, ComponentFlags requires, EntityBatch** batches)
+{
+    u32 count = 0;
+    BatchQuery query = BeginBatchQuery(world, requires);
+    while(NextBatchInQuery(&query))
+	batches[count++] = query.batch;
+
+    return count;
+}
+
+void ParallelForBatchesInQuery(World* world, ComponentFlags requires, BatchFunction function, void* userData)
+{
+    if(!pool.started)
+	StartParallelFor(0);
+
+    BatchList* batchList = TakeBatchList(world);
+
+    ParallelForJob job;
+    job.batches = batchList->batches;
+    job.batchCount = BatchesInQuery(world, requires, job.batches);
+    job.function = function;
+    job.userData = userData;
+
+    // Not worth waking anyone up for
+    if(job.batchCount <= 1 || !pool.workerCount)
+    {
+	u32 batchIdx;
+	for(batchIdx = 0; batchIdx < job.batchCount; ++batchIdx)
+	    function(job.batches[batchIdx], userData);
+	GiveBackBatchList(batchList);
+	return;
+    }
+
+    // Deal the chunks out evenly, stealing sorts out any unevenness in how long they take
+    job.dequeCount = pool.workerCount + 1;
+    u32 chunkCount = job.dequeCount * PARALLEL_FOR_CHUNKS_PER_THREAD;
+    if(chunkCount > job.batchCount)
+	chunkCount = job.batchCount;
+    job.chunkSize = (job.batchCount + chunkCount - 1) / chunkCount;
+    chunkCount = (job.batchCount + job.chunkSize - 1) / job.chunkSize;
+
+    u32 dequeIdx;
+    for(dequeIdx = 0; dequeIdx < job.dequeCount; ++dequeIdx)
+    {
+	u32 top = (chunkCount * dequeIdx) / job.dequeCount;
+	u32 bottom = (chunkCount * (dequeIdx + 1)) / job.dequeCount;
+	atomic_init(&job.deques[dequeIdx].range, DequeRange(top, bottom));
+    }
+    atomic_init(&job.nextDeque, 1);
+    job.helperCount = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    u8 posted = (pool.jobCount < MAX_PARALLEL_FOR_JOBS);
+    if(posted)
+    {
+	pool.jobs[pool.jobCount++] = &job;
+	pthread_cond_broadcast(&pool.jobPosted);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    // Too many jobs on the go already, we still get it done just without help
+    WorkOnJob(&job, 0);
+
+    if(posted)
+    {
+	// Nothing is left to claim but helpers may still be running their last chunk
+	pthread_mutex_lock(&pool.lock);
+	u32 jobIdx;
+	for(jobIdx = 0; pool.jobs[jobIdx] != &job; ++jobIdx);
+	pool.jobs[jobIdx] = pool.jobs[--pool.jobCount];
+
+	while(job.helperCount)
+	    pthread_cond_wait(&pool.helperLeft, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+    }
+
+    GiveBackBatchList(batchList);
+}
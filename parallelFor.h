@@ -0,0 +1,33 @@
+#ifndef __PARALLEL_FOR_H__
+#define __PARALLEL_FOR_H__
+
+#include "types.h"
+#include "entityComponentSystem.h"
+
+// Lets a single system spread its batches over every core. The matching batches are cut
+// into chunks and each thread taking part gets a deque of them, it works through its own
+// from one end and when that runs dry steals from the other end of someone else's. The
+// calling thread always takes part so nested calls, or calls from scheduler workers, can
+// never stall waiting for a pool thread.
+//
+// This pool is separate from the system scheduler's, when several systems run at once and
+// all of them use it there will be more threads than cores for a while
+#define MAX_PARALLEL_FOR_WORKERS (15)
+#define PARALLEL_FOR_CHUNKS_PER_THREAD (8)
+#define MAX_PARALLEL_FOR_JOBS (16)
+
+typedef void (*BatchFunction)(EntityBatch* batch, void* userData);
+
+// Passing 0 workers uses one per core, not counting the calling thread. The first parallel
+// for starts the pool if this has not been called
+void StartParallelFor(u32 workerCount);
+void StopParallelFor();
+
+// Workers plus the calling thread
+u32 ParallelForThreadCount();
+
+// Calls function once for every batch with live entities which has at least the required
+// components, returns when every batch is done. Any thread may end up running function
+void ParallelForBatchesInQuery(World* world, ComponentFlags requires, BatchFunction function, void* userData);
+
+#endif
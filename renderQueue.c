@@ -0,0 +1,165 @@
+#define NO_PRINT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+
+#include "renderQueue.h"
+#include "spriteBatch.h"
+#include "traceEvents.h"
+#include "timing.h"
+
+#define RADIX_BITS (8)
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_PASSES (sizeof(u64) * 8 / RADIX_BITS)
+
+typedef struct
+{
+    float x;
+    float y;
+    float width;
+    float height;
+    TextureRect uv;
+    GLuint texture;
+} QueuedSprite;
+
+typedef struct
+{
+    u64 key;
+    u32 sprite;
+} SortEntry;
+
+static QueuedSprite* sprites;
+static SortEntry* entries;
+static SortEntry* sortSpace;
+static u32 queuedCount;
+static u32 queueCapacity;
+static RenderQueueStats lastStats;
+
+// Flips floats so comparing their bits as unsigned gives the same order as comparing the
+// floats, negatives have every bit flipped and positives just the sign
+static inline u32 SortableDepth(float depth)
+{
+    u32 bits;
+    memcpy(&bits, &depth, sizeof(bits));
+    return (bits & 0x80000000) ? ~bits : (bits | 0x80000000);
+}
+
+static inline u64 RenderKey(u8 layer, GLuint texture, float depth)
+{
+    return ((u64)layer << (RENDER_TEXTURE_BITS + RENDER_DEPTH_BITS))
+	| ((u64)texture << RENDER_DEPTH_BITS)
+	| (SortableDepth(depth) >> (32 - RENDER_DEPTH_BITS));
+}
+
+void BeginRenderQueue()
+{
+    queuedCount = 0;
+}
+
+void QueueSprite(u8 layer, GLuint texture, float depth, TextureRect uv, float x, float y, float width, float height)
+{
+    if(queuedCount == queueCapacity)
+    {
+	queueCapacity = queueCapacity ? queueCapacity * 2 : 1024;
+	sprites = realloc(sprites, queueCapacity * sizeof(QueuedSprite));
+	entries = realloc(entries, queueCapacity * sizeof(SortEntry));
+	sortSpace = realloc(sortSpace, queueCapacity * sizeof(SortEntry));
+    }
+
+    sprites[queuedCount] = (QueuedSprite){x, y, width, height, uv, texture};
+    entries[queuedCount] = (SortEntry){RenderKey(layer, texture, depth), queuedCount};
+    queuedCount++;
+}
+
+// LSD radix sort, stable so sprites with equal keys stay in the order they were queued.
+// All the histograms are counted in one go up front, a byte where everything landed in
+// one bucket would not move anything so that pass is skipped. Returns the passes run
+static u32 SortQueuedSprites()
+{
+    static u32 counts[RADIX_PASSES][RADIX_BUCKETS];
+    memset(counts, 0, sizeof(counts));
+
+    u32 entry, pass;
+    for(entry = 0; entry < queuedCount; ++entry)
+    {
+	u64 key = entries[entry].key;
+	for(pass = 0; pass < RADIX_PASSES; ++pass)
+	    counts[pass][(key >> (pass * RADIX_BITS)) & (RADIX_BUCKETS - 1)]++;
+    }
+
+    u32 passesRun = 0;
+    for(pass = 0; pass < RADIX_PASSES; ++pass)
+    {
+	u32 shift = pass * RADIX_BITS;
+	if(counts[pass][(entries[0].key >> shift) & (RADIX_BUCKETS - 1)] == queuedCount)
+	    continue;
+
+	u32 offset = 0, bucket;
+	for(bucket = 0; bucket < RADIX_BUCKETS; ++bucket)
+	{
+	    u32 count = counts[pass][bucket];
+	    counts[pass][bucket] = offset;
+	    offset += count;
+	}
+
+	for(entry = 0; entry < queuedCount; ++entry)
+	    sortSpace[counts[pass][(entries[entry].key >> shift) & (RADIX_BUCKETS - 1)]++] = entries[entry];
+
+	SortEntry* sorted = sortSpace;
+	sortSpace = entries;
+	entries = sorted;
+	passesRun++;
+    }
+
+    return passesRun;
+}
+
+void SubmitRenderQueue()
+{
+    TRACE_ZONE("SubmitRenderQueue");
+
+    RenderQueueStats stats = {queuedCount, 0, 0, 0, 0};
+
+    if(queuedCount)
+    {
+	u64 sortStart = NowNs();
+	stats.sortPasses = SortQueuedSprites();
+	stats.sortMs = (float)(NowNs() - sortStart) / NS_PER_MS;
+    }
+
+    // The batcher only flushes and binds when the texture changes, which sorting has
+    // made happen as rarely as it can
+    BeginSpriteBatch();
+    u32 entry;
+    for(entry = 0; entry < queuedCount; ++entry)
+    {
+	QueuedSprite* sprite = &sprites[entries[entry].sprite];
+	DrawSprite(sprite->texture, sprite->uv, sprite->x, sprite->y, sprite->width, sprite->height);
+    }
+    EndSpriteBatch();
+
+    SpriteBatchStats batchStats = LastSpriteBatchStats();
+    stats.textureBinds = batchStats.textureBinds;
+    stats.drawCalls = batchStats.drawCalls;
+    lastStats = stats;
+
+    DEBUG_LOG("Drew %u sprites, %u binds, %u draw calls, sorted in %u passes", stats.sprites, stats.textureBinds, stats.drawCalls, stats.sortPasses);
+}
+
+RenderQueueStats LastRenderQueueStats()
+{
+    return lastStats;
+}
+
+void FreeRenderQueue()
+{
+    free(sprites);
+    free(entries);
+    free(sortSpace);
+    sprites = NULL;
+    entries = sortSpace = NULL;
+    queuedCount = queueCapacity = 0;
+}
@@ -0,0 +1,38 @@
+#ifndef __RENDER_QUEUE_H__
+#define __RENDER_QUEUE_H__
+
+#include <GL/gl.h>
+
+#include "types.h"
+#include "textureAtlas.h"
+
+// Sprites are queued over the frame and drawn in key order rather than the order the
+// entities happen to be stored in. The key is (layer, texture, depth) packed into a u64 so
+// a layer is always drawn over the layers below it, and within a layer everything using
+// one texture (usually an atlas page) is drawn together so the batcher only binds it once. Depth only orders
+// sprites sharing a layer and texture, anything which has to overlap in a particular way
+// should go on its own layer.
+//
+// Keys are radix sorted a byte at a time, bytes every key has the same are skipped so a
+// frame where only the textures differ costs a pass or two
+#define RENDER_LAYER_BITS (8)
+#define RENDER_TEXTURE_BITS (32)
+#define RENDER_DEPTH_BITS (24)
+
+typedef struct
+{
+    u32 sprites;
+    u32 textureBinds;
+    u32 drawCalls;
+    u32 sortPasses; // How many bytes of the keys actually needed sorting
+    float sortMs;
+} RenderQueueStats;
+
+void BeginRenderQueue();
+void QueueSprite(u8 layer, GLuint texture, float depth, TextureRect uv, float x, float y, float width, float height);
+// Sorts everything queued since BeginRenderQueue and draws it
+void SubmitRenderQueue();
+RenderQueueStats LastRenderQueueStats();
+void FreeRenderQueue();
+
+#endif
@@ -0,0 +1,105 @@
+#define NO_PRINT
+#define GL_GLEXT_PROTOTYPES
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "logging.h"
+
+#include "spriteBatch.h"
+#include "traceEvents.h"
+
+#define NO_TEXTURE (0xffffffff)
+#define SPRITE_BATCH_BUFFER_BYTES (SPRITE_BATCH_BUFFER_SPRITES * 4 * sizeof(SpriteVertex))
+
+SpriteBatch spriteBatch;
+
+static GLuint vertexBuffer;
+static u32 bufferedSprites; // Where the next flush writes to in the vertex buffer
+static GLuint boundTexture;
+static SpriteBatchStats lastStats;
+
+void BeginSpriteBatch()
+{
+    if(!vertexBuffer)
+    {
+	spriteBatch.vertices = malloc(SPRITE_BATCH_SPRITES * 4 * sizeof(SpriteVertex));
+	glGenBuffers(1, &vertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, SPRITE_BATCH_BUFFER_BYTES, NULL, GL_STREAM_DRAW);
+	DEBUG_LOG("Created sprite vertex buffer %u - %d", vertexBuffer, glGetError());
+	bufferedSprites = 0;
+    }
+
+    spriteBatch.spriteCount = 0;
+    spriteBatch.texture = 0;
+    spriteBatch.stats = (SpriteBatchStats){0, 0, 0, 0};
+    boundTexture = NO_TEXTURE; // Whatever was drawn since the last batch could have bound anything
+
+    // Draws index into the buffer so the pointers are set once for the whole frame
+    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glVertexPointer(2, GL_FLOAT, sizeof(SpriteVertex), (void*)0);
+    glTexCoordPointer(2, GL_FLOAT, sizeof(SpriteVertex), (void*)(2 * sizeof(float)));
+}
+
+void FlushSpriteBatch()
+{
+    if(!spriteBatch.spriteCount)
+	return;
+
+    if(bufferedSprites + spriteBatch.spriteCount > SPRITE_BATCH_BUFFER_SPRITES)
+    {
+	// Anything the GPU has not drawn yet keeps the old storage, we get a fresh one
+	// without waiting
+	glBufferData(GL_ARRAY_BUFFER, SPRITE_BATCH_BUFFER_BYTES, NULL, GL_STREAM_DRAW);
+	bufferedSprites = 0;
+	spriteBatch.stats.bufferOrphans++;
+    }
+
+    glBufferSubData(GL_ARRAY_BUFFER, bufferedSprites * 4 * sizeof(SpriteVertex), spriteBatch.spriteCount * 4 * sizeof(SpriteVertex), spriteBatch.vertices);
+    // A full batch flushes without the texture changing
+    if(spriteBatch.texture != boundTexture)
+    {
+	glBindTexture(GL_TEXTURE_2D, spriteBatch.texture);
+	boundTexture = spriteBatch.texture;
+	spriteBatch.stats.textureBinds++;
+    }
+    glDrawArrays(GL_QUADS, bufferedSprites * 4, spriteBatch.spriteCount * 4);
+    DEBUG_LOG("Drew %u sprites - %d", spriteBatch.spriteCount, glGetError());
+
+    bufferedSprites += spriteBatch.spriteCount;
+    spriteBatch.stats.sprites += spriteBatch.spriteCount;
+    spriteBatch.stats.drawCalls++;
+    spriteBatch.spriteCount = 0;
+}
+
+void EndSpriteBatch()
+{
+    TRACE_ZONE("FlushSprites");
+
+    FlushSpriteBatch();
+
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    lastStats = spriteBatch.stats;
+}
+
+SpriteBatchStats LastSpriteBatchStats()
+{
+    return lastStats;
+}
+
+void FreeSpriteBatch()
+{
+    if(!vertexBuffer)
+	return;
+
+    glDeleteBuffers(1, &vertexBuffer);
+    vertexBuffer = 0;
+    free(spriteBatch.vertices);
+    spriteBatch.vertices = NULL;
+}
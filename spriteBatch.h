@@ -0,0 +1,69 @@
+#ifndef __SPRITE_BATCH_H__
+#define __SPRITE_BATCH_H__
+
+#include <GL/gl.h>
+
+#include "types.h"
+#include "textureAtlas.h"
+
+// Collects textured quads and draws them with as few calls as possible. Sprites go into a
+// staging array as they come and are only sent to GL when the texture changes or the array
+// fills up, then copied into a streamed vertex buffer and drawn with one glDrawArrays.
+//
+// The vertex buffer is written front to back over a frame and only orphaned when it runs
+// out of room, so the driver can keep drawing from the old storage while we fill the new.
+// Everything here has to be called on the thread owning the GL context
+#define SPRITE_BATCH_SPRITES (16384) // Most sprites sent in one draw
+#define SPRITE_BATCH_BUFFER_SPRITES (SPRITE_BATCH_SPRITES * 4) // Room in the vertex buffer
+
+typedef struct
+{
+    float x;
+    float y;
+    float u;
+    float v;
+} SpriteVertex;
+
+typedef struct
+{
+    u32 sprites;
+    u32 drawCalls;
+    u32 textureBinds;
+    u32 bufferOrphans; // How many times the vertex buffer was swapped for fresh storage
+} SpriteBatchStats;
+
+typedef struct
+{
+    SpriteVertex* vertices; // 4 per sprite
+    u32 spriteCount;
+    GLuint texture;
+    SpriteBatchStats stats;
+} SpriteBatch;
+
+// Only here so DrawSprite can be inlined into the render loop, leave it alone
+extern SpriteBatch spriteBatch;
+
+// Creates the vertex buffer the first time it is called
+void BeginSpriteBatch();
+// Draws anything still waiting and puts back the GL state the batch changed
+void EndSpriteBatch();
+void FlushSpriteBatch();
+SpriteBatchStats LastSpriteBatchStats();
+void FreeSpriteBatch();
+
+static inline void DrawSprite(GLuint texture, TextureRect uv, float x, float y, float width, float height)
+{
+    if(texture != spriteBatch.texture || spriteBatch.spriteCount == SPRITE_BATCH_SPRITES)
+    {
+	FlushSpriteBatch();
+	spriteBatch.texture = texture;
+    }
+
+    SpriteVertex* quad = &spriteBatch.vertices[spriteBatch.spriteCount++ * 4];
+    quad[0] = (SpriteVertex){x, y, uv.u0, uv.v0};
+    quad[1] = (SpriteVertex){x + width, y, uv.u1, uv.v0};
+    quad[2] = (SpriteVertex){x + width, y + height, uv.u1, uv.v1};
+    quad[3] = (SpriteVertex){x, y + height, uv.u0, uv.v1};
+}
+
+#endif
@@ -0,0 +1,345 @@
+#define NO_PRINT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+
+#include "systemDependencies.h"
+
+#define NO_SYSTEM (0xffffffff)
+
+typedef struct
+{
+    u32 id;
+    u32 idx;
+} SystemIdIndex;
+
+// Dependencies on one system and the systems waiting on another, both as lists of indices
+// into the descriptors. first[idx] to first[idx + 1] are the entries for system idx
+typedef struct
+{
+    u32* first;
+    u32* entries;
+} SystemEdges;
+
+static inline char* SystemName(SystemDescriptor* descriptor)
+{
+    return descriptor->name ? descriptor->name : "unnamed";
+}
+
+static int CompareSystemIds(const void* a, const void* b)
+{
+    u32 left = ((const SystemIdIndex*)a)->id;
+    u32 right = ((const SystemIdIndex*)b)->id;
+    return (left > right) - (left < right);
+}
+
+static u32 FindSystemWithId(SystemIdIndex* ids, u32 count, u32 id)
+{
+    SystemIdIndex key = {id, 0};
+    SystemIdIndex* found = bsearch(&key, ids, count, sizeof(SystemIdIndex), &CompareSystemIds);
+    return found ? found->idx : NO_SYSTEM;
+}
+
+// Turn every system's list of ids it depends on into indices, fails if any id is missing
+// or is used twice
+static u8 BuildPredecessors(SystemDescriptor** descriptors, u32 count, SystemEdges* predecessors)
+{
+    SystemIdIndex* ids = malloc(count * sizeof(SystemIdIndex));
+    u32 idx;
+    for(idx = 0; idx < count; ++idx)
+    {
+	ids[idx].id = descriptors[idx]->id;
+	ids[idx].idx = idx;
+    }
+    qsort(ids, count, sizeof(SystemIdIndex), &CompareSystemIds);
+
+    u8 ok = 1;
+    for(idx = 1; idx < count; ++idx)
+    {
+	if(ids[idx].id == ids[idx - 1].id)
+	{
+	    DEBUG_ERR("Systems %s and %s both have id %u", SystemName(descriptors[ids[idx - 1].idx]), SystemName(descriptors[ids[idx].idx]), ids[idx].id);
+	    ok = 0;
+	}
+    }
+
+    predecessors->first = malloc((count + 1) * sizeof(u32));
+    predecessors->first[0] = 0;
+    for(idx = 0; idx < count; ++idx)
+	predecessors->first[idx + 1] = predecessors->first[idx] + descriptors[idx]->dependencyCount;
+    predecessors->entries = malloc((predecessors->first[count] + 1) * sizeof(u32));
+
+    for(idx = 0; ok && idx < count; ++idx)
+    {
+	SystemDescriptor* descriptor = descriptors[idx];
+	u32 dependency;
+	for(dependency = 0; dependency < descriptor->dependencyCount; ++dependency)
+	{
+	    u32 found = FindSystemWithId(ids, count, descriptor->dependsOn[dependency]);
+	    if(found == NO_SYSTEM)
+	    {
+		DEBUG_ERR("System %s (%u) depends on system %u which is not loaded", SystemName(descriptor), descriptor->id, descriptor->dependsOn[dependency]);
+		ok = 0;
+		break;
+	    }
+	    predecessors->entries[predecessors->first[idx] + dependency] = found;
+	}
+    }
+
+    free(ids);
+    return ok;
+}
+
+// The same edges the other way round
+static void BuildSuccessors(SystemEdges* predecessors, u32 count, SystemEdges* successors)
+{
+    successors->first = calloc(count + 1, sizeof(u32));
+    successors->entries = malloc((predecessors->first[count] + 1) * sizeof(u32));
+
+    u32 idx, edge;
+    for(edge = 0; edge < predecessors->first[count]; ++edge)
+	successors->first[predecessors->entries[edge] + 1]++;
+    for(idx = 0; idx < count; ++idx)
+	successors->first[idx + 1] += successors->first[idx];
+
+    u32* filled = calloc(count, sizeof(u32));
+    for(idx = 0; idx < count; ++idx)
+    {
+	for(edge = predecessors->first[idx]; edge < predecessors->first[idx + 1]; ++edge)
+	{
+	    u32 predecessor = predecessors->entries[edge];
+	    successors->entries[successors->first[predecessor] + filled[predecessor]++] = idx;
+	}
+    }
+    free(filled);
+}
+
+static inline void ReportCycleStep(SystemDescriptor* system, SystemDescriptor* dependency)
+{
+    DEBUG_ERR("    %s (%u) depends on %s (%u)", SystemName(system), system->id, SystemName(dependency), dependency->id);
+}
+
+// Everything Kahn's algorithm could not place is either in a cycle or waiting on one. Every
+// one of them has a predecessor which was not placed either, so following those back has
+// to come round to somewhere it has already been
+static void ReportDependencyCycles(SystemDescriptor** descriptors, u32 count, u8* placed, SystemEdges* predecessors)
+{
+    u8* visited = calloc(count, sizeof(u8)); // 1 on the walk in progress, 2 dealt with
+    u32* walk = malloc(count * sizeof(u32));
+    u32 waiting = 0;
+
+    u32 start;
+    for(start = 0; start < count; ++start)
+    {
+	if(placed[start] || visited[start])
+	    continue;
+
+	u32 walkLength = 0;
+	u32 idx = start;
+	while(!visited[idx])
+	{
+	    visited[idx] = 1;
+	    walk[walkLength++] = idx;
+
+	    u32 edge = predecessors->first[idx];
+	    while(placed[predecessors->entries[edge]])
+		edge++;
+	    idx = predecessors->entries[edge];
+	}
+
+	// Came back round to this walk, from where we first saw idx is a cycle. Running into
+	// an earlier walk means these are only waiting on a cycle we already reported
+	u32 cycleStart = walkLength;
+	if(visited[idx] == 1)
+	{
+	    for(cycleStart = 0; walk[cycleStart] != idx; ++cycleStart);
+
+	    DEBUG_ERR("Systems depend on each other in a cycle:");
+	    u32 step;
+	    for(step = cycleStart; step < walkLength; ++step)
+	    {
+		ReportCycleStep(descriptors[walk[step]], descriptors[(step + 1 < walkLength) ? walk[step + 1] : walk[cycleStart]]);
+	    }
+	}
+	waiting += cycleStart;
+
+	u32 step;
+	for(step = 0; step < walkLength; ++step)
+	    visited[walk[step]] = 2;
+    }
+
+    if(waiting)
+    {
+	DEBUG_ERR("Another %u systems can not run because they wait on a cycle", waiting);
+    }
+
+    free(walk);
+    free(visited);
+}
+
+// Ready systems are kept in a heap, longest chain first and then in the order they were given
+static inline u8 RunsBefore(u32 a, u32 b, float* criticalPath)
+{
+    if(criticalPath[a] != criticalPath[b])
+	return criticalPath[a] > criticalPath[b];
+    return a < b;
+}
+
+static void PushReadySystem(u32* heap, u32* heapSize, u32 idx, float* criticalPath)
+{
+    u32 position = (*heapSize)++;
+    while(position)
+    {
+	u32 parent = (position - 1) / 2;
+	if(!RunsBefore(idx, heap[parent], criticalPath))
+	    break;
+	heap[position] = heap[parent];
+	position = parent;
+    }
+    heap[position] = idx;
+}
+
+static u32 PopReadySystem(u32* heap, u32* heapSize, float* criticalPath)
+{
+    u32 ret = heap[0];
+    u32 last = heap[--(*heapSize)];
+
+    u32 position = 0;
+    while(1)
+    {
+	u32 child = position * 2 + 1;
+	if(child >= *heapSize)
+	    break;
+	if(child + 1 < *heapSize && RunsBefore(heap[child + 1], heap[child], criticalPath))
+	    child++;
+	if(!RunsBefore(heap[child], last, criticalPath))
+	    break;
+	heap[position] = heap[child];
+	position = child;
+    }
+    heap[position] = last;
+
+    return ret;
+}
+
+u8 ResolveSystemOrder(SystemDescriptor** descriptors, u32 count, float* costs)
+{
+    SystemEdges predecessors, successors;
+    if(!BuildPredecessors(descriptors, count, &predecessors))
+    {
+	free(predecessors.first);
+	free(predecessors.entries);
+	return 0;
+    }
+    BuildSuccessors(&predecessors, count, &successors);
+
+    u32* waitingOn = malloc(count * sizeof(u32));
+    u32* order = malloc(count * sizeof(u32));
+    float* criticalPath = malloc(count * sizeof(float));
+    u8* placed = calloc(count, sizeof(u8));
+
+    // First pass is plain Kahn's algorithm, it finds an order if there is one
+    u32 idx, edge;
+    u32 placedCount = 0;
+    for(idx = 0; idx < count; ++idx)
+    {
+	waitingOn[idx] = predecessors.first[idx + 1] - predecessors.first[idx];
+	if(!waitingOn[idx])
+	    order[placedCount++] = idx;
+    }
+
+    u32 next;
+    for(next = 0; next < placedCount; ++next)
+    {
+	placed[order[next]] = 1;
+	for(edge = successors.first[order[next]]; edge < successors.first[order[next] + 1]; ++edge)
+	{
+	    if(!--waitingOn[successors.entries[edge]])
+		order[placedCount++] = successors.entries[edge];
+	}
+    }
+
+    u8 ok = (placedCount == count);
+    if(!ok)
+	ReportDependencyCycles(descriptors, count, placed, &predecessors);
+
+    if(ok)
+    {
+	// Going backwards through that order every successor is done before the systems it waits
+	// on, the critical path from a system is its own cost plus the longest one after it
+	while(next--)
+	{
+	    idx = order[next];
+	    float longestAfter = 0;
+	    for(edge = successors.first[idx]; edge < successors.first[idx + 1]; ++edge)
+	    {
+		if(criticalPath[successors.entries[edge]] > longestAfter)
+		    longestAfter = criticalPath[successors.entries[edge]];
+	    }
+	    criticalPath[idx] = (costs ? costs[idx] : 1) + longestAfter;
+	}
+
+	// Second pass again but picking the longest chain whenever there is a choice
+	u32* heap = malloc(count * sizeof(u32));
+	u32 heapSize = 0;
+	for(idx = 0; idx < count; ++idx)
+	{
+	    waitingOn[idx] = predecessors.first[idx + 1] - predecessors.first[idx];
+	    if(!waitingOn[idx])
+		PushReadySystem(heap, &heapSize, idx, criticalPath);
+	}
+
+	placedCount = 0;
+	while(heapSize)
+	{
+	    idx = PopReadySystem(heap, &heapSize, criticalPath);
+	    order[placedCount++] = idx;
+	    for(edge = successors.first[idx]; edge < successors.first[idx + 1]; ++edge)
+	    {
+		if(!--waitingOn[successors.entries[edge]])
+		    PushReadySystem(heap, &heapSize, successors.entries[edge], criticalPath);
+	    }
+	}
+	free(heap);
+
+#if defined(DEBUG) && !defined(NO_PRINT)
+	// Follow the longest chain down from the first system
+	if(count)
+	{
+	    DEBUG_LOG("Critical path takes %.3f:", criticalPath[order[0]]);
+	    idx = order[0];
+	    while(idx != NO_SYSTEM)
+	    {
+		DEBUG_LOG("    %s (%u)", SystemName(descriptors[idx]), descriptors[idx]->id);
+		u32 longest = NO_SYSTEM;
+		for(edge = successors.first[idx]; edge < successors.first[idx + 1]; ++edge)
+		{
+		    if(longest == NO_SYSTEM || criticalPath[successors.entries[edge]] > criticalPath[longest])
+			longest = successors.entries[edge];
+		}
+		idx = longest;
+	    }
+	}
+#endif
+
+	SystemDescriptor** unordered = malloc(count * sizeof(SystemDescriptor*));
+	memcpy(unordered, descriptors, count * sizeof(SystemDescriptor*));
+	for(idx = 0; idx < count; ++idx)
+	    descriptors[idx] = unordered[order[idx]];
+	free(unordered);
+    }
+
+    free(placed);
+    free(criticalPath);
+    free(order);
+    free(waitingOn);
+    free(successors.first);
+    free(successors.entries);
+    free(predecessors.first);
+    free(predecessors.entries);
+
+    return ok;
+}
@@ -0,0 +1,21 @@
+#ifndef __SYSTEM_DEPENDENCIES_H__
+#define __SYSTEM_DEPENDENCIES_H__
+
+#include "types.h"
+#include "entityComponentSystem.h"
+
+// Puts systems in an order where each one comes after everything it depends on. This is
+// Kahn's algorithm so it takes time in line with the number of systems plus dependencies,
+// not their square.
+//
+// When more than one system is free to go next the one at the head of the longest chain
+// still to run goes first, so the scheduler (which always picks the earliest ready
+// system) gets going on the critical path as soon as it can. costs says how long each
+// system is expected to take for working out the chains, NULL counts every system as 1.
+//
+// If a dependency is on a system which is not loaded, two systems share an id or the
+// dependencies go round in a circle the systems involved are named in the debug output,
+// 0 is returned and descriptors are left as they were
+u8 ResolveSystemOrder(SystemDescriptor** descriptors, u32 count, float* costs);
+
+#endif
@@ -0,0 +1,234 @@
+#define NO_PRINT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "logging.h"
+
+#include "systemProfiler.h"
+#include "timing.h"
+
+typedef struct
+{
+    au64 startNs;
+    au64 endNs;
+} ProfileSample;
+
+// Runs are numbered from 0 for the life of a load, run n goes in sample n % PROFILE_HISTORY.
+// The writer bumps claimed before touching a sample and written after, a reader which
+// catches it part way through can tell which samples may have been overwritten under it
+typedef struct
+{
+    u32 systemId;
+    char* name; // Our own copy, NULL if the system has none
+    au32 claimed;
+    au32 written;
+    ProfileSample samples[PROFILE_HISTORY];
+} __attribute__((aligned(CACHE_LINE_BYTES))) SystemProfile;
+
+// Recording never takes this, it only keeps the profiles from being swapped out under
+// someone reading stats while the systems are reloaded
+static pthread_mutex_t profilesLock = PTHREAD_MUTEX_INITIALIZER;
+
+static SystemProfile* profiles;
+static u32 profileCount;
+static u32 profileCapacity;
+
+static SystemProfileStats* previousLoad;
+static u32 previousLoadCount;
+
+void RecordSystemRun(u32 systemIdx, u64 startNs, u64 endNs)
+{
+    SystemProfile* profile = &profiles[systemIdx];
+
+    // Only one thread runs a system at a time so nothing else is writing this ring
+    u32 run = atomic_load_explicit(&profile->written, memory_order_relaxed);
+    atomic_store_explicit(&profile->claimed, run + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    ProfileSample* sample = &profile->samples[run % PROFILE_HISTORY];
+    atomic_store_explicit(&sample->startNs, startNs, memory_order_relaxed);
+    atomic_store_explicit(&sample->endNs, endNs, memory_order_relaxed);
+
+    atomic_store_explicit(&profile->written, run + 1, memory_order_release);
+}
+
+static int CompareDurations(const void* a, const void* b)
+{
+    u64 left = *(const u64*)a;
+    u64 right = *(const u64*)b;
+    return (left > right) - (left < right);
+}
+
+static SystemProfileStats StatsForProfile(SystemProfile* profile)
+{
+    SystemProfileStats stats = {0};
+    stats.systemId = profile->systemId;
+
+    u32 end = atomic_load_explicit(&profile->written, memory_order_acquire);
+    u32 first = (end > PROFILE_HISTORY) ? (end - PROFILE_HISTORY) : 0;
+
+    u64 durations[PROFILE_HISTORY];
+    u32 run;
+    for(run = first; run < end; ++run)
+    {
+	ProfileSample* sample = &profile->samples[run % PROFILE_HISTORY];
+	durations[run - first] = atomic_load_explicit(&sample->endNs, memory_order_relaxed) -
+	    atomic_load_explicit(&sample->startNs, memory_order_relaxed);
+    }
+
+    // Anything the writer has claimed since may have landed on the oldest samples we read
+    atomic_thread_fence(memory_order_acquire);
+    u32 claimed = atomic_load_explicit(&profile->claimed, memory_order_relaxed);
+    u32 skip = 0;
+    if(claimed > PROFILE_HISTORY && claimed - PROFILE_HISTORY > first)
+	skip = claimed - PROFILE_HISTORY - first;
+    if(skip > end - first)
+	skip = end - first;
+
+    stats.sampleCount = end - first - skip;
+    if(!stats.sampleCount)
+	return stats;
+
+    u64* kept = durations + skip;
+    qsort(kept, stats.sampleCount, sizeof(u64), &CompareDurations);
+
+    u64 total = 0;
+    for(run = 0; run < stats.sampleCount; ++run)
+	total += kept[run];
+
+    u32 p99 = (stats.sampleCount * 99 + 99) / 100 - 1;
+    stats.minMs = (float)kept[0] / NS_PER_MS;
+    stats.avgMs = ((float)total / stats.sampleCount) / NS_PER_MS;
+    stats.p99Ms = (float)kept[p99] / NS_PER_MS;
+    stats.maxMs = (float)kept[stats.sampleCount - 1] / NS_PER_MS;
+
+    return stats;
+}
+
+void ResetSystemProfiles(SystemDescriptor* systems, u32 systemCount)
+{
+    pthread_mutex_lock(&profilesLock);
+
+    // Hang on to the outgoing load's numbers, systems that never ran have nothing worth keeping
+    u32 idx;
+    free(previousLoad);
+    previousLoad = malloc((profileCount + 1) * sizeof(SystemProfileStats));
+    previousLoadCount = 0;
+    for(idx = 0; idx < profileCount; ++idx)
+    {
+	SystemProfileStats stats = StatsForProfile(&profiles[idx]);
+	if(!stats.sampleCount)
+	    continue;
+
+	previousLoad[previousLoadCount++] = stats;
+	DEBUG_LOG("System %u before reload: min %.3fms avg %.3fms p99 %.3fms over %u runs", stats.systemId, stats.minMs, stats.avgMs, stats.p99Ms, stats.sampleCount);
+    }
+
+    for(idx = 0; idx < profileCount; ++idx)
+	free(profiles[idx].name);
+
+    if(systemCount > profileCapacity)
+    {
+	free(profiles);
+	profileCapacity = systemCount;
+	profiles = aligned_alloc(CACHE_LINE_BYTES, profileCapacity * sizeof(SystemProfile));
+    }
+
+    for(idx = 0; idx < systemCount; ++idx)
+    {
+	profiles[idx].systemId = systems[idx].id;
+	profiles[idx].name = systems[idx].name ? strdup(systems[idx].name) : NULL;
+	atomic_store(&profiles[idx].claimed, 0);
+	atomic_store(&profiles[idx].written, 0);
+    }
+    profileCount = systemCount;
+
+    pthread_mutex_unlock(&profilesLock);
+}
+
+u32 ProfiledSystemCount()
+{
+    return profileCount;
+}
+
+SystemProfileStats SystemProfileStatsFor(u32 systemIdx)
+{
+    SystemProfileStats stats = {0};
+
+    pthread_mutex_lock(&profilesLock);
+    if(systemIdx < profileCount)
+	stats = StatsForProfile(&profiles[systemIdx]);
+    pthread_mutex_unlock(&profilesLock);
+
+    return stats;
+}
+
+u8 SystemProfileStatsForId(u32 systemId, SystemProfileStats* stats)
+{
+    u8 found = 0;
+
+    pthread_mutex_lock(&profilesLock);
+    u32 idx;
+    for(idx = 0; idx < profileCount; ++idx)
+    {
+	if(profiles[idx].systemId == systemId)
+	{
+	    *stats = StatsForProfile(&profiles[idx]);
+	    found = (stats->sampleCount != 0);
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&profilesLock);
+
+    return found;
+}
+
+// Called with the lock held
+static u8 FindPreviousStats(u32 systemId, SystemProfileStats* stats)
+{
+    u32 idx;
+    for(idx = 0; idx < previousLoadCount; ++idx)
+    {
+	if(previousLoad[idx].systemId == systemId)
+	{
+	    *stats = previousLoad[idx];
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+u8 PreviousSystemProfileStats(u32 systemId, SystemProfileStats* stats)
+{
+    pthread_mutex_lock(&profilesLock);
+    u8 found = FindPreviousStats(systemId, stats);
+    pthread_mutex_unlock(&profilesLock);
+
+    return found;
+}
+
+void DumpSystemProfiles(FILE* out)
+{
+    pthread_mutex_lock(&profilesLock);
+
+    fprintf(out, "System profile, last %d runs of each system\n", PROFILE_HISTORY);
+    fprintf(out, "  system                    id   runs    min ms    avg ms    p99 ms    max ms | before reload: avg ms    p99 ms\n");
+
+    u32 idx;
+    for(idx = 0; idx < profileCount; ++idx)
+    {
+	SystemProfileStats stats = StatsForProfile(&profiles[idx]);
+	fprintf(out, "  %-24.24s  %4u  %5u  %8.3f  %8.3f  %8.3f  %8.3f |", profiles[idx].name ? profiles[idx].name : "unnamed", stats.systemId, stats.sampleCount, stats.minMs, stats.avgMs, stats.p99Ms, stats.maxMs);
+
+	SystemProfileStats before;
+	if(FindPreviousStats(stats.systemId, &before))
+	    fprintf(out, "                %8.3f  %8.3f\n", before.avgMs, before.p99Ms);
+	else
+	    fprintf(out, "                       -         -\n");
+    }
+
+    pthread_mutex_unlock(&profilesLock);
+}
@@ -0,0 +1,50 @@
+#ifndef __SYSTEM_PROFILER_H__
+#define __SYSTEM_PROFILER_H__
+
+#include <stdio.h>
+
+#include "types.h"
+#include "entityComponentSystem.h"
+
+// Keeps the start and end time of the last PROFILE_HISTORY runs of every scheduled
+// system. Each system has its own ring which only the thread running it writes to, so
+// recording is a couple of stores and never waits on anything, stats can be read from any
+// thread while systems are running.
+//
+// Samples are runs, not frames. Frame systems run once a frame but simulation systems run
+// once per fixed step, so a frame can give them several samples or none and their stats
+// are the cost of a single step. That is also what the scheduler wants when it guesses
+// how long a system will take.
+//
+// Loading a new set of systems starts the rings again, the stats from the outgoing load
+// are kept so a hot reload can be compared against what came before it
+#define PROFILE_HISTORY (256)
+
+typedef struct
+{
+    u32 systemId;
+    u32 sampleCount; // How many runs these are over, at most PROFILE_HISTORY
+    float minMs;
+    float avgMs;
+    float p99Ms;
+    float maxMs;
+} SystemProfileStats;
+
+// Called when a schedule is built, systems are referred to by their index from then on
+void ResetSystemProfiles(SystemDescriptor* systems, u32 systemCount);
+
+void RecordSystemRun(u32 systemIdx, u64 startNs, u64 endNs);
+
+u32 ProfiledSystemCount();
+SystemProfileStats SystemProfileStatsFor(u32 systemIdx);
+
+// The same for the loaded system with this id, returns 0 if there is none or it has not run
+u8 SystemProfileStatsForId(u32 systemId, SystemProfileStats* stats);
+
+// Stats for a system as it was before the last reload, returns 0 if it was not loaded then
+u8 PreviousSystemProfileStats(u32 systemId, SystemProfileStats* stats);
+
+// A table of every system, with the previous load alongside where there was one
+void DumpSystemProfiles(FILE* out);
+
+#endif
@@ -0,0 +1,421 @@
+#define NO_PRINT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "logging.h"
+
+#include "systemScheduler.h"
+#include "systemProfiler.h"
+#include "timing.h"
+#include "traceEvents.h"
+
+// A system's place in the schedule, systems are referred to by their index in the resolved order
+typedef struct
+{
+    SystemDescriptor* system;
+    u32 firstSuccessor; // Systems waiting on this one are in the scheduler's successors from here
+    u32 successorCount;
+    u32 predecessorCount; // How many systems this one waits for
+    u32 pending; // Predecessors still to finish this frame
+} ScheduledSystem;
+
+struct SystemSchedule
+{
+    SystemDescriptor* systems;
+    ScheduledSystem* scheduled;
+    u32 systemCount;
+    u32* successors;
+    u32 readyWordCount;
+    u64* readyWords; // Room for both of the scheduler's ready sets
+};
+
+// Ready systems are a bit each so the lowest (earliest in the resolved order, which puts
+// the longest chains first) is always picked first
+typedef struct
+{
+    u64* words;
+    u32 count;
+} ReadySet;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t workReady; // Workers wait on this for something to run
+    pthread_cond_t frameProgress; // The main thread waits on this for something to run or the end of the frame
+
+    pthread_t workers[MAX_SCHEDULER_WORKERS];
+    u32 workerCount;
+    u8 started;
+    u8 stopping;
+
+    // Copied from the schedule in use
+    ScheduledSystem* scheduled;
+    u32 systemCount;
+    u32* successors;
+    u32 readyWordCount;
+
+    // The frame in progress
+    World* world;
+    ReadySet readyForAnyThread;
+    ReadySet readyForMainThread;
+    u32 completedCount;
+    u32 runningCount;
+    u32 peakRunningCount;
+    double busyMs;
+    u32 accessViolations;
+
+    ScheduleFrameStats lastFrame;
+} SystemScheduler;
+
+static SystemScheduler scheduler =
+{
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .workReady = PTHREAD_COND_INITIALIZER,
+    .frameProgress = PTHREAD_COND_INITIALIZER,
+};
+
+static inline void AddReadySystem(ReadySet* ready, u32 idx)
+{
+    ready->words[idx >> 6] |= ((u64)1 << (idx & 63));
+    ready->count++;
+}
+
+static inline u32 PopLowestSystem(ReadySet* ready)
+{
+    u32 word = 0;
+    while(!ready->words[word])
+	word++;
+
+    u32 idx = (word << 6) + __builtin_ctzll(ready->words[word]);
+    ready->words[word] &= ready->words[word] - 1;
+    ready->count--;
+    return idx;
+}
+
+static inline void ClearReadySet(ReadySet* ready)
+{
+    memset(ready->words, 0, scheduler.readyWordCount * sizeof(u64));
+    ready->count = 0;
+}
+
+// Everything its predecessors needed is done, put it where the right thread will find it
+// Called with the lock held
+static inline void MakeSystemReady(u32 idx)
+{
+    if(scheduler.scheduled[idx].system->flags & SYSTEM_ON_MAIN_THREAD)
+    {
+	AddReadySystem(&scheduler.readyForMainThread, idx);
+	pthread_cond_signal(&scheduler.frameProgress);
+    }
+    else
+    {
+	AddReadySystem(&scheduler.readyForAnyThread, idx);
+	pthread_cond_signal(&scheduler.workReady);
+	pthread_cond_signal(&scheduler.frameProgress);
+    }
+}
+
+// Run a single system, the lock is held on the way in and out but not while the system runs
+static void RunScheduledSystem(u32 idx)
+{
+    ScheduledSystem* scheduled = &scheduler.scheduled[idx];
+    World* world = scheduler.world;
+
+    if(++scheduler.runningCount > scheduler.peakRunningCount)
+	scheduler.peakRunningCount = scheduler.runningCount;
+
+    pthread_mutex_unlock(&scheduler.lock);
+
+#ifdef CHECK_COMPONENT_ACCESS
+    // Nothing that writes these can be running alongside us, so any change is this system's doing
+    ComponentFlags readOnly = ComponentMaskWithout(scheduled->system->componentsRead, scheduled->system->componentsWritten);
+    u64 checksum = ChecksumComponentsInWorld(world, readOnly);
+#endif
+
+    u64 start = NowNs();
+    {
+	TRACE_ZONE_ID("System", scheduled->system->id);
+	scheduled->system->updateFunction(world);
+    }
+    u64 end = NowNs();
+    RecordSystemRun(idx, start, end);
+
+#ifdef CHECK_COMPONENT_ACCESS
+    u8 violated = (ChecksumComponentsInWorld(world, readOnly) != checksum);
+    if(violated)
+    {
+	DEBUG_ERR("System %d changed components it only declared as read "ComponentMaskPrintfSymbol, scheduled->system->id, ComponentMaskToPrintf(readOnly));
+    }
+#endif
+
+    pthread_mutex_lock(&scheduler.lock);
+
+    scheduler.runningCount--;
+    scheduler.busyMs += (double)(end - start) / NS_PER_MS;
+#ifdef CHECK_COMPONENT_ACCESS
+    scheduler.accessViolations += violated;
+#endif
+
+    // Let go of anything that was only waiting on us
+    u32* successor = &scheduler.successors[scheduled->firstSuccessor];
+    u32* lastSuccessor = successor + scheduled->successorCount;
+    for(; successor < lastSuccessor; ++successor)
+    {
+	if(!--scheduler.scheduled[*successor].pending)
+	    MakeSystemReady(*successor);
+    }
+
+    if(++scheduler.completedCount == scheduler.systemCount)
+	pthread_cond_signal(&scheduler.frameProgress);
+}
+
+static void* SchedulerWorker(void* unused)
+{
+    TRACE_THREAD_NAME("Scheduler worker");
+
+    pthread_mutex_lock(&scheduler.lock);
+    while(1)
+    {
+	while(!scheduler.readyForAnyThread.count && !scheduler.stopping)
+	    pthread_cond_wait(&scheduler.workReady, &scheduler.lock);
+
+	if(scheduler.stopping)
+	    break;
+
+	RunScheduledSystem(PopLowestSystem(&scheduler.readyForAnyThread));
+    }
+    pthread_mutex_unlock(&scheduler.lock);
+
+    return NULL;
+}
+
+void StartSystemScheduler(u32 workerCount)
+{
+    if(scheduler.started)
+	return;
+
+    if(!workerCount)
+    {
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	workerCount = (cores > 1) ? (u32)(cores - 1) : 0;
+    }
+
+    if(workerCount > MAX_SCHEDULER_WORKERS)
+	workerCount = MAX_SCHEDULER_WORKERS;
+
+    scheduler.stopping = 0;
+    scheduler.workerCount = 0;
+    while(scheduler.workerCount < workerCount)
+    {
+	if(pthread_create(&scheduler.workers[scheduler.workerCount], NULL, &SchedulerWorker, NULL))
+	{
+	    DEBUG_ERR("Unable to start scheduler worker %d, carrying on with what we have", scheduler.workerCount);
+	    break;
+	}
+	scheduler.workerCount++;
+    }
+
+    scheduler.started = 1;
+    DEBUG_LOG("System scheduler started with %d workers", scheduler.workerCount);
+}
+
+void StopSystemScheduler()
+{
+    if(!scheduler.started)
+	return;
+
+    pthread_mutex_lock(&scheduler.lock);
+    scheduler.stopping = 1;
+    pthread_cond_broadcast(&scheduler.workReady);
+    pthread_mutex_unlock(&scheduler.lock);
+
+    while(scheduler.workerCount)
+	pthread_join(scheduler.workers[--scheduler.workerCount], NULL);
+
+    scheduler.started = 0;
+}
+
+// Can't run at the same time if either one writes something the other touches
+static inline u8 SystemsConflict(SystemDescriptor* a, SystemDescriptor* b)
+{
+    return ComponentMaskOverlaps(a->componentsWritten, ComponentMaskUnion(b->componentsRead, b->componentsWritten)) ||
+	ComponentMaskOverlaps(b->componentsWritten, a->componentsRead);
+}
+
+static inline u8 SystemDependsOn(SystemDescriptor* system, u32 id)
+{
+    u32 dependency;
+    for(dependency = 0; dependency < system->dependencyCount; ++dependency)
+    {
+	if(system->dependsOn[dependency] == id)
+	    return 1;
+    }
+    return 0;
+}
+
+SystemSchedule* BuildSystemSchedule(SystemDescriptor* systems, u32 systemCount)
+{
+    TRACE_ZONE("BuildSystemSchedule");
+
+    SystemSchedule* schedule = malloc(sizeof(SystemSchedule));
+    schedule->systems = systems;
+    schedule->systemCount = systemCount;
+    schedule->scheduled = calloc(systemCount + 1, sizeof(ScheduledSystem));
+    schedule->readyWordCount = (systemCount + 63) / 64 + 1;
+    schedule->readyWords = calloc(schedule->readyWordCount * 2, sizeof(u64));
+
+    u32 successorCount = 0;
+    u32 successorCapacity = systemCount;
+    u32* successors = malloc((successorCapacity + 1) * sizeof(u32));
+    ScheduledSystem* scheduled = schedule->scheduled;
+
+    u32 idx, later;
+    for(idx = 0; idx < systemCount; ++idx)
+    {
+	scheduled[idx].system = &systems[idx];
+	scheduled[idx].firstSuccessor = successorCount;
+
+	// Systems are already in dependency order so anything waiting on this one is later,
+	// conflicting systems keep that order too so a frame always gives the same result
+	for(later = idx + 1; later < systemCount; ++later)
+	{
+	    if(!SystemDependsOn(&systems[later], systems[idx].id) && !SystemsConflict(&systems[later], &systems[idx]))
+		continue;
+
+	    if(successorCount == successorCapacity)
+	    {
+		successorCapacity *= 2;
+		successors = realloc(successors, successorCapacity * sizeof(u32));
+	    }
+	    successors[successorCount++] = later;
+	    scheduled[later].predecessorCount++;
+	}
+
+	scheduled[idx].successorCount = successorCount - scheduled[idx].firstSuccessor;
+    }
+    schedule->successors = successors;
+
+    for(idx = 0; idx < systemCount; ++idx)
+    {
+	DEBUG_LOG("Scheduled system %u waits for %u others", systems[idx].id, scheduled[idx].predecessorCount);
+    }
+
+    return schedule;
+}
+
+void FreeSystemSchedule(SystemSchedule* schedule)
+{
+    if(!schedule)
+	return;
+
+    free(schedule->scheduled);
+    free(schedule->successors);
+    free(schedule->readyWords);
+    free(schedule);
+}
+
+void UseSystemSchedule(SystemSchedule* schedule)
+{
+    // Workers only look at the graph while a frame is running but they are never left
+    // with half of one
+    pthread_mutex_lock(&scheduler.lock);
+
+    scheduler.scheduled = schedule->scheduled;
+    scheduler.systemCount = schedule->systemCount;
+    scheduler.successors = schedule->successors;
+    scheduler.readyWordCount = schedule->readyWordCount;
+    scheduler.readyForAnyThread.words = schedule->readyWords;
+    scheduler.readyForAnyThread.count = 0;
+    scheduler.readyForMainThread.words = schedule->readyWords + schedule->readyWordCount;
+    scheduler.readyForMainThread.count = 0;
+
+    pthread_mutex_unlock(&scheduler.lock);
+
+    ResetSystemProfiles(schedule->systems, schedule->systemCount);
+}
+
+static inline u8 SystemInPhase(SystemDescriptor* system, SchedulePhase phase)
+{
+    if(phase == AllSystems)
+	return 1;
+
+    return ((system->flags & SYSTEM_EVERY_FRAME) != 0) == (phase == FrameSystems);
+}
+
+void RunSystemSchedule(World* world, SchedulePhase phase)
+{
+    if(!scheduler.started)
+	StartSystemScheduler(0);
+
+    u64 frameStart = NowNs();
+
+    pthread_mutex_lock(&scheduler.lock);
+
+    scheduler.world = world;
+    scheduler.completedCount = 0;
+    scheduler.runningCount = 0;
+    scheduler.peakRunningCount = 0;
+    scheduler.busyMs = 0;
+    scheduler.accessViolations = 0;
+    ClearReadySet(&scheduler.readyForAnyThread);
+    ClearReadySet(&scheduler.readyForMainThread);
+
+    u32 idx;
+    for(idx = 0; idx < scheduler.systemCount; ++idx)
+	scheduler.scheduled[idx].pending = scheduler.scheduled[idx].predecessorCount;
+
+    // Systems from the other phase are finished as far as this run is concerned
+    u32 runCount = 0;
+    for(idx = 0; idx < scheduler.systemCount; ++idx)
+    {
+	if(SystemInPhase(scheduler.scheduled[idx].system, phase))
+	{
+	    runCount++;
+	    continue;
+	}
+
+	u32 successor;
+	for(successor = 0; successor < scheduler.scheduled[idx].successorCount; ++successor)
+	    scheduler.scheduled[scheduler.successors[scheduler.scheduled[idx].firstSuccessor + successor]].pending--;
+	scheduler.completedCount++;
+    }
+
+    for(idx = 0; idx < scheduler.systemCount; ++idx)
+    {
+	if(SystemInPhase(scheduler.scheduled[idx].system, phase) && !scheduler.scheduled[idx].pending)
+	    MakeSystemReady(idx);
+    }
+
+    // The main thread works too, its own systems first so nothing else has to wait on them
+    while(scheduler.completedCount < scheduler.systemCount)
+    {
+	if(scheduler.readyForMainThread.count)
+	    RunScheduledSystem(PopLowestSystem(&scheduler.readyForMainThread));
+	else if(scheduler.readyForAnyThread.count)
+	    RunScheduledSystem(PopLowestSystem(&scheduler.readyForAnyThread));
+	else
+	    pthread_cond_wait(&scheduler.frameProgress, &scheduler.lock);
+    }
+
+    ScheduleFrameStats* stats = &scheduler.lastFrame;
+    stats->systemCount = runCount;
+    stats->threadCount = scheduler.workerCount + 1;
+    stats->peakConcurrency = scheduler.peakRunningCount;
+    stats->wallMs = (float)(NowNs() - frameStart) / NS_PER_MS;
+    stats->busyMs = (float)scheduler.busyMs;
+    stats->parallelism = (stats->wallMs > 0) ? (stats->busyMs / stats->wallMs) : 0;
+    stats->accessViolations = scheduler.accessViolations;
+
+    pthread_mutex_unlock(&scheduler.lock);
+
+    DEBUG_LOG("Ran %d systems on %d threads in %.3fms, parallelism %.2f (peak %d at once)", stats->systemCount, stats->threadCount, stats->wallMs, stats->parallelism, stats->peakConcurrency);
+}
+
+ScheduleFrameStats LastScheduleFrameStats()
+{
+    return scheduler.lastFrame;
+}
@@ -0,0 +1,69 @@
+#ifndef __SYSTEM_SCHEDULER_H__
+#define __SYSTEM_SCHEDULER_H__
+
+#include "types.h"
+#include "entityComponentSystem.h"
+
+// Runs each frame's systems across a pool of threads. Every loaded system is a node in a
+// graph, it has to wait for the systems it depends on and for any system earlier in the
+// resolved order which writes something it reads or reads something it writes. Everything
+// else is free to run at the same time, so readers of a component share it while a writer
+// gets it alone. The thread calling RunSystemSchedule joins in and is the only one
+// allowed to run SYSTEM_ON_MAIN_THREAD systems.
+//
+// Debug builds (or CHECK_COMPONENT_ACCESS) checksum the components a system only reads
+// around every run and count it as a violation if they changed
+#define MAX_SCHEDULER_WORKERS (15)
+
+#if defined(DEBUG) && !defined(CHECK_COMPONENT_ACCESS)
+#define CHECK_COMPONENT_ACCESS
+#endif
+
+// How well the last frame was spread over the threads, parallelism is the time spent
+// running systems divided by how long the frame took, 1 means they may as well have run
+// one after another
+typedef struct
+{
+    u32 systemCount; // How many actually ran
+    u32 threadCount; // Workers plus the main thread
+    u32 peakConcurrency; // Most systems running at once
+    float wallMs;
+    float busyMs;
+    float parallelism;
+    u32 accessViolations; // Systems caught writing something they said they only read
+} ScheduleFrameStats;
+
+// Passing 0 workers uses one per core, not counting the main thread. Running a schedule
+// starts the threads if this has not been called
+void StartSystemScheduler(u32 workerCount);
+void StopSystemScheduler();
+
+// The graph for a set of systems which are already in dependency order. Building one
+// doesn't touch anything the scheduler is using so it can happen on any thread, eg while
+// a new systems library is being prepared. The systems are not copied so must stay put
+// until the schedule is freed
+typedef struct SystemSchedule SystemSchedule;
+
+SystemSchedule* BuildSystemSchedule(SystemDescriptor* systems, u32 systemCount);
+void FreeSystemSchedule(SystemSchedule* schedule);
+
+// Runs schedule from the next frame on and starts its systems' profiles afresh. Only call
+// this between frames from the thread that calls RunSystemSchedule, the schedule is swapped
+// in under the scheduler's lock but a frame part way through would be left running systems
+// from both. The old schedule can be freed once this returns
+void UseSystemSchedule(SystemSchedule* schedule);
+
+// Which systems to run, systems left out count as done so nothing waits for them
+typedef enum
+{
+    AllSystems = 0,
+    SimulationSystems, // Everything without SYSTEM_EVERY_FRAME
+    FrameSystems, // Only SYSTEM_EVERY_FRAME systems
+} SchedulePhase;
+
+// Runs the phase's systems once, returns when they have all finished
+void RunSystemSchedule(World* world, SchedulePhase phase);
+
+ScheduleFrameStats LastScheduleFrameStats();
+
+#endif
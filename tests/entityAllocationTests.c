@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "entityComponentSystem.h"
+
+// Once a world has grown to fit its entities, creating, looking up, moving and destroying
+// them shouldn't touch the heap at all. Linked with every allocator wrapped (see the test
+// target in the Makefile) so we can count what the engine asks for
+#define TEST_ENTITIES (5000)
+#define TEST_CYCLES (50)
+
+static u64 allocations;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* pointer, size_t size);
+void* __real_aligned_alloc(size_t alignment, size_t size);
+int __real_posix_memalign(void** pointer, size_t alignment, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+    allocations++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size)
+{
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* pointer, size_t size)
+{
+    allocations++;
+    return __real_realloc(pointer, size);
+}
+
+void* __wrap_aligned_alloc(size_t alignment, size_t size)
+{
+    allocations++;
+    return __real_aligned_alloc(alignment, size);
+}
+
+int __wrap_posix_memalign(void** pointer, size_t alignment, size_t size)
+{
+    allocations++;
+    return __real_posix_memalign(pointer, alignment, size);
+}
+
+static EntityId entities[TEST_ENTITIES];
+
+// Spawns everything, looks each one up every way there is, moves them between archetypes
+// and back and destroys them all again. Returns how many lookups found the wrong thing
+static u32 RunCycle(World* world)
+{
+    u32 failures = 0;
+    u32 idx;
+    for(idx = 0; idx < TEST_ENTITIES; ++idx)
+    {
+	entities[idx] = NewEntityInWorld(world, GetComponentFlag(Position));
+	Entity entity = EntityFromWorld(world, entities[idx]);
+	EntityField(&entity, position, x) = (float)idx;
+    }
+
+    // Every other entity gets moved to an archetype with more components
+    for(idx = 0; idx < TEST_ENTITIES; idx += 2)
+    {
+	AddComponentsToEntityInWorld(world, entities[idx], ComponentMaskOf(GetComponentId(Velocity), GetComponentId(Health)));
+	HealthForEntityInWorld(world, entities[idx])->hp = idx;
+    }
+
+    for(idx = 0; idx < TEST_ENTITIES; ++idx)
+    {
+	Entity entity = EntityFromWorld(world, entities[idx]);
+	PositionArray position = PositionForEntityInWorld(world, entities[idx]);
+	Health* health = HealthForEntityInWorld(world, entities[idx]);
+	if(EntityField(&entity, position, x) != (float)idx || !PositionArrayIsPresent(position))
+	    failures++;
+	if((idx & 1) ? (health != NULL) : (!health || health->hp != (int)idx))
+	    failures++;
+    }
+
+    // And back again, then everything goes
+    for(idx = 0; idx < TEST_ENTITIES; idx += 2)
+	RemoveComponentsFromEntityInWorld(world, entities[idx], ComponentMaskOf(GetComponentId(Velocity), GetComponentId(Health)));
+    for(idx = 0; idx < TEST_ENTITIES; ++idx)
+	DestroyEntityInWorld(world, entities[idx]);
+
+    return failures;
+}
+
+int main()
+{
+    World* world = CreateWorld(16);
+
+    // The first cycle grows the world to fit
+    u32 failures = RunCycle(world);
+    u64 warmAllocations = allocations;
+
+    u32 cycle;
+    for(cycle = 0; cycle < TEST_CYCLES; ++cycle)
+	failures += RunCycle(world);
+    u64 allocationsAfterWarm = allocations - warmAllocations;
+
+    if(failures)
+	printf("Entity lookups: %u found the wrong thing\n", failures);
+    if(allocationsAfterWarm)
+	printf("Entity cycles: %llu allocations in %u cycles once warm\n", (unsigned long long)allocationsAfterWarm, TEST_CYCLES);
+    else
+	printf("Entity cycles: no allocations in %u cycles of %u entities once warm\n", TEST_CYCLES, TEST_ENTITIES);
+
+    return (failures || allocationsAfterWarm) ? 1 : 0;
+}
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+#include "entityComponentSystem.h"
+#include "movementKernels.h"
+
+// Runs every kernel level the CPU supports over the same entities as the scalar kernels and
+// checks they come out bit for bit the same. Covers whichever layout this was built with,
+// make test builds it both ways
+#ifdef SOA_COMPONENTS
+#define LAYOUT_NAME "split"
+#else
+#define LAYOUT_NAME "struct per entity"
+#endif
+
+// Position and Velocity
+#define FLOATS_PER_ENTITY (6)
+
+#define TEST_ENTITIES (3000)
+#define TEST_STEPS (3)
+#define TEST_DT (1.0f / 60.0f)
+
+// Enough to leave every possible remainder for the widest kernels (16 floats of one field
+// split, 4 velocities a register otherwise)
+#define MAX_TAIL_COUNT (33)
+
+// Asking for a level the CPU can't do gives back a lower one, so name them ourselves
+static const char* levelNames[__KERNEL_LEVEL_COUNT__] = {"scalar", "SSE2", "AVX2", "AVX-512"};
+
+static u32 randomState = 0x2545f491;
+
+static u32 NextRandom()
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+// Mostly ordinary values with everything the lanes have to agree on mixed in
+static float TestFloat()
+{
+    switch(NextRandom() % 16)
+    {
+    case 0: return NAN;
+    case 1: return -NAN;
+    case 2: return 0.0f;
+    case 3: return -0.0f;
+    case 4: return INFINITY;
+    case 5: return -INFINITY;
+    case 6: return FLT_MIN / 8.0f; // Denormal
+    case 7: return FLT_MAX;
+    default: return ((float)(NextRandom() % 40000) - 20000.0f) / 64.0f;
+    }
+}
+
+// The arrays the kernels touch in a batch and how many floats each holds
+static u32 BatchFloatArrays(EntityBatch* batch, float** arrays, u32* counts)
+{
+#ifdef SOA_COMPONENTS
+    float* fields[FLOATS_PER_ENTITY] = {batch->positions.x, batch->positions.y, batch->velocities.vx, batch->velocities.vy, batch->velocities.vxMax, batch->velocities.vyMax};
+    u32 field;
+    for(field = 0; field < FLOATS_PER_ENTITY; ++field)
+    {
+	arrays[field] = fields[field];
+	counts[field] = batch->entityCount;
+    }
+    return FLOATS_PER_ENTITY;
+#else
+    arrays[0] = (float*)batch->positions;
+    counts[0] = batch->entityCount * (sizeof(Position) / sizeof(float));
+    arrays[1] = (float*)batch->velocities;
+    counts[1] = batch->entityCount * (sizeof(Velocity) / sizeof(float));
+    return 2;
+#endif
+}
+
+// Copies every float the kernels could have touched to or from a flat buffer
+static void CopyWorldFloats(World* world, float* buffer, u8 toWorld)
+{
+    BatchQuery query = BeginBatchQuery(world, ComponentMaskOf(GetComponentId(Position), GetComponentId(Velocity)));
+    while(NextBatchInQuery(&query))
+    {
+	float* arrays[FLOATS_PER_ENTITY];
+	u32 counts[FLOATS_PER_ENTITY];
+	u32 arrayCount = BatchFloatArrays(query.batch, arrays, counts);
+	u32 array;
+	for(array = 0; array < arrayCount; ++array)
+	{
+	    if(toWorld)
+		memcpy(arrays[array], buffer, counts[array] * sizeof(float));
+	    else
+		memcpy(buffer, arrays[array], counts[array] * sizeof(float));
+	    buffer += counts[array];
+	}
+    }
+}
+
+// A few simulation steps the way the systems run them, only the first limit entities of
+// each batch so the kernels' leftovers get tested too
+static void RunKernels(World* world, MovementKernels kernels, u32 limit)
+{
+    u32 step;
+    for(step = 0; step < TEST_STEPS; ++step)
+    {
+	BatchQuery query = BeginBatchQuery(world, ComponentMaskOf(GetComponentId(Position), GetComponentId(Velocity)));
+	while(NextBatchInQuery(&query))
+	{
+	    u32 count = (query.batch->entityCount < limit) ? query.batch->entityCount : limit;
+	    kernels.applyGravity(query.batch->velocities, count, TEST_DT);
+	    kernels.moveEntities(query.batch->positions, query.batch->velocities, count, TEST_DT);
+	    kernels.clampVelocities(query.batch->velocities, count);
+	}
+    }
+}
+
+// Returns the first float which differs, or floatCount if they all match. Any NaN
+// matches any other, see MovementKernels
+static u32 FirstDifference(float* expected, float* actual, u32 floatCount)
+{
+    u32 idx;
+    for(idx = 0; idx < floatCount; ++idx)
+    {
+	if(isnan(expected[idx]) && isnan(actual[idx]))
+	    continue;
+	if(memcmp(&expected[idx], &actual[idx], sizeof(float)))
+	    return idx;
+    }
+    return floatCount;
+}
+
+int main()
+{
+    World* world = CreateWorld(TEST_ENTITIES);
+
+    u32 idx;
+    for(idx = 0; idx < TEST_ENTITIES; ++idx)
+    {
+	EntityId entityId = NewEntityInWorld(world, ComponentMaskOf(GetComponentId(Position), GetComponentId(Velocity)));
+	Entity entity = EntityFromWorld(world, entityId);
+	EntityField(&entity, position, x) = TestFloat();
+	EntityField(&entity, position, y) = TestFloat();
+	EntityField(&entity, velocity, vx) = TestFloat();
+	EntityField(&entity, velocity, vy) = TestFloat();
+	EntityField(&entity, velocity, vxMax) = TestFloat();
+	EntityField(&entity, velocity, vyMax) = TestFloat();
+    }
+
+    u32 floatCount = TEST_ENTITIES * FLOATS_PER_ENTITY;
+    float* initial = malloc(floatCount * sizeof(float));
+    float* expected = malloc(floatCount * sizeof(float));
+    float* actual = malloc(floatCount * sizeof(float));
+    CopyWorldFloats(world, initial, 0);
+
+    KernelLevel supported = SupportedKernelLevel();
+    u32 failures = 0;
+
+    KernelLevel level;
+    for(level = KernelsSSE2; level < __KERNEL_LEVEL_COUNT__; ++level)
+    {
+	MovementKernels kernels = MovementKernelsForLevel(level);
+	if(level > supported)
+	{
+	    printf("%-8s %s: not supported by this CPU, skipped\n", levelNames[level], LAYOUT_NAME);
+	    continue;
+	}
+
+	// Every batch whole, then every short count
+	u32 limit;
+	u32 levelFailures = 0;
+	for(limit = 0; limit <= MAX_TAIL_COUNT + 1; ++limit)
+	{
+	    u32 entityLimit = (limit > MAX_TAIL_COUNT) ? TEST_ENTITIES : limit;
+
+	    CopyWorldFloats(world, initial, 1);
+	    RunKernels(world, MovementKernelsForLevel(KernelsScalar), entityLimit);
+	    CopyWorldFloats(world, expected, 0);
+
+	    CopyWorldFloats(world, initial, 1);
+	    RunKernels(world, kernels, entityLimit);
+	    CopyWorldFloats(world, actual, 0);
+
+	    u32 difference = FirstDifference(expected, actual, floatCount);
+	    if(difference != floatCount)
+	    {
+		if(entityLimit == TEST_ENTITIES)
+		    printf("%-8s %s: whole batches, float %u is %a, scalar gave %a\n", levelNames[level], LAYOUT_NAME, difference, actual[difference], expected[difference]);
+		else
+		    printf("%-8s %s: %u entities a batch, float %u is %a, scalar gave %a\n", levelNames[level], LAYOUT_NAME, entityLimit, difference, actual[difference], expected[difference]);
+		levelFailures++;
+	    }
+	}
+
+	if(!levelFailures)
+	    printf("%-8s %s: matches scalar\n", levelNames[level], LAYOUT_NAME);
+	failures += levelFailures;
+    }
+
+    free(initial);
+    free(expected);
+    free(actual);
+
+    return failures ? 1 : 0;
+}
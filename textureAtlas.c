@@ -0,0 +1,492 @@
+#define NO_PRINT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+
+#include "textureAtlas.h"
+#include "traceEvents.h"
+
+#define BYTES_PER_PIXEL (4)
+#define NO_ATLAS_PAGE (0xffffffff) // Marks regions which are free to reuse
+
+// One step of a page's skyline, everything from x to x + width is filled up to y
+typedef struct
+{
+    u32 x;
+    u32 y;
+    u32 width;
+} SkylineNode;
+
+typedef struct
+{
+    GLuint texture;
+    u32 width;
+    u32 height;
+    u8 dedicated; // Holds one image which was too big to pack
+    SkylineNode* skyline;
+    u32 nodeCount;
+    u64 usedArea;
+} AtlasPage;
+
+u32 atlasGeneration;
+
+static AtlasPage* pages;
+static u32 pageCount;
+static u32 pageCapacity;
+
+static AtlasRegion* regions;
+static u32 regionCount; // Including free ones
+static u32 regionCapacity;
+static u32* freeRegions;
+static u32 freeRegionCount;
+
+static u32 repackCount;
+static u64 wasteAfterRepack; // Only worth repacking again once there is a lot more waste than this
+
+static inline u32 PaddedSize(u32 size)
+{
+    return size + (2 * ATLAS_PADDING);
+}
+
+static GLuint CreatePageTexture(u32 width, u32 height)
+{
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    DEBUG_LOG("Created %ux%u atlas page %u - %d", width, height, texture, glGetError());
+    return texture;
+}
+
+static u32 AddPage(u32 width, u32 height, u8 dedicated)
+{
+    if(pageCount == pageCapacity)
+    {
+	pageCapacity = pageCapacity ? pageCapacity * 2 : 4;
+	pages = realloc(pages, pageCapacity * sizeof(AtlasPage));
+    }
+
+    AtlasPage* page = &pages[pageCount];
+    page->texture = CreatePageTexture(width, height);
+    page->width = width;
+    page->height = height;
+    page->dedicated = dedicated;
+    page->usedArea = 0;
+    // Every node starts at a different x so a page never has more nodes than columns, plus
+    // one while a new node is going in
+    page->skyline = dedicated ? NULL : malloc((width + 1) * sizeof(SkylineNode));
+    page->nodeCount = 1;
+    if(page->skyline)
+	page->skyline[0] = (SkylineNode){0, 0, width};
+
+    return pageCount++;
+}
+
+// Where an image would sit if its left edge went at this node, it has to clear every node
+// it spans. Returns 0 if it would go off the page
+static u8 SkylineFits(AtlasPage* page, u32 node, u32 width, u32 height, u32* y)
+{
+    u32 x = page->skyline[node].x;
+    if(x + width > page->width)
+	return 0;
+
+    u32 top = 0;
+    s32 widthLeft = width;
+    while(widthLeft > 0)
+    {
+	if(page->skyline[node].y > top)
+	    top = page->skyline[node].y;
+	if(top + height > page->height)
+	    return 0;
+	widthLeft -= page->skyline[node].width;
+	node++;
+    }
+
+    *y = top;
+    return 1;
+}
+
+// Lowest top edge wins, then the narrowest step so wide gaps are kept for wide images
+static u8 FindSpaceInPage(AtlasPage* page, u32 width, u32 height, u32* bestNode, u32* bestY)
+{
+    u32 bestTop = 0xffffffff;
+    u32 bestWidth = 0xffffffff;
+    u32 node, y;
+    for(node = 0; node < page->nodeCount; ++node)
+    {
+	if(!SkylineFits(page, node, width, height, &y))
+	    continue;
+	if(y + height < bestTop || (y + height == bestTop && page->skyline[node].width < bestWidth))
+	{
+	    bestTop = y + height;
+	    bestWidth = page->skyline[node].width;
+	    *bestNode = node;
+	    *bestY = y;
+	}
+    }
+    return bestTop != 0xffffffff;
+}
+
+static void RaiseSkyline(AtlasPage* page, u32 node, u32 y, u32 width, u32 height)
+{
+    SkylineNode placed = {page->skyline[node].x, y + height, width};
+
+    memmove(&page->skyline[node + 1], &page->skyline[node], (page->nodeCount - node) * sizeof(SkylineNode));
+    page->skyline[node] = placed;
+    page->nodeCount++;
+
+    // Cut back or drop the nodes the new one now covers
+    u32 next = node + 1;
+    while(next < page->nodeCount)
+    {
+	u32 coveredTo = placed.x + placed.width;
+	if(page->skyline[next].x >= coveredTo)
+	    break;
+
+	u32 overlap = coveredTo - page->skyline[next].x;
+	if(overlap < page->skyline[next].width)
+	{
+	    page->skyline[next].x += overlap;
+	    page->skyline[next].width -= overlap;
+	    break;
+	}
+	memmove(&page->skyline[next], &page->skyline[next + 1], (page->nodeCount - next - 1) * sizeof(SkylineNode));
+	page->nodeCount--;
+    }
+
+    // Neighbours at the same height are one step
+    for(next = 1; next < page->nodeCount; ++next)
+    {
+	if(page->skyline[next - 1].y == page->skyline[next].y)
+	{
+	    page->skyline[next - 1].width += page->skyline[next].width;
+	    memmove(&page->skyline[next], &page->skyline[next + 1], (page->nodeCount - next - 1) * sizeof(SkylineNode));
+	    page->nodeCount--;
+	    next--;
+	}
+    }
+
+    page->usedArea += (u64)width * height;
+}
+
+static void SetRegionPlacement(AtlasRegion* region, u32 pageIdx, u32 x, u32 y)
+{
+    AtlasPage* page = &pages[pageIdx];
+    region->texture = page->texture;
+    region->page = pageIdx;
+    region->x = x;
+    region->y = y;
+    region->uv.u0 = (float)x / page->width;
+    region->uv.v0 = (float)y / page->height;
+    region->uv.u1 = (float)(x + region->width) / page->width;
+    region->uv.v1 = (float)(y + region->height) / page->height;
+}
+
+// Finds room for a region with its border on any packed page, starting a new page if none
+// of them have it. Only sets where it goes, the pixels are up to the caller
+static void PackRegion(AtlasRegion* region, u8 allowNewPage, u8* packed)
+{
+    u32 width = PaddedSize(region->width);
+    u32 height = PaddedSize(region->height);
+
+    u32 pageIdx, node, y;
+    for(pageIdx = 0; pageIdx < pageCount; ++pageIdx)
+    {
+	if(!pages[pageIdx].dedicated && FindSpaceInPage(&pages[pageIdx], width, height, &node, &y))
+	    break;
+    }
+
+    if(pageIdx == pageCount)
+    {
+	*packed = 0;
+	if(!allowNewPage)
+	    return;
+	pageIdx = AddPage(ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE, 0);
+	FindSpaceInPage(&pages[pageIdx], width, height, &node, &y);
+    }
+
+    u32 x = pages[pageIdx].skyline[node].x;
+    RaiseSkyline(&pages[pageIdx], node, y, width, height);
+    SetRegionPlacement(region, pageIdx, x + ATLAS_PADDING, y + ATLAS_PADDING);
+    *packed = 1;
+}
+
+// The image with every edge pixel repeated out into the border
+static u8* PadImage(const u8* pixels, u32 width, u32 height)
+{
+    u32 paddedWidth = PaddedSize(width);
+    u32 paddedHeight = PaddedSize(height);
+    u8* padded = malloc(paddedWidth * paddedHeight * BYTES_PER_PIXEL);
+
+    u32 row;
+    for(row = 0; row < paddedHeight; ++row)
+    {
+	u32 fromRow = (row < ATLAS_PADDING) ? 0 : (row - ATLAS_PADDING >= height) ? height - 1 : row - ATLAS_PADDING;
+	const u8* from = pixels + (fromRow * width * BYTES_PER_PIXEL);
+	u8* to = padded + (row * paddedWidth * BYTES_PER_PIXEL);
+
+	u32 column;
+	for(column = 0; column < ATLAS_PADDING; ++column)
+	{
+	    memcpy(to + (column * BYTES_PER_PIXEL), from, BYTES_PER_PIXEL);
+	    memcpy(to + ((ATLAS_PADDING + width + column) * BYTES_PER_PIXEL), from + ((width - 1) * BYTES_PER_PIXEL), BYTES_PER_PIXEL);
+	}
+	memcpy(to + (ATLAS_PADDING * BYTES_PER_PIXEL), from, width * BYTES_PER_PIXEL);
+    }
+
+    return padded;
+}
+
+static u64 WastedArea()
+{
+    u64 wasted = 0;
+    u32 pageIdx;
+    for(pageIdx = 0; pageIdx < pageCount; ++pageIdx)
+    {
+	if(!pages[pageIdx].dedicated)
+	    wasted += ((u64)pages[pageIdx].width * pages[pageIdx].height) - pages[pageIdx].usedArea;
+    }
+    return wasted;
+}
+
+static int CompareRegionHeights(const void* a, const void* b)
+{
+    const AtlasRegion* left = &regions[*(const u32*)a];
+    const AtlasRegion* right = &regions[*(const u32*)b];
+    if(left->height != right->height)
+	return (left->height < right->height) - (left->height > right->height);
+    return (left->width < right->width) - (left->width > right->width);
+}
+
+// Gives back pages nothing is using any more, only page indices change so regions keep
+// their texture and UVs
+static void RemoveEmptyPages()
+{
+    u32* newIdx = malloc(pageCount * sizeof(u32));
+    u32 pageIdx, keptCount = 0;
+    for(pageIdx = 0; pageIdx < pageCount; ++pageIdx)
+    {
+	if(pages[pageIdx].usedArea)
+	{
+	    newIdx[pageIdx] = keptCount;
+	    pages[keptCount++] = pages[pageIdx];
+	    continue;
+	}
+
+	DEBUG_LOG("Deleting empty atlas page %u", pages[pageIdx].texture);
+	glDeleteTextures(1, &pages[pageIdx].texture);
+	free(pages[pageIdx].skyline);
+	newIdx[pageIdx] = NO_ATLAS_PAGE;
+    }
+
+    if(keptCount != pageCount)
+    {
+	u32 regionIdx;
+	for(regionIdx = 0; regionIdx < regionCount; ++regionIdx)
+	{
+	    if(regions[regionIdx].page != NO_ATLAS_PAGE)
+		regions[regionIdx].page = newIdx[regions[regionIdx].page];
+	}
+	pageCount = keptCount;
+
+	u64 wasted = WastedArea();
+	if(wasted < wasteAfterRepack)
+	    wasteAfterRepack = wasted;
+    }
+
+    free(newIdx);
+}
+
+// Packs every image on the shared pages again tallest first. The old pages are read back
+// whole before anything moves so images can be copied straight from where they were
+static void RepackAtlas()
+{
+    TRACE_ZONE("RepackAtlas");
+
+    u32 packedPageCount = pageCount;
+    u8** oldPixels = calloc(packedPageCount, sizeof(u8*));
+    u32 pageIdx;
+    for(pageIdx = 0; pageIdx < packedPageCount; ++pageIdx)
+    {
+	AtlasPage* page = &pages[pageIdx];
+	if(page->dedicated)
+	    continue;
+	oldPixels[pageIdx] = malloc((u64)page->width * page->height * BYTES_PER_PIXEL);
+	glBindTexture(GL_TEXTURE_2D, page->texture);
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, oldPixels[pageIdx]);
+
+	page->skyline[0] = (SkylineNode){0, 0, page->width};
+	page->nodeCount = 1;
+	page->usedArea = 0;
+    }
+
+    u32* order = malloc(regionCount * sizeof(u32));
+    u32 packedCount = 0, regionIdx;
+    for(regionIdx = 0; regionIdx < regionCount; ++regionIdx)
+    {
+	if(regions[regionIdx].page != NO_ATLAS_PAGE && !pages[regions[regionIdx].page].dedicated)
+	    order[packedCount++] = regionIdx;
+    }
+    qsort(order, packedCount, sizeof(u32), &CompareRegionHeights);
+
+    for(regionIdx = 0; regionIdx < packedCount; ++regionIdx)
+    {
+	AtlasRegion* region = &regions[order[regionIdx]];
+	AtlasPage* oldPage = &pages[region->page];
+	u32 oldPageIdx = region->page;
+	u32 oldX = region->x - ATLAS_PADDING;
+	u32 oldY = region->y - ATLAS_PADDING;
+	u32 oldWidth = oldPage->width;
+
+	u8 packed;
+	PackRegion(region, 1, &packed);
+
+	glBindTexture(GL_TEXTURE_2D, region->texture);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, oldWidth);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, region->x - ATLAS_PADDING, region->y - ATLAS_PADDING, PaddedSize(region->width), PaddedSize(region->height), GL_RGBA, GL_UNSIGNED_BYTE, oldPixels[oldPageIdx] + ((((u64)oldY * oldWidth) + oldX) * BYTES_PER_PIXEL));
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+    for(pageIdx = 0; pageIdx < packedPageCount; ++pageIdx)
+	free(oldPixels[pageIdx]);
+    free(oldPixels);
+    free(order);
+
+    RemoveEmptyPages();
+    wasteAfterRepack = WastedArea();
+    repackCount++;
+    atlasGeneration++;
+    DEBUG_LOG("Repacked %u images into %u pages - %d", packedCount, pageCount, glGetError());
+}
+
+// Skyline packing in load order leaves gaps under short images and freed images leave holes,
+// once that adds up to a good part of a page it is worth sorting everything and starting
+// again. Returns 1 if it repacked
+static u8 RepackIfWasteful(u64 needArea)
+{
+    u64 wasted = WastedArea();
+    if(wasted < needArea || wasted < wasteAfterRepack + ((u64)ATLAS_PAGE_SIZE * ATLAS_PAGE_SIZE / 4))
+	return 0;
+
+    RepackAtlas();
+    return 1;
+}
+
+u32 AddImageToAtlas(const u8* pixels, u32 width, u32 height)
+{
+    if(!width || !height || width > 0xffff || height > 0xffff)
+    {
+	DEBUG_ERR("Can't add a %ux%u image to the atlas", width, height);
+	return NO_ATLAS_REGION;
+    }
+
+    u32 regionIdx;
+    if(freeRegionCount)
+    {
+	regionIdx = freeRegions[--freeRegionCount];
+    }
+    else
+    {
+	if(regionCount == regionCapacity)
+	{
+	    regionCapacity = regionCapacity ? regionCapacity * 2 : 64;
+	    regions = realloc(regions, regionCapacity * sizeof(AtlasRegion));
+	    freeRegions = realloc(freeRegions, regionCapacity * sizeof(u32));
+	}
+	regionIdx = regionCount++;
+    }
+    AtlasRegion* region = &regions[regionIdx];
+    region->width = width;
+    region->height = height;
+    region->page = NO_ATLAS_PAGE; // Keeps it out of a repack until it has a place
+
+    if(width > ATLAS_MAX_PACKED_SIZE || height > ATLAS_MAX_PACKED_SIZE)
+    {
+	u32 pageIdx = AddPage(width, height, 1);
+	SetRegionPlacement(region, pageIdx, 0, 0);
+	pages[pageIdx].usedArea = (u64)width * height;
+	glBindTexture(GL_TEXTURE_2D, region->texture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	return regionIdx;
+    }
+
+    u8 packed;
+    PackRegion(region, 0, &packed);
+    if(!packed)
+    {
+	RepackIfWasteful((u64)PaddedSize(width) * PaddedSize(height));
+	PackRegion(region, 1, &packed);
+    }
+
+    u8* padded = PadImage(pixels, width, height);
+    glBindTexture(GL_TEXTURE_2D, region->texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, region->x - ATLAS_PADDING, region->y - ATLAS_PADDING, PaddedSize(width), PaddedSize(height), GL_RGBA, GL_UNSIGNED_BYTE, padded);
+    free(padded);
+    DEBUG_LOG("Packed %ux%u image at %u,%u in page %u - %d", width, height, region->x, region->y, region->page, glGetError());
+
+    return regionIdx;
+}
+
+// The space only becomes usable again after a repack, unless it empties the page
+void RemoveImageFromAtlas(u32 regionIdx)
+{
+    AtlasRegion* region = &regions[regionIdx];
+    AtlasPage* page = &pages[region->page];
+    if(page->dedicated)
+	page->usedArea = 0;
+    else
+	page->usedArea -= (u64)PaddedSize(region->width) * PaddedSize(region->height);
+
+    region->page = NO_ATLAS_PAGE;
+    freeRegions[freeRegionCount++] = regionIdx;
+
+    if(!page->usedArea)
+	RemoveEmptyPages();
+}
+
+u8 CompactTextureAtlas()
+{
+    return RepackIfWasteful(0);
+}
+
+AtlasRegion AtlasRegionFor(u32 region)
+{
+    return regions[region];
+}
+
+AtlasStats CurrentAtlasStats()
+{
+    AtlasStats stats = {pageCount, regionCount - freeRegionCount, repackCount, 0, 0};
+    u32 pageIdx;
+    for(pageIdx = 0; pageIdx < pageCount; ++pageIdx)
+    {
+	stats.pageBytes += (u64)pages[pageIdx].width * pages[pageIdx].height * BYTES_PER_PIXEL;
+	stats.usedBytes += pages[pageIdx].usedArea * BYTES_PER_PIXEL;
+    }
+    return stats;
+}
+
+void FreeTextureAtlas()
+{
+    u32 pageIdx;
+    for(pageIdx = 0; pageIdx < pageCount; ++pageIdx)
+    {
+	glDeleteTextures(1, &pages[pageIdx].texture);
+	free(pages[pageIdx].skyline);
+    }
+    free(pages);
+    free(regions);
+    free(freeRegions);
+    pages = NULL;
+    regions = NULL;
+    freeRegions = NULL;
+    pageCount = pageCapacity = 0;
+    regionCount = regionCapacity = freeRegionCount = 0;
+}
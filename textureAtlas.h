@@ -0,0 +1,68 @@
+#ifndef __TEXTURE_ATLAS_H__
+#define __TEXTURE_ATLAS_H__
+
+#include <GL/gl.h>
+
+#include "types.h"
+
+// Packs images into a few big textures (pages) so sprites using different images can
+// still be drawn together. Each page is packed with a skyline, the top edge of everything
+// placed so far, and a new image goes wherever it leaves that edge lowest.
+//
+// Every image gets a 1 pixel border copied from its own edge so linear filtering at the
+// edge of a sprite doesn't pick up its neighbours. Images too big to share a page get one
+// to themselves.
+//
+// When nothing has room for a new image and the pages are wasting enough space, every
+// image is repacked tallest first, which wastes a lot less than packing in load order and
+// fills the holes left by removed images. That moves images about, so atlasGeneration goes
+// up and anything keeping hold of a region's texture and UVs should look the region up
+// again. Pages are deleted as soon as nothing is left on them
+#define ATLAS_PAGE_SIZE (2048)
+#define ATLAS_MAX_PACKED_SIZE (ATLAS_PAGE_SIZE / 2) // Bigger than this in either direction gets its own page
+#define ATLAS_PADDING (1)
+#define NO_ATLAS_REGION (0xffffffff)
+
+typedef struct
+{
+    float u0;
+    float v0;
+    float u1;
+    float v1;
+} TextureRect;
+
+typedef struct
+{
+    GLuint texture;
+    TextureRect uv;
+    u32 page;
+    u16 x; // Where the image starts in its page, inside the border
+    u16 y;
+    u16 width;
+    u16 height;
+} AtlasRegion;
+
+typedef struct
+{
+    u32 pageCount;
+    u32 regionCount;
+    u32 repackCount;
+    u64 pageBytes; // Texture memory used by all the pages
+    u64 usedBytes; // How much of that is images and their borders
+} AtlasStats;
+
+// Bumped every time regions move or a texture which was loading gets its region
+extern u32 atlasGeneration;
+
+// Copies RGBA pixels into the atlas and returns the region they went in. Has to be called
+// on the thread owning the GL context
+u32 AddImageToAtlas(const u8* pixels, u32 width, u32 height);
+// The region id may be handed out again by the next AddImageToAtlas
+void RemoveImageFromAtlas(u32 region);
+// Repacks if removed images have left enough holes, returns 1 if it did
+u8 CompactTextureAtlas();
+AtlasRegion AtlasRegionFor(u32 region);
+AtlasStats CurrentAtlasStats();
+void FreeTextureAtlas();
+
+#endif
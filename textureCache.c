@@ -0,0 +1,367 @@
+#define NO_PRINT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "logging.h"
+
+#include "textureCache.h"
+#include "textureAtlas.h"
+
+#define BYTES_PER_PIXEL (4)
+#define EMPTY_SLOT (NO_TEXTURE_HANDLE)
+
+// Entry 0 is never a texture, its links are the ends of the unreferenced list. Oldest
+// release is next from it, newest is previous
+typedef struct
+{
+    char* path; // NULL for free entries
+    u64 hash;
+    u32 atlasRegion;
+    u32 width;
+    u32 height;
+    u32 refCount;
+    u8 pending; // Still being decoded, has no region and can't be evicted
+    u32 lruPrev;
+    u32 lruNext; // Also links free entries
+} CachedTexture;
+
+static CachedTexture* entries;
+static u32 entryCount = 1;
+static u32 entryCapacity;
+static u32 firstFreeEntry;
+
+// Handles, at most half full so probes stay short
+static TextureHandle* slots;
+static u32 slotCapacity;
+
+static TextureCacheStats stats = {0, 0, 0, 0, DEFAULT_TEXTURE_BUDGET_BYTES, 0, 0, 0};
+
+// References dropped off the GL thread, protected by the lock. Only the handles are
+// queued, nothing else in the cache is touched until they are released
+static pthread_mutex_t queuedReleaseLock = PTHREAD_MUTEX_INITIALIZER;
+static TextureHandle* queuedReleases;
+static u32 queuedReleaseCount;
+static u32 queuedReleaseCapacity;
+
+// FNV-1a
+static u64 HashPath(const char* path)
+{
+    u64 hash = 0xcbf29ce484222325;
+    while(*path)
+    {
+	hash ^= (u8)*path++;
+	hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+static inline u32 SlotFor(u64 hash)
+{
+    return (u32)(hash ^ (hash >> 32)) & (slotCapacity - 1);
+}
+
+static void InsertIntoSlots(TextureHandle texture)
+{
+    u32 slot = SlotFor(entries[texture].hash);
+    while(slots[slot] != EMPTY_SLOT)
+	slot = (slot + 1) & (slotCapacity - 1);
+    slots[slot] = texture;
+}
+
+static void GrowSlots()
+{
+    TextureHandle* oldSlots = slots;
+    u32 oldCapacity = slotCapacity;
+
+    slotCapacity = slotCapacity ? slotCapacity * 2 : 256;
+    slots = calloc(slotCapacity, sizeof(TextureHandle));
+
+    u32 slot;
+    for(slot = 0; slot < oldCapacity; ++slot)
+    {
+	if(oldSlots[slot] != EMPTY_SLOT)
+	    InsertIntoSlots(oldSlots[slot]);
+    }
+    free(oldSlots);
+}
+
+// Linear probing without tombstones, anything after the hole which could have gone in it
+// is moved back so every chain stays unbroken
+static void RemoveFromSlots(TextureHandle texture)
+{
+    u32 hole = SlotFor(entries[texture].hash);
+    while(slots[hole] != texture)
+	hole = (hole + 1) & (slotCapacity - 1);
+
+    u32 slot = hole;
+    while(1)
+    {
+	slot = (slot + 1) & (slotCapacity - 1);
+	if(slots[slot] == EMPTY_SLOT)
+	    break;
+
+	// Only move it if its home isn't between the hole and where it is now
+	u32 home = SlotFor(entries[slots[slot]].hash);
+	if(((slot - home) & (slotCapacity - 1)) >= ((slot - hole) & (slotCapacity - 1)))
+	{
+	    slots[hole] = slots[slot];
+	    hole = slot;
+	}
+    }
+    slots[hole] = EMPTY_SLOT;
+}
+
+static inline u64 TextureBytes(CachedTexture* entry)
+{
+    return (u64)entry->width * entry->height * BYTES_PER_PIXEL;
+}
+
+static void UnlinkUnreferenced(TextureHandle texture)
+{
+    entries[entries[texture].lruPrev].lruNext = entries[texture].lruNext;
+    entries[entries[texture].lruNext].lruPrev = entries[texture].lruPrev;
+    stats.unreferencedCount--;
+}
+
+static void LinkUnreferenced(TextureHandle texture)
+{
+    entries[texture].lruPrev = entries[0].lruPrev;
+    entries[texture].lruNext = 0;
+    entries[entries[0].lruPrev].lruNext = texture;
+    entries[0].lruPrev = texture;
+    stats.unreferencedCount++;
+}
+
+static void EvictTexture(TextureHandle texture)
+{
+    CachedTexture* entry = &entries[texture];
+    DEBUG_LOG("Evicting texture \"%s\"", entry->path);
+
+    UnlinkUnreferenced(texture);
+    RemoveFromSlots(texture);
+    if(entry->atlasRegion != NO_ATLAS_REGION)
+	RemoveImageFromAtlas(entry->atlasRegion);
+
+    stats.residentBytes -= TextureBytes(entry);
+    stats.textureCount--;
+    stats.evictions++;
+
+    free(entry->path);
+    entry->path = NULL;
+    entry->lruNext = firstFreeEntry;
+    firstFreeEntry = texture;
+}
+
+// Oldest unreferenced first until we fit, then close up the holes that left in the atlas
+static void EvictOverBudget()
+{
+    u32 evicted = 0;
+    while(stats.residentBytes > stats.budgetBytes && entries[0].lruNext)
+    {
+	EvictTexture(entries[0].lruNext);
+	evicted++;
+    }
+
+    if(evicted)
+    {
+	CompactTextureAtlas();
+	DEBUG_LOG("Evicted %u textures, %llu bytes left", evicted, (unsigned long long)stats.residentBytes);
+    }
+}
+
+TextureHandle FindCachedTexture(const char* path)
+{
+    if(slotCapacity)
+    {
+	u64 hash = HashPath(path);
+	u32 slot = SlotFor(hash);
+	while(slots[slot] != EMPTY_SLOT)
+	{
+	    TextureHandle texture = slots[slot];
+	    if(entries[texture].hash == hash && strcmp(entries[texture].path, path) == 0)
+	    {
+		stats.hits++;
+		RetainTexture(texture);
+		return texture;
+	    }
+	    slot = (slot + 1) & (slotCapacity - 1);
+	}
+    }
+
+    stats.misses++;
+    return NO_TEXTURE_HANDLE;
+}
+
+static TextureHandle NewCachedTexture(const char* path)
+{
+    TextureHandle texture = firstFreeEntry;
+    if(texture)
+    {
+	firstFreeEntry = entries[texture].lruNext;
+    }
+    else
+    {
+	if(entryCount >= entryCapacity)
+	{
+	    entryCapacity = entryCapacity ? entryCapacity * 2 : 256;
+	    entries = realloc(entries, entryCapacity * sizeof(CachedTexture));
+	    if(entryCount == 1)
+		entries[0] = (CachedTexture){NULL, 0, NO_ATLAS_REGION, 0, 0, 0, 0, 0, 0};
+	}
+	texture = entryCount++;
+    }
+
+    CachedTexture* entry = &entries[texture];
+    entry->path = malloc(strlen(path) + 1);
+    strcpy(entry->path, path);
+    entry->hash = HashPath(path);
+    entry->atlasRegion = NO_ATLAS_REGION;
+    entry->width = 0;
+    entry->height = 0;
+    entry->refCount = 1;
+    entry->pending = 0;
+
+    if((stats.textureCount + 1) * 2 > slotCapacity)
+	GrowSlots();
+    InsertIntoSlots(texture);
+    stats.textureCount++;
+
+    return texture;
+}
+
+TextureHandle AddCachedTexture(const char* path, u32 atlasRegion, u32 width, u32 height)
+{
+    TextureHandle texture = NewCachedTexture(path);
+    FinishTextureLoad(texture, atlasRegion, width, height);
+    return texture;
+}
+
+TextureHandle AddPendingTexture(const char* path)
+{
+    TextureHandle texture = NewCachedTexture(path);
+    entries[texture].pending = 1;
+    stats.pendingCount++;
+    return texture;
+}
+
+void FinishTextureLoad(TextureHandle texture, u32 atlasRegion, u32 width, u32 height)
+{
+    CachedTexture* entry = &entries[texture];
+    entry->atlasRegion = atlasRegion;
+    entry->width = (atlasRegion == NO_ATLAS_REGION) ? 0 : width;
+    entry->height = (atlasRegion == NO_ATLAS_REGION) ? 0 : height;
+    stats.residentBytes += TextureBytes(entry);
+
+    if(entry->pending)
+    {
+	entry->pending = 0;
+	stats.pendingCount--;
+	if(!entry->refCount)
+	    LinkUnreferenced(texture);
+    }
+
+    EvictOverBudget();
+}
+
+u8 TextureIsPending(TextureHandle texture)
+{
+    return entries[texture].pending;
+}
+
+void RetainTexture(TextureHandle texture)
+{
+    if(!entries[texture].refCount++ && !entries[texture].pending)
+	UnlinkUnreferenced(texture);
+}
+
+void ReleaseTexture(TextureHandle texture)
+{
+    if(!entries[texture].refCount)
+    {
+	DEBUG_ERR("Texture \"%s\" released more times than it was retained", entries[texture].path);
+	return;
+    }
+
+    if(!--entries[texture].refCount && !entries[texture].pending)
+	LinkUnreferenced(texture);
+}
+
+void QueueTextureRelease(TextureHandle texture)
+{
+    pthread_mutex_lock(&queuedReleaseLock);
+    if(queuedReleaseCount >= queuedReleaseCapacity)
+    {
+	queuedReleaseCapacity = queuedReleaseCapacity ? queuedReleaseCapacity * 2 : 256;
+	queuedReleases = realloc(queuedReleases, queuedReleaseCapacity * sizeof(TextureHandle));
+    }
+    queuedReleases[queuedReleaseCount++] = texture;
+    pthread_mutex_unlock(&queuedReleaseLock);
+}
+
+// Nothing else takes the lock on this thread so releasing with it held is fine, and the
+// workers queueing are only held up for as long as a few unlinks take
+u32 ReleaseQueuedTextures()
+{
+    pthread_mutex_lock(&queuedReleaseLock);
+    u32 released = queuedReleaseCount;
+    u32 release;
+    for(release = 0; release < released; ++release)
+	ReleaseTexture(queuedReleases[release]);
+    queuedReleaseCount = 0;
+    pthread_mutex_unlock(&queuedReleaseLock);
+
+    return released;
+}
+
+u32 CachedTextureRegion(TextureHandle texture)
+{
+    return entries[texture].atlasRegion;
+}
+
+void CachedTextureSize(TextureHandle texture, u32* width, u32* height)
+{
+    *width = entries[texture].width;
+    *height = entries[texture].height;
+}
+
+const char* CachedTexturePath(TextureHandle texture)
+{
+    return entries[texture].path;
+}
+
+void SetTextureBudget(u64 bytes)
+{
+    stats.budgetBytes = bytes;
+    EvictOverBudget();
+}
+
+TextureCacheStats CurrentTextureCacheStats()
+{
+    return stats;
+}
+
+// Only frees the cache, the atlas still has to be freed
+void FreeTextureCache()
+{
+    u32 texture;
+    for(texture = 1; texture < entryCount; ++texture)
+	free(entries[texture].path);
+    free(entries);
+    free(slots);
+
+    pthread_mutex_lock(&queuedReleaseLock);
+    free(queuedReleases);
+    queuedReleases = NULL;
+    queuedReleaseCount = queuedReleaseCapacity = 0;
+    pthread_mutex_unlock(&queuedReleaseLock);
+
+    entries = NULL;
+    slots = NULL;
+    entryCount = 1;
+    entryCapacity = slotCapacity = 0;
+    firstFreeEntry = 0;
+    stats = (TextureCacheStats){0, 0, 0, 0, stats.budgetBytes, 0, 0, 0};
+}
@@ -0,0 +1,67 @@
+#ifndef __TEXTURE_CACHE_H__
+#define __TEXTURE_CACHE_H__
+
+#include "types.h"
+
+// Every loaded texture by path. The cache keeps its own copy of each path and finds them
+// through an open addressed hash table, so a lookup is a hash and usually one strcmp.
+//
+// Textures are reference counted, whoever gets a handle from FindCachedTexture or
+// AddCachedTexture owns a reference and gives it back with ReleaseTexture (a Renderable
+// does this itself when it is removed). Textures nothing references stay loaded in case
+// they are wanted again, but once the cache holds more than its budget the ones released
+// longest ago are evicted from the atlas until it fits. Textures still in use are never
+// evicted, so the budget can be exceeded if everything is in use.
+//
+// Not thread safe, everything has to happen on the thread owning the GL context. The one
+// exception is QueueTextureRelease, for references dropped on other threads (a Renderable
+// removed by a system on a worker), they are only given back when the GL thread calls
+// ReleaseQueuedTextures
+#define NO_TEXTURE_HANDLE (0)
+#define DEFAULT_TEXTURE_BUDGET_BYTES (256ull * 1024 * 1024)
+
+typedef u32 TextureHandle;
+
+typedef struct
+{
+    u32 textureCount;
+    u32 unreferencedCount; // Loaded but only kept in case they come back
+    u32 pendingCount; // Still being loaded
+    u64 residentBytes;
+    u64 budgetBytes;
+    u32 hits;
+    u32 misses;
+    u32 evictions;
+} TextureCacheStats;
+
+// Returns NO_TEXTURE_HANDLE if the path isn't loaded
+TextureHandle FindCachedTexture(const char* path);
+TextureHandle AddCachedTexture(const char* path, u32 atlasRegion, u32 width, u32 height);
+
+// For textures loaded in the background, the entry is there straight away so anything
+// asking for the same path shares it. It has no atlas region until FinishTextureLoad, which
+// is also how a failed load is recorded (with NO_ATLAS_REGION). Pending textures are never
+// evicted
+TextureHandle AddPendingTexture(const char* path);
+void FinishTextureLoad(TextureHandle texture, u32 atlasRegion, u32 width, u32 height);
+u8 TextureIsPending(TextureHandle texture);
+
+void RetainTexture(TextureHandle texture);
+void ReleaseTexture(TextureHandle texture);
+// Safe from any thread
+void QueueTextureRelease(TextureHandle texture);
+// Once a frame on the GL thread, returns how many it released
+u32 ReleaseQueuedTextures();
+
+// NO_ATLAS_REGION if the texture is pending or failed to load
+u32 CachedTextureRegion(TextureHandle texture);
+void CachedTextureSize(TextureHandle texture, u32* width, u32* height);
+const char* CachedTexturePath(TextureHandle texture);
+
+// Evicts straight away if the cache is already over the new budget
+void SetTextureBudget(u64 bytes);
+TextureCacheStats CurrentTextureCacheStats();
+// Queued releases are dropped, their handles mean nothing once the cache is gone
+void FreeTextureCache();
+
+#endif
@@ -0,0 +1,270 @@
+#define NO_PRINT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "logging.h"
+
+#include "textureLoader.h"
+#include "textureAtlas.h"
+#include "traceEvents.h"
+#include "timing.h"
+#include "stb_image.h"
+
+#define BYTES_PER_PIXEL (4)
+
+typedef struct DecodeJob
+{
+    struct DecodeJob* next;
+    TextureHandle texture;
+    u8* pixels; // NULL if it failed to decode
+    int width;
+    int height;
+    char path[];
+} DecodeJob;
+
+typedef struct
+{
+    DecodeJob* first;
+    DecodeJob* last;
+    u32 count;
+} DecodeJobList;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t jobQueued;
+
+    pthread_t threads[MAX_TEXTURE_LOADER_THREADS];
+    u32 threadCount;
+    u8 started;
+    u8 stopping;
+
+    // Both protected by the lock, jobs go from waiting to decoded in whatever order the
+    // threads finish them
+    DecodeJobList waiting;
+    DecodeJobList decoded;
+} TextureLoader;
+
+static TextureLoader loader =
+{
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .jobQueued = PTHREAD_COND_INITIALIZER,
+};
+
+static TextureLoaderStats lastStats;
+static u32 failedLoads;
+
+static void PushJob(DecodeJobList* list, DecodeJob* job)
+{
+    job->next = NULL;
+    if(list->last)
+	list->last->next = job;
+    else
+	list->first = job;
+    list->last = job;
+    list->count++;
+}
+
+static DecodeJob* PopJob(DecodeJobList* list)
+{
+    DecodeJob* job = list->first;
+    if(!job)
+	return NULL;
+
+    list->first = job->next;
+    if(!list->first)
+	list->last = NULL;
+    list->count--;
+    return job;
+}
+
+static void FreeJob(DecodeJob* job)
+{
+    stbi_image_free(job->pixels);
+    free(job);
+}
+
+static void DecodeJobPixels(DecodeJob* job)
+{
+    TRACE_ZONE("DecodeTexture");
+    int componentsPerPixel;
+    job->pixels = stbi_load(job->path, &job->width, &job->height, &componentsPerPixel, BYTES_PER_PIXEL);
+}
+
+static void* TextureLoaderThread(void* unused)
+{
+    TRACE_THREAD_NAME("Texture loader");
+
+    pthread_mutex_lock(&loader.lock);
+    while(1)
+    {
+	while(!loader.waiting.first && !loader.stopping)
+	    pthread_cond_wait(&loader.jobQueued, &loader.lock);
+	if(loader.stopping)
+	    break;
+
+	DecodeJob* job = PopJob(&loader.waiting);
+	pthread_mutex_unlock(&loader.lock);
+
+	DecodeJobPixels(job);
+
+	pthread_mutex_lock(&loader.lock);
+	PushJob(&loader.decoded, job);
+    }
+    pthread_mutex_unlock(&loader.lock);
+
+    return NULL;
+}
+
+void StartTextureLoader(u32 threadCount)
+{
+    if(loader.started)
+	return;
+
+    if(!threadCount)
+    {
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	threadCount = (cores > 1) ? (u32)(cores / 2) : 1;
+    }
+
+    if(threadCount > MAX_TEXTURE_LOADER_THREADS)
+	threadCount = MAX_TEXTURE_LOADER_THREADS;
+
+    loader.stopping = 0;
+    loader.threadCount = 0;
+    while(loader.threadCount < threadCount)
+    {
+	if(pthread_create(&loader.threads[loader.threadCount], NULL, &TextureLoaderThread, NULL))
+	{
+	    DEBUG_ERR("Unable to start texture loader thread %d, carrying on with what we have", loader.threadCount);
+	    break;
+	}
+	loader.threadCount++;
+    }
+
+    loader.started = 1;
+    DEBUG_LOG("Texture loader started with %d threads", loader.threadCount);
+}
+
+void StopTextureLoader()
+{
+    if(!loader.started)
+	return;
+
+    pthread_mutex_lock(&loader.lock);
+    loader.stopping = 1;
+    pthread_cond_broadcast(&loader.jobQueued);
+    pthread_mutex_unlock(&loader.lock);
+
+    while(loader.threadCount)
+	pthread_join(loader.threads[--loader.threadCount], NULL);
+
+    DecodeJob* job;
+    while((job = PopJob(&loader.waiting)))
+	FreeJob(job);
+    while((job = PopJob(&loader.decoded)))
+	FreeJob(job);
+
+    loader.started = 0;
+}
+
+void QueueTextureDecode(TextureHandle texture, const char* path)
+{
+    StartTextureLoader(0);
+
+    DecodeJob* job = malloc(sizeof(DecodeJob) + strlen(path) + 1);
+    job->texture = texture;
+    job->pixels = NULL;
+    job->width = 0;
+    job->height = 0;
+    strcpy(job->path, path);
+
+    // If no thread would start there is nobody to decode it but us, it still waits for
+    // UploadDecodedTextures like the rest
+    if(!loader.threadCount)
+    {
+	DecodeJobPixels(job);
+	pthread_mutex_lock(&loader.lock);
+	PushJob(&loader.decoded, job);
+	pthread_mutex_unlock(&loader.lock);
+	return;
+    }
+
+    pthread_mutex_lock(&loader.lock);
+    PushJob(&loader.waiting, job);
+    pthread_cond_signal(&loader.jobQueued);
+    pthread_mutex_unlock(&loader.lock);
+}
+
+// A texture can be finished without us (eg a blocking LoadTexture of the same path) and
+// its handle reused, so only upload if it is still pending for the same path
+static inline u8 StillWanted(DecodeJob* job)
+{
+    return TextureIsPending(job->texture) && strcmp(CachedTexturePath(job->texture), job->path) == 0;
+}
+
+u32 UploadDecodedTextures(u64 budgetBytes)
+{
+    TRACE_ZONE("UploadTextures");
+
+    u64 startNs = NowNs();
+    TextureLoaderStats stats = {0, 0, 0, 0, 0, 0};
+
+    while(!stats.uploaded || stats.uploadedBytes < budgetBytes)
+    {
+	pthread_mutex_lock(&loader.lock);
+	DecodeJob* job = PopJob(&loader.decoded);
+	pthread_mutex_unlock(&loader.lock);
+	if(!job)
+	    break;
+
+	if(StillWanted(job))
+	{
+	    u32 atlasRegion = NO_ATLAS_REGION;
+	    if(job->pixels)
+	    {
+		atlasRegion = AddImageToAtlas(job->pixels, job->width, job->height);
+	    }
+	    else
+	    {
+		DEBUG_ERR("Failed to load texture \"%s\"", job->path);
+		failedLoads++;
+	    }
+
+	    FinishTextureLoad(job->texture, atlasRegion, job->width, job->height);
+	    stats.uploaded++;
+	    stats.uploadedBytes += (u64)job->width * job->height * BYTES_PER_PIXEL;
+	}
+
+	FreeJob(job);
+    }
+
+    // Renderables showing the placeholder look their texture up again
+    if(stats.uploaded)
+	atlasGeneration++;
+
+    pthread_mutex_lock(&loader.lock);
+    stats.waiting = loader.waiting.count;
+    stats.decoded = loader.decoded.count;
+    pthread_mutex_unlock(&loader.lock);
+
+    stats.uploadMs = (float)(NowNs() - startNs) / NS_PER_MS;
+    stats.failed = failedLoads;
+    lastStats = stats;
+
+    if(stats.uploaded)
+    {
+	DEBUG_LOG("Uploaded %u textures (%llu bytes) in %.2fms, %u waiting", stats.uploaded, (unsigned long long)stats.uploadedBytes, stats.uploadMs, stats.waiting + stats.decoded);
+    }
+
+    return stats.uploaded;
+}
+
+TextureLoaderStats LastTextureLoaderStats()
+{
+    return lastStats;
+}
@@ -0,0 +1,39 @@
+#ifndef __TEXTURE_LOADER_H__
+#define __TEXTURE_LOADER_H__
+
+#include "types.h"
+#include "textureCache.h"
+
+// Reads and decodes images on a few background threads so loading a level doesn't stall
+// the frame. Decoded pixels wait in a queue until the GL thread calls
+// UploadDecodedTextures, which packs them into the atlas, finishes their cache entries
+// and bumps atlasGeneration so renderables pick them up. Uploads are limited to a number
+// of bytes a frame so a big batch of images arriving at once is spread over a few frames
+#define MAX_TEXTURE_LOADER_THREADS (4)
+#define TEXTURE_UPLOAD_BUDGET_BYTES (4 * 1024 * 1024)
+
+typedef struct
+{
+    u32 waiting; // Queued but not decoded yet
+    u32 decoded; // Ready to upload
+    u32 uploaded; // Last call to UploadDecodedTextures
+    u64 uploadedBytes;
+    float uploadMs;
+    u32 failed; // Since the loader started
+} TextureLoaderStats;
+
+// Passing 0 threads uses half the cores. Queueing a decode starts the threads if this has
+// not been called. If none of them start, queued images are decoded on
+// the thread queueing them instead
+void StartTextureLoader(u32 threadCount);
+// Anything not uploaded yet is thrown away, its cache entry stays pending
+void StopTextureLoader();
+
+// The texture has to be pending in the cache, the path is copied
+void QueueTextureDecode(TextureHandle texture, const char* path);
+
+// Always uploads at least one texture if there is one waiting, returns how many it did
+u32 UploadDecodedTextures(u64 budgetBytes);
+TextureLoaderStats LastTextureLoaderStats();
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+#include <time.h>
+
+#include "types.h"
+
+#define NS_PER_SECOND (1000000000ull)
+#define NS_PER_MS (1000000ull)
+
+// Monotonic nanoseconds, only useful for measuring the time between two calls
+static inline u64 NowNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((u64)now.tv_sec * NS_PER_SECOND) + now.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,130 @@
+#define NO_PRINT
+
+#include "traceEvents.h"
+
+#ifdef TRACE_EVENTS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "logging.h"
+#include "timing.h"
+
+typedef struct
+{
+    const char* name;
+    s32 id;
+    u64 startNs;
+    u64 endNs;
+} TraceEvent;
+
+// Only the owning thread writes to one of these, the list of them is only touched under the lock
+typedef struct TraceThread
+{
+    struct TraceThread* next;
+    u32 tid;
+    const char* name;
+    u32 eventCount; // Every event since the thread started, the buffer wraps
+    TraceEvent events[TRACE_EVENTS_PER_THREAD];
+} TraceThread;
+
+static pthread_mutex_t traceThreadsLock = PTHREAD_MUTEX_INITIALIZER;
+static TraceThread* traceThreads;
+
+static __thread TraceThread* thisTraceThread;
+
+static TraceThread* GetTraceThread()
+{
+    if(thisTraceThread)
+	return thisTraceThread;
+
+    TraceThread* thread = malloc(sizeof(TraceThread));
+    thread->tid = (u32)syscall(SYS_gettid);
+    thread->name = NULL;
+    thread->eventCount = 0;
+
+    pthread_mutex_lock(&traceThreadsLock);
+    thread->next = traceThreads;
+    traceThreads = thread;
+    pthread_mutex_unlock(&traceThreadsLock);
+
+    thisTraceThread = thread;
+    return thread;
+}
+
+TraceZone BeginTraceZone(const char* name, s32 id)
+{
+    TraceZone zone = {name, id, NowNs()};
+    return zone;
+}
+
+void EndTraceZone(TraceZone* zone)
+{
+    u64 endNs = NowNs();
+    TraceThread* thread = GetTraceThread();
+
+    TraceEvent* event = &thread->events[thread->eventCount++ % TRACE_EVENTS_PER_THREAD];
+    event->name = zone->name;
+    event->id = zone->id;
+    event->startNs = zone->startNs;
+    event->endNs = endNs;
+}
+
+void NameTraceThread(const char* name)
+{
+    GetTraceThread()->name = name;
+}
+
+void WriteTraceEvents(const char* filename)
+{
+    FILE* file = fopen(filename, "w");
+    if(!file)
+    {
+	DEBUG_ERR("Unable to open %s to write the trace", filename);
+	return;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    u8 first = 1;
+
+    pthread_mutex_lock(&traceThreadsLock);
+    TraceThread* thread;
+    for(thread = traceThreads; thread; thread = thread->next)
+    {
+	if(thread->name)
+	{
+	    fprintf(file, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", thread->tid, thread->name);
+	    first = 0;
+	}
+
+	u32 eventIdx = (thread->eventCount > TRACE_EVENTS_PER_THREAD) ? (thread->eventCount - TRACE_EVENTS_PER_THREAD) : 0;
+	if(eventIdx)
+	{
+	    DEBUG_ERR("Thread %u traced %u events, only the last %d are kept", thread->tid, thread->eventCount, TRACE_EVENTS_PER_THREAD);
+	}
+
+	for(; eventIdx < thread->eventCount; ++eventIdx)
+	{
+	    TraceEvent* event = &thread->events[eventIdx % TRACE_EVENTS_PER_THREAD];
+
+	    // Timestamps and durations are in microseconds
+	    fprintf(file, "%s{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"name\":\"", first ? "" : ",\n", thread->tid, event->startNs / 1000.0, (event->endNs - event->startNs) / 1000.0);
+	    if(event->id >= 0)
+		fprintf(file, "%s %d\"}", event->name, event->id);
+	    else
+		fprintf(file, "%s\"}", event->name);
+	    first = 0;
+	}
+    }
+    pthread_mutex_unlock(&traceThreadsLock);
+
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    DEBUG_LOG("Wrote trace to %s", filename);
+}
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef __TRACE_EVENTS_H__
+#define __TRACE_EVENTS_H__
+
+#include "types.h"
+
+// Timeline zones written out as Chrome trace JSON, load the file in chrome://tracing or
+// ui.perfetto.dev to see what every thread was doing and where they waited on each other.
+//
+// A zone covers from where TRACE_ZONE is written to the end of the enclosing block. Each
+// thread keeps the last TRACE_EVENTS_PER_THREAD zones it finished in a buffer of its own so
+// recording never takes a lock.
+//
+// Only built with TRACE_EVENTS defined, otherwise every macro here is empty and none of
+// the arguments are evaluated
+#define TRACE_EVENTS_PER_THREAD (1 << 16)
+
+#ifdef TRACE_EVENTS
+
+typedef struct
+{
+    const char* name; // Has to outlive the trace, in practice a string literal
+    s32 id; // Shown after the name, -1 for none
+    u64 startNs;
+} TraceZone;
+
+TraceZone BeginTraceZone(const char* name, s32 id);
+void EndTraceZone(TraceZone* zone);
+
+void NameTraceThread(const char* name);
+
+// Only call once every other thread which traced anything has stopped
+void WriteTraceEvents(const char* filename);
+
+#define TRACE_ZONE_VARIABLE_(line) traceZone##line
+#define TRACE_ZONE_VARIABLE(line) TRACE_ZONE_VARIABLE_(line)
+
+#define TRACE_ZONE_ID(name, id) TraceZone TRACE_ZONE_VARIABLE(__LINE__) __attribute__((cleanup(EndTraceZone))) = BeginTraceZone(name, id)
+#define TRACE_ZONE(name) TRACE_ZONE_ID(name, -1)
+#define TRACE_THREAD_NAME(name) NameTraceThread(name)
+#define TRACE_WRITE(filename) WriteTraceEvents(filename)
+
+#else
+
+#define TRACE_ZONE_ID(name, id)
+#define TRACE_ZONE(name)
+#define TRACE_THREAD_NAME(name)
+#define TRACE_WRITE(filename)
+
+#endif
+
+#endif